@@ -0,0 +1,129 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#include "BackgroundWriter.h"
+#include <stdexcept>
+
+using namespace std;
+
+BackgroundWriter::BackgroundWriter(
+    size_t ringSize,
+    RecordHandler recordHandler,
+    FlushHandler flushHandler,
+    unsigned intervalMs):
+        ring(ringSize),
+        recordHandler(recordHandler),
+        flushHandler(flushHandler),
+        intervalMs(intervalMs),
+        wakeEvent(0),
+        thread(0),
+        stopping(0),
+        failed(0),
+        refused(0),
+        droppedFlushed(0)
+{
+    wakeEvent = CreateEvent(0, false, false, 0);
+    if(!wakeEvent)
+        throw runtime_error("CreateEvent failed");
+
+    thread = CreateThread(0, 0, threadProc, this, 0, 0);
+    if(!thread)
+    {
+        CloseHandle(wakeEvent);
+        throw runtime_error("CreateThread failed");
+    }
+
+    // The printer matters more than the writer
+    SetThreadPriority(thread, THREAD_PRIORITY_BELOW_NORMAL);
+}
+
+BackgroundWriter::~BackgroundWriter()
+{
+    stop();
+    CloseHandle(wakeEvent);
+}
+
+void BackgroundWriter::stop()
+{
+    if(!thread)
+        return;
+    InterlockedExchange(&stopping, 1);
+    SetEvent(wakeEvent);
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+    thread = 0;
+}
+
+bool BackgroundWriter::push(const void* a, size_t aSize, const void* b, size_t bSize)
+{
+    if(failed || stopping)
+    {
+        InterlockedIncrement(&refused);
+        return false;
+    }
+    if(!ring.push(a, aSize, b, bSize))
+        return false;
+
+    // Only pay for a wakeup when the thread is in danger of falling behind
+    if(ring.used() > ring.capacity() / 2)
+        SetEvent(wakeEvent);
+    return true;
+}
+
+DWORD WINAPI BackgroundWriter::threadProc(LPVOID param)
+{
+    BackgroundWriter* self = (BackgroundWriter*)param;
+    std::vector<char> record;
+    while(!self->stopping)
+    {
+        WaitForSingleObject(self->wakeEvent, self->intervalMs);
+        self->drain(record);
+    }
+    self->drain(record);
+    return 0;
+}
+
+void BackgroundWriter::drain(std::vector<char>& record)
+{
+    if(failed)
+        return;
+    try
+    {
+        bool any = false;
+        while(ring.pop(record))
+        {
+            if(record.empty())
+                recordHandler(0, 0);
+            else
+                recordHandler(&record[0], &record[0] + record.size());
+            any = true;
+        }
+
+        // A drop is worth a flush of its own, so it's recorded even if nothing follows it
+        unsigned dropped = getDropped();
+        if(any || dropped != droppedFlushed)
+        {
+            droppedFlushed = dropped;
+            flushHandler();
+        }
+    }
+    catch(exception& e)
+    {
+        error = e.what();
+        InterlockedExchange(&failed, 1);
+    }
+}
@@ -0,0 +1,75 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#pragma once
+
+#include "RecordRing.h"
+#include <functional>
+#include <string>
+
+// Consumes one record; runs on the background thread
+typedef std::function<void(const char* begin, const char* end)> RecordHandler;
+
+// Called after each batch of records, and when records were dropped; runs on the background thread
+typedef std::function<void()> FlushHandler;
+
+// Owns a RecordRing and a thread which drains it. The producer side (push) never blocks;
+// the thread wakes up every intervalMs, or sooner if the ring is getting full.
+class BackgroundWriter
+{
+private:
+    RecordRing ring;                            // Records waiting to be handled
+    RecordHandler recordHandler;                // Called for each record
+    FlushHandler flushHandler;                  // Called after each batch
+    unsigned intervalMs;                        // Maximum time between batches
+    HANDLE wakeEvent;                           // Wakes thread early
+    HANDLE thread;                              // Background thread
+    volatile LONG stopping;                     // Thread should drain and exit
+    volatile LONG failed;                       // A handler threw; further records are dropped
+    volatile LONG refused;                      // Records dropped because of that
+    std::string error;                          // What the handler threw; valid once failed is set
+    unsigned droppedFlushed;                    // getDropped() at the last flush; only used by the thread
+
+public:
+    BackgroundWriter(
+        size_t ringSize,                        // Bytes
+        RecordHandler recordHandler,
+        FlushHandler flushHandler,
+        unsigned intervalMs);
+    ~BackgroundWriter();                        // Drains remaining records
+
+public:
+    // Queue a record made of up to two pieces. Returns false if it was dropped.
+    bool push(const void* a, size_t aSize, const void* b = 0, size_t bSize = 0);
+
+    // Number of records dropped because the ring was full or a handler had failed
+    unsigned getDropped() const {return ring.getDropped() + (unsigned)refused;}
+
+    // Handle the remaining records and stop the thread; nothing more is handled after this.
+    // Call it before getFailed() to hear about the last batch.
+    void stop();
+
+    // Has a handler failed? If so, getError() describes it.
+    bool getFailed() const {return failed != 0;}
+    const std::string& getError() const {return error;}
+
+private:
+    static DWORD WINAPI threadProc(LPVOID param);
+
+    // Handle everything in the ring
+    void drain(std::vector<char>& record);
+};
@@ -0,0 +1,865 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#include "Benchmarks.h"
+#include "CommandTable.h"
+#include "EventLoop.h"
+#include "GCodeLexer.h"
+#include "GCodeSender.h"
+#include "IocpSerial.h"
+#include "LoopbackFirmware.h"
+#include "NoisyTransport.h"
+#include "PrintEstimator.h"
+#include "Reactor.h"
+#include "Serial.h"
+#include "SimulatedPrinter.h"
+#include "TcpTransport.h"
+#include <algorithm>
+#include <stdexcept>
+
+using namespace std;
+
+const char* benchmarkNames = "noise, estop, poll, reactor, iocp, tcp, lexer, preparse, estimate";
+
+// A job of short extruding moves, so the link rather than the planner limits the rate
+static string makeLinkBoundJob(unsigned lines, size_t& payload)
+{
+    string job = "G90\nM82\nG92 E0\nG1 X100 Y100 F12000\n";
+    payload = job.size() - 4;
+    double e = 0;
+    char buf[80];
+    for(unsigned i = 0; i < lines; ++i)
+    {
+        e += 0.01;
+        int n = sprintf(buf, "G1 X%.3f Y%.3f E%.5f F6000\n", 100 + (i % 100) * 0.2, 100 + (i / 100 % 2) * 0.2, e);
+        job.append(buf, n);
+        payload += n - 1;
+    }
+    return job;
+}
+
+struct NoiseRun
+{
+    bool stalled;
+    double seconds;                             // Until the sender finished
+    unsigned faults;
+    SenderStats sender;
+};
+
+static NoiseRun runNoise(const string& job, const SenderOptions& options, const NoiseConfig& noise, const SimulatorConfig& simulator)
+{
+    VirtualClock clock;
+    NoisyTransport* noisy = 0;
+    GCodeSender sender(
+        clock,
+        [&](LineHandler receivedLine, StatusWriter statusWriter) -> unique_ptr<Transport> {
+            noisy = new NoisyTransport(
+                noise,
+                [&](LineHandler receivedLine, StatusWriter statusWriter) -> unique_ptr<Transport> {
+                    return unique_ptr<Transport>(new SimulatedPrinter(clock, simulator, receivedLine, statusWriter));},
+                receivedLine,
+                statusWriter);
+            return unique_ptr<Transport>(noisy);
+        },
+        unique_ptr<LineSource>(new TextLineSource(job.data(), job.data() + job.size())),
+        options);
+
+    vector<Event> events = sender.getEvents();
+    events.insert(events.end(), clock.getEvents().begin(), clock.getEvents().end());
+
+    NoiseRun run;
+    run.stalled = false;
+    try
+    {
+        runEventLoop(events, [&](){return sender.getDone();}, true);
+    }
+    catch(exception&)
+    {
+        run.stalled = true;
+    }
+    run.seconds = clock.now() / 1000000.0;
+    run.faults = noisy->getFaults();
+    run.sender = sender.getStats();
+    return run;
+}
+
+// Goodput and recovery cost of each sending strategy under each kind of line noise
+static void noiseBenchmark()
+{
+    struct Strategy
+    {
+        const char* name;
+        SenderOptions options;
+    };
+    Strategy stopAndWait = {"stop-and-wait"};
+    stopAndWait.options.timeoutMs = 1000;
+    stopAndWait.options.onReset = resetContinue;    // Injected resets are noise; the simulated firmware keeps its state
+    Strategy streaming = {"streaming, as with flow control"};
+    streaming.options = stopAndWait.options;
+    streaming.options.window = maxWindow;
+    Strategy strategies[] = {stopAndWait, streaming};
+
+    struct Scenario
+    {
+        const char* name;
+        double NoiseConfig::*rate;
+        double value;
+    };
+    Scenario scenarios[] = {
+        {"clean",                   0,                          0},
+        {"bit flips 1e-5/byte",     &NoiseConfig::bitFlipRate,  1e-5},
+        {"bit flips 1e-4/byte",     &NoiseConfig::bitFlipRate,  1e-4},
+        {"bit flips 1e-3/byte",     &NoiseConfig::bitFlipRate,  1e-3},
+        {"dropped bytes 1e-4/byte", &NoiseConfig::dropByteRate, 1e-4},
+        {"dropped bytes 1e-3/byte", &NoiseConfig::dropByteRate, 1e-3},
+        {"dropped oks 0.1%",        &NoiseConfig::dropOkRate,   1e-3},
+        {"dropped oks 1%",          &NoiseConfig::dropOkRate,   1e-2},
+        {"spurious resets 0.01%",   &NoiseConfig::resetRate,    1e-4},
+    };
+
+    SimulatorConfig simulator;
+    simulator.bps = 115200;
+    simulator.printer.acceleration = 100000;    // Moves finish faster than the link delivers them
+    size_t payload;
+    unsigned lines = 5000;
+    string job = makeLinkBoundJob(lines, payload);
+    printf("%u lines, %u payload bytes, %u bps, simulated\n\n", lines, (unsigned)payload, simulator.bps);
+
+    for(size_t i = 0; i < sizeof(strategies) / sizeof(strategies[0]); ++i)
+    {
+        const Strategy& strategy = strategies[i];
+        printf("%s:\n", strategy.name);
+        printf("  %-24s %10s %10s %7s %8s %8s %13s\n", "noise", "time (s)", "goodput", "faults", "resends", "timeouts", "recovery (ms)");
+        double cleanSeconds = 0;
+        for(size_t j = 0; j < sizeof(scenarios) / sizeof(scenarios[0]); ++j)
+        {
+            NoiseConfig noise;
+            if(scenarios[j].rate)
+                noise.*scenarios[j].rate = scenarios[j].value;
+            NoiseRun run = runNoise(job, strategy.options, noise, simulator);
+            if(!j)
+                cleanSeconds = run.seconds;
+            if(run.stalled)
+            {
+                printf("  %-24s stalled after %.3f s\n", scenarios[j].name, run.seconds);
+                continue;
+            }
+            printf("  %-24s %10.3f %8.0f/s %7u %8u %8u", scenarios[j].name, run.seconds, payload / run.seconds,
+                run.faults, run.sender.resendRequests, run.sender.timeouts);
+            if(run.faults)
+                printf(" %13.2f", (run.seconds - cleanSeconds) * 1000 / run.faults);
+            printf("\n");
+        }
+        printf("\n");
+    }
+    printf("goodput: payload bytes per second until the last line was acknowledged\n");
+    printf("recovery: extra time over the clean run, per injected fault\n");
+}
+
+struct PriorityRun
+{
+    double queryMs;                             // From sendPriority until the M105 reply arrived
+    double haltMs;                              // From emergencyStop until the firmware halted
+};
+
+static PriorityRun runPriority(const string& job, const SimulatorConfig& simulator, uint64_t queryAt, uint64_t stopAt)
+{
+    VirtualClock clock;
+    SimulatedPrinter* printer = 0;
+    uint64_t replyTime = 0;
+    GCodeSender sender(
+        clock,
+        [&](LineHandler receivedLine, StatusWriter statusWriter) -> unique_ptr<Transport> {
+            printer = new SimulatedPrinter(
+                clock,
+                simulator,
+                [&, receivedLine](const char* b, const char* e){
+                    if(!replyTime && e - b >= 5 && !strncmp(b, "ok T:", 5))
+                        replyTime = clock.now();
+                    receivedLine(b, e);
+                },
+                statusWriter);
+            return unique_ptr<Transport>(printer);
+        },
+        unique_ptr<LineSource>(new TextLineSource(job.data(), job.data() + job.size())),
+        SenderOptions());
+
+    clock.setTimer(queryAt, [&](){sender.sendPriority("M105");});
+    clock.setTimer(stopAt, [&](){sender.emergencyStop();});
+
+    vector<Event> events = sender.getEvents();
+    events.insert(events.end(), clock.getEvents().begin(), clock.getEvents().end());
+    runEventLoop(events, [&](){return printer->getStats().halted;}, true);
+
+    PriorityRun run;
+    run.queryMs = replyTime ? (replyTime - queryAt) / 1000.0 : -1;
+    run.haltMs = (printer->getStats().finishTime - stopAt) / 1000.0;
+    return run;
+}
+
+// How long an operator command waits behind a streaming job, and how long an emergency stop
+// takes to halt the firmware
+static void estopBenchmark()
+{
+    size_t payload;
+    string job = makeLinkBoundJob(20000, payload);
+    unsigned rates[] = {19200, 115200, 250000};
+    const unsigned trials = 20;
+
+    printf("%u trials per rate, requests at varying points of a streaming job, simulated\n\n", trials);
+    printf("%8s %9s %17s %17s\n", "bps", "frame (ms)", "M105 reply (ms)", "M112 halt (ms)");
+    for(size_t i = 0; i < sizeof(rates) / sizeof(rates[0]); ++i)
+    {
+        SimulatorConfig simulator;
+        simulator.bps = rates[i];
+        simulator.printer.acceleration = 100000;
+        double queryTotal = 0, queryMax = 0, haltTotal = 0, haltMax = 0;
+        for(unsigned t = 0; t < trials; ++t)
+        {
+            uint64_t at = 2000000 + t * 37111;   // Past the first long move, into steady streaming
+            PriorityRun run = runPriority(job, simulator, at, at + 200000);
+            queryTotal += run.queryMs;
+            queryMax = max(queryMax, run.queryMs);
+            haltTotal += run.haltMs;
+            haltMax = max(haltMax, run.haltMs);
+        }
+        double frameMs = 36 * 10 * 1000.0 / rates[i];
+        printf("%8u %9.2f %8.2f / %6.2f %8.2f / %6.2f\n", rates[i], frameMs,
+            queryTotal / trials, queryMax, haltTotal / trials, haltMax);
+    }
+    printf("\nframe: wire time of a typical numbered move; replies and halts are mean / max\n");
+}
+
+// What temperature polling costs a link-bound job, against the bytes it puts on the wire
+static void pollBenchmark()
+{
+    SimulatorConfig simulator;
+    simulator.bps = 115200;
+    simulator.printer.acceleration = 100000;
+    size_t payload;
+    unsigned lines = 20000;
+    string job = makeLinkBoundJob(lines, payload);
+    printf("%u lines, %u bps, simulated\n\n", lines, simulator.bps);
+
+    // A numbered poll, and the simulator's answer with the heaters off
+    const double pollBytes = sizeof("N10000 M105*123\n") - 1 + sizeof("ok T:20.0 /0 B:20.0 /0\n") - 1;
+    unsigned intervals[] = {0, 5000, 2000, 1000, 500, 250};
+    NoiseRun clean;
+    printf("%9s %9s %6s %10s %14s %14s\n", "poll (ms)", "time (s)", "polls", "extra (ms)", "per poll (ms)", "on wire (ms)");
+    for(size_t i = 0; i < sizeof(intervals) / sizeof(intervals[0]); ++i)
+    {
+        SenderOptions options;
+        options.temperatureMs = intervals[i];
+        NoiseRun run = runNoise(job, options, NoiseConfig(), simulator);
+        if(!i)
+        {
+            clean = run;
+            printf("%9s %9.3f\n", "none", run.seconds);
+            continue;
+        }
+        unsigned polls = run.sender.framesSent - clean.sender.framesSent;
+        double extra = (run.seconds - clean.seconds) * 1000;
+        printf("%9u %9.3f %6u %10.1f %14.3f %14.3f\n", intervals[i], run.seconds, polls, extra,
+            extra / polls, pollBytes * 10 * 1000 / simulator.bps);
+    }
+    printf("\non wire: time to send a typical poll plus time to receive its answer; the two directions\n");
+    printf("overlap, so a poll can cost less. Sparse polling is within the noise of where the job meets the planner.\n");
+}
+
+// A simulated printer on its own virtual clock, for running many at once
+struct SimulatedSession
+{
+    VirtualClock clock;
+    unique_ptr<GCodeSender> sender;
+
+    SimulatedSession(const string& job, const SimulatorConfig& simulator)
+    {
+        sender.reset(new GCodeSender(
+            clock,
+            [&](LineHandler receivedLine, StatusWriter statusWriter) -> unique_ptr<Transport> {
+                return unique_ptr<Transport>(new SimulatedPrinter(clock, simulator, receivedLine, statusWriter));},
+            unique_ptr<LineSource>(new TextLineSource(job.data(), job.data() + job.size())),
+            SenderOptions()));
+    }
+};
+
+// Many printers driven from one thread through one reactor
+static void reactorBenchmark()
+{
+    SimulatorConfig simulator;
+    simulator.bps = 250000;
+    simulator.printer.acceleration = 100000;
+    size_t payload;
+    unsigned lines = 2000;
+    string job = makeLinkBoundJob(lines, payload);
+    printf("%u lines per printer, each on its own virtual clock, one thread\n\n", lines);
+    printf("  %-8s %8s %10s %12s %12s\n", "reactor", "printers", "wall (s)", "frames/s", "us/dispatch");
+
+    unsigned counts[] = {1, 16, 64, 256};
+    for(int poll = 0; poll < 2; ++poll)
+    {
+        for(size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); ++i)
+        {
+            unsigned n = counts[i];
+            if(!poll && n > MAXIMUM_WAIT_OBJECTS)
+                continue;
+            unique_ptr<Reactor> reactor(poll ? (Reactor*)new PollReactor : new WaitReactor);
+            vector<unique_ptr<SimulatedSession>> sessions;
+            for(unsigned j = 0; j < n; ++j)
+            {
+                sessions.push_back(unique_ptr<SimulatedSession>(new SimulatedSession(job, simulator)));
+                reactor->add(sessions.back()->sender->getEvents());
+                reactor->add(sessions.back()->clock.getEvents());
+            }
+
+            uint64_t start = monotonicMicros();
+            uint64_t dispatched = 0;
+            unsigned remaining = n;
+            while(remaining)
+            {
+                unsigned d = reactor->step(0);
+                if(!d)
+                    throw runtime_error("reactor benchmark stalled");
+                dispatched += d;
+                remaining = 0;
+                for(unsigned j = 0; j < n; ++j)
+                    remaining += !sessions[j]->sender->getDone();
+            }
+            double seconds = (monotonicMicros() - start) / 1000000.0;
+
+            uint64_t frames = 0;
+            for(unsigned j = 0; j < n; ++j)
+                frames += sessions[j]->sender->getStats().framesSent;
+            printf("  %-8s %8u %10.3f %12.0f %12.3f\n", poll ? "poll" : "wait", n, seconds,
+                frames / seconds, seconds * 1000000 / dispatched);
+        }
+    }
+    printf("\nwall: real time to finish every job; frames/s: frames sent by all printers per wall second\n");
+}
+
+// Pipe end driven by events, the way Serial drives a port: a read is always outstanding, and
+// each string queued is its own WriteFile()
+class EventPipe: public Transport
+{
+private:
+    LineHandler receivedLine;
+    StatusWriter statusWriter;
+    vector<Event> events;
+    HANDLE pipe;
+    OVERLAPPED overlappedRead;
+    OVERLAPPED overlappedWrite;
+    list<string> writeQueue;
+    bool writing;
+    static const size_t readBufferSize = 1024;
+    char readBuffer[readBufferSize];
+    size_t bytesInReadBuffer;
+
+public:
+    EventPipe(HANDLE pipe, LineHandler receivedLine, StatusWriter statusWriter):
+        receivedLine(receivedLine),
+        statusWriter(statusWriter),
+        pipe(pipe),
+        writing(false),
+        bytesInReadBuffer(0)
+    {
+        memset(&overlappedRead, 0, sizeof(OVERLAPPED));
+        memset(&overlappedWrite, 0, sizeof(OVERLAPPED));
+        overlappedRead.hEvent = CreateEvent(0, true, false, 0);
+        overlappedWrite.hEvent = CreateEvent(0, true, false, 0);
+        if(!overlappedRead.hEvent || !overlappedWrite.hEvent)
+            throw runtime_error("CreateEvent failed");
+        events.push_back(Event(overlappedRead.hEvent, [this](){onRead();}));
+        events.push_back(Event(overlappedWrite.hEvent, [this](){onWrite();}));
+        startRead();
+    }
+
+    ~EventPipe()
+    {
+        DWORD dummy;
+        CancelIo(pipe);
+        GetOverlappedResult(pipe, &overlappedRead, &dummy, true);
+        if(writing)
+            GetOverlappedResult(pipe, &overlappedWrite, &dummy, true);
+        CloseHandle(pipe);
+        CloseHandle(overlappedRead.hEvent);
+        CloseHandle(overlappedWrite.hEvent);
+    }
+
+    virtual void send(std::string&& data)
+    {
+        writeQueue.push_back(move(data));
+        startWrite();
+    }
+
+    virtual const std::vector<Event>& getEvents() {return events;}
+
+private:
+    void startRead()
+    {
+        ResetEvent(overlappedRead.hEvent);
+        if(!ReadFile(pipe, readBuffer + bytesInReadBuffer, readBufferSize - bytesInReadBuffer, 0, &overlappedRead) && GetLastError() != ERROR_IO_PENDING)
+            throw runtime_error("pipe read failed");
+    }
+
+    void onRead()
+    {
+        DWORD numRead = 0;
+        if(!GetOverlappedResult(pipe, &overlappedRead, &numRead, false))
+            throw runtime_error("pipe read failed");
+        bytesInReadBuffer += numRead;
+        dispatchLines(readBuffer, bytesInReadBuffer, readBufferSize, receivedLine, statusWriter);
+        startRead();
+    }
+
+    void startWrite()
+    {
+        if(writing || writeQueue.empty())
+            return;
+        ResetEvent(overlappedWrite.hEvent);
+        if(!WriteFile(pipe, writeQueue.front().data(), writeQueue.front().size(), 0, &overlappedWrite) && GetLastError() != ERROR_IO_PENDING)
+            throw runtime_error("pipe write failed");
+        writing = true;
+    }
+
+    void onWrite()
+    {
+        DWORD numWritten = 0;
+        if(!GetOverlappedResult(pipe, &overlappedWrite, &numWritten, false))
+            throw runtime_error("pipe write failed");
+        writing = false;
+        writeQueue.pop_front();
+        startWrite();
+    }
+};
+
+// Printers at the far ends of pipes, answering every line with "ok". They all run on one
+// thread through one completion port, so the firmware side costs the same whichever
+// transport the host side uses.
+class PipeFirmware
+{
+private:
+    IocpReactor reactor;
+    vector<unique_ptr<IocpSerial>> ports;       // Must come after reactor
+    volatile LONG stopping;
+    HANDLE thread;
+
+public:
+    // Make n pipes and put their client ends in clients
+    PipeFirmware(unsigned n, vector<HANDLE>& clients):
+        stopping(0),
+        thread(0)
+    {
+        StatusWriter ignore = [](const char*){};
+        for(unsigned i = 0; i < n; ++i)
+        {
+            string name = "\\\\.\\pipe\\send-gcode-bench-" + toString(GetCurrentProcessId()) + "-" + toString(i);
+            HANDLE server = CreateNamedPipeA(name.c_str(), PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+                PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT, 1, 4096, 4096, 0, 0);
+            if(server == INVALID_HANDLE_VALUE)
+                throw runtime_error("can not create pipe " + name);
+            HANDLE client = CreateFileA(name.c_str(), GENERIC_READ | GENERIC_WRITE, 0, 0, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, 0);
+            if(client == INVALID_HANDLE_VALUE)
+            {
+                CloseHandle(server);
+                throw runtime_error("can not open pipe " + name);
+            }
+            clients.push_back(client);
+
+            ports.push_back(unique_ptr<IocpSerial>());
+            ports[i].reset(new IocpSerial(reactor, [this, i](const char*, const char*){ports[i]->send("ok\n");}, ignore));
+            ports[i]->attach(server);
+        }
+
+        // The ports are only touched by the thread from here on
+        thread = CreateThread(0, 0, threadProc, this, 0, 0);
+        if(!thread)
+            throw runtime_error("CreateThread failed");
+    }
+
+    ~PipeFirmware()
+    {
+        InterlockedExchange(&stopping, 1);
+        WaitForSingleObject(thread, INFINITE);
+        CloseHandle(thread);
+    }
+
+private:
+    static DWORD WINAPI threadProc(LPVOID param)
+    {
+        PipeFirmware* self = (PipeFirmware*)param;
+        try
+        {
+            while(!self->stopping)
+                self->reactor.step(10);
+        }
+        catch(exception& e)
+        {
+            printf("firmware side: %s\n", e.what());
+        }
+        return 0;
+    }
+};
+
+// Many printers on real pipes, driven from one thread by events or by a completion port
+static void iocpBenchmark()
+{
+    size_t payload;
+    unsigned lines = 2000;
+    string job = makeLinkBoundJob(lines, payload);
+    printf("%u lines per printer over named pipes; the firmware ends answer \"ok\" from one other thread\n\n", lines);
+    printf("  %-8s %8s %10s %12s\n", "host", "printers", "wall (s)", "frames/s");
+
+    // Each EventPipe takes two of the MAXIMUM_WAIT_OBJECTS handles and the clock takes one
+    unsigned counts[] = {1, 16, 31, 64, 256};
+    for(int iocp = 0; iocp < 2; ++iocp)
+    {
+        for(size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); ++i)
+        {
+            unsigned n = counts[i];
+            if(!iocp && n * 2 + 1 > MAXIMUM_WAIT_OBJECTS)
+                continue;
+
+            unique_ptr<Reactor> reactor;
+            IocpReactor* completionPort = 0;
+            if(iocp)
+                reactor.reset(completionPort = new IocpReactor);
+            else
+                reactor.reset(new WaitReactor);
+            RealClock clock;
+            vector<HANDLE> clients;
+            unique_ptr<PipeFirmware> firmware(new PipeFirmware(n, clients));
+
+            uint64_t start = monotonicMicros();
+            vector<unique_ptr<GCodeSender>> senders;
+            for(unsigned j = 0; j < n; ++j)
+            {
+                HANDLE client = clients[j];
+                senders.push_back(unique_ptr<GCodeSender>(new GCodeSender(
+                    clock,
+                    [&, client](LineHandler receivedLine, StatusWriter statusWriter) -> unique_ptr<Transport> {
+                        if(!completionPort)
+                            return unique_ptr<Transport>(new EventPipe(client, receivedLine, statusWriter));
+                        unique_ptr<IocpSerial> port(new IocpSerial(*completionPort, receivedLine, statusWriter));
+                        port->attach(client);
+                        return move(port);
+                    },
+                    unique_ptr<LineSource>(new TextLineSource(job.data(), job.data() + job.size())),
+                    SenderOptions())));
+                reactor->add(senders.back()->getEvents());
+            }
+            reactor->add(clock.getEvents());
+
+            unsigned remaining = n;
+            while(remaining)
+            {
+                reactor->step(100);
+                remaining = 0;
+                for(unsigned j = 0; j < n; ++j)
+                    remaining += !senders[j]->getDone();
+            }
+            double seconds = (monotonicMicros() - start) / 1000000.0;
+
+            uint64_t frames = 0;
+            for(unsigned j = 0; j < n; ++j)
+                frames += senders[j]->getStats().framesSent;
+            firmware.reset();
+            printf("  %-8s %8u %10.3f %12.0f\n", iocp ? "iocp" : "events", n, seconds, frames / seconds);
+        }
+    }
+    printf("\nwall: real time to finish every job; frames/s: frames sent by all printers per wall second\n");
+}
+
+// A job over TCP to a local firmware stand-in, with and without the connection dropping
+static void tcpBenchmark()
+{
+    size_t payload;
+    unsigned lines = 5000;
+    string job = makeLinkBoundJob(lines, payload);
+    printf("%u lines over TCP to 127.0.0.1; the firmware end answers \"ok\" from another thread\n\n", lines);
+    printf("  %10s %10s %12s %10s %8s %8s %9s\n", "drop every", "wall (s)", "frames/s", "reconnects", "resends", "timeouts", "accepted");
+
+    unsigned dropEvery[] = {0, 2000, 500};
+    for(size_t i = 0; i < sizeof(dropEvery) / sizeof(dropEvery[0]); ++i)
+    {
+        LoopbackFirmware firmware(dropEvery[i]);
+        RealClock clock;
+        WaitReactor reactor;
+        SenderOptions options;
+        options.timeoutMs = 250;            // Finds the "ok" lost in each drop
+        options.statusWriter = [](const char*){};
+        TcpTransport* tcp = 0;
+
+        uint64_t start = monotonicMicros();
+        GCodeSender sender(
+            clock,
+            [&](LineHandler receivedLine, StatusWriter statusWriter) -> unique_ptr<Transport> {
+                unique_ptr<TcpTransport> transport(new TcpTransport(receivedLine, statusWriter));
+                transport->open("127.0.0.1", toString(firmware.getPort()));
+                tcp = transport.get();
+                return move(transport);
+            },
+            unique_ptr<LineSource>(new TextLineSource(job.data(), job.data() + job.size())),
+            options);
+        reactor.add(sender.getEvents());
+        reactor.add(clock.getEvents());
+        while(!sender.getDone())
+            reactor.step(100);
+        double seconds = (monotonicMicros() - start) / 1000000.0;
+        firmware.stop();
+
+        const SenderStats& stats = sender.getStats();
+        char drop[16] = "never";
+        if(dropEvery[i])
+            sprintf(drop, "%u", dropEvery[i]);
+        printf("  %10s %10.3f %12.0f %10u %8u %8u %9u\n", drop, seconds, stats.framesSent / seconds,
+            tcp->getReconnects(), stats.resendRequests, stats.timeouts, firmware.getStats().linesAccepted);
+    }
+    printf("\naccepted: numbered lines the firmware took in order; it equals the lines sent, with none lost or doubled,\n");
+    printf("when reconnecting kept the numbering. Each drop costs about one timeout.\n");
+}
+
+// Typical slicer output: comments, layer markers, inline comments and extruding moves
+static string makeSlicerJob(size_t bytes)
+{
+    string job = "; generated for the lexer benchmark\nG21 (millimeters)\nG90\nM82\nM104 S210\nG28\nG92 E0\n";
+    char buf[120];
+    double e = 0;
+    for(unsigned layer = 0; job.size() < bytes; ++layer)
+    {
+        job.append(buf, sprintf(buf, ";LAYER:%u\nM117 Layer %u\nG0 F9000 X%.3f Y%.3f Z%.2f\n", layer, layer, 80.0, 80.0, 0.2 + layer * 0.2));
+        for(unsigned i = 0; i < 400 && job.size() < bytes; ++i)
+        {
+            e += 0.03291;
+            if(i % 50 == 0)
+                job.append(buf, sprintf(buf, "G1 F1800 X%.3f Y%.3f E%.5f ; perimeter\n", 80 + i * 0.1, 80 + (i % 7) * 0.5, e));
+            else if(i % 50 == 25)
+                job.append(buf, sprintf(buf, "G1 X%.3f (infill) Y%.3f E%.5f\n", 80 + i * 0.1, 80 + (i % 7) * 0.5, e));
+            else
+                job.append(buf, sprintf(buf, "G1 X%.3f Y%.3f E%.5f\n", 80 + i * 0.1, 80 + (i % 7) * 0.5, e));
+        }
+    }
+    return job;
+}
+
+// The scan GCodeSender used before the lexer: find each line's code, stopping at the first comment
+static size_t scanLines(const char* pos, const char* end, size_t& codeBytes)
+{
+    size_t lines = 0;
+    codeBytes = 0;
+    while(pos != end)
+    {
+        while(pos != end && isspace((unsigned char)*pos))
+            ++pos;
+        const char* e = pos;
+        while(e != end && *e != '\r' && *e != '\n' && *e != '(' && *e != ';')
+            ++e;
+        if(pos != e)
+        {
+            ++lines;
+            codeBytes += e - pos;
+        }
+        while(e != end && *e != '\r' && *e != '\n')
+            ++e;
+        pos = e;
+    }
+    return lines;
+}
+
+// Throughput of the lexer over an in-memory job, against the old ad-hoc scan
+static void lexerBenchmark()
+{
+    const size_t size = 64 << 20;
+    const int passes = 5;
+    string job = makeSlicerJob(size);
+    const char* b = job.data();
+    const char* e = b + job.size();
+    printf("%u MB of slicer output, best of %d passes\n\n", (unsigned)(job.size() >> 20), passes);
+    printf("  %-22s %9s %12s %12s\n", "", "GB/s", "lines/s", "words");
+
+    uint64_t best = 0;
+    size_t lines = 0, words = 0;
+    for(int pass = 0; pass < passes; ++pass)
+    {
+        uint64_t start = monotonicMicros();
+        GCodeLexer lexer(b, e);
+        GCodeLine line;
+        lines = words = 0;
+        while(lexer.next(line))
+            if(line.hasCode())
+            {
+                ++lines;
+                words += line.numWords + 1;
+            }
+        uint64_t elapsed = monotonicMicros() - start;
+        if(!pass || elapsed < best)
+            best = elapsed;
+    }
+    printf("  %-22s %9.2f %12.0f %12u\n", "lexer", job.size() / (best * 1000.0), lines * 1000000.0 / best, (unsigned)words);
+
+    uint64_t values = 0;
+    for(int pass = 0; pass < passes; ++pass)
+    {
+        uint64_t start = monotonicMicros();
+        GCodeLexer lexer(b, e);
+        GCodeLine line;
+        double sum = 0;
+        lines = 0;
+        while(lexer.next(line))
+        {
+            if(line.hasCode())
+                ++lines;
+            double v;
+            for(unsigned i = 0; i < line.numWords; ++i)
+                if(toDouble(line.words[i].number, v))
+                    sum += v;
+        }
+        uint64_t elapsed = monotonicMicros() - start;
+        values = (uint64_t)sum;
+        if(!pass || elapsed < best)
+            best = elapsed;
+    }
+    printf("  %-22s %9.2f %12.0f %12s\n", "lexer + toDouble", job.size() / (best * 1000.0), lines * 1000000.0 / best, "");
+
+    size_t codeBytes = 0;
+    for(int pass = 0; pass < passes; ++pass)
+    {
+        uint64_t start = monotonicMicros();
+        lines = scanLines(b, e, codeBytes);
+        uint64_t elapsed = monotonicMicros() - start;
+        if(!pass || elapsed < best)
+            best = elapsed;
+    }
+    printf("  %-22s %9.2f %12.0f %12s\n", "old line scan", job.size() / (best * 1000.0), lines * 1000000.0 / best, "");
+    printf("\n(checksum of values: %u)\n", (unsigned)values);
+}
+
+static bool sameTable(const CommandTable& a, const CommandTable& b)
+{
+    return a.opcodes == b.opcodes && a.paramMasks == b.paramMasks && a.flags == b.flags &&
+        a.valueStarts == b.valueStarts && a.offsets == b.offsets && a.sourceLines == b.sourceLines &&
+        a.totalLines == b.totalLines && a.values.size() == b.values.size() &&
+        (a.values.empty() || !memcmp(&a.values[0], &b.values[0], a.values.size() * sizeof(float)));
+}
+
+// Scaling of the parallel pre-parse, and a check that every thread count builds the same table
+static void preparseBenchmark()
+{
+    const size_t size = 128 << 20;
+    string job = makeSlicerJob(size);
+    const char* b = job.data();
+    const char* e = b + job.size();
+
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    unsigned processors = info.dwNumberOfProcessors;
+    unsigned most = max(processors, 4u);        // Check determinism even on small machines
+    printf("%u MB of slicer output, %u processors, best of 3 passes\n\n", (unsigned)(job.size() >> 20), processors);
+    printf("  %7s %9s %12s %8s\n", "threads", "GB/s", "commands", "speedup");
+
+    CommandTable reference;
+    double single = 0;
+    for(unsigned threads = 1; ; threads *= 2)
+    {
+        threads = min(threads, most);
+        CommandTable table;
+        uint64_t best = 0;
+        for(int pass = 0; pass < 3; ++pass)
+        {
+            uint64_t start = monotonicMicros();
+            buildCommandTable(b, e, threads, table);
+            uint64_t elapsed = monotonicMicros() - start;
+            if(!pass || elapsed < best)
+                best = elapsed;
+        }
+        double rate = job.size() / (best * 1000.0);
+        if(threads == 1)
+        {
+            single = rate;
+            reference.opcodes.swap(table.opcodes);
+            reference.paramMasks.swap(table.paramMasks);
+            reference.flags.swap(table.flags);
+            reference.valueStarts.swap(table.valueStarts);
+            reference.values.swap(table.values);
+            reference.offsets.swap(table.offsets);
+            reference.sourceLines.swap(table.sourceLines);
+            reference.totalLines = table.totalLines;
+            printf("  %7u %9.2f %12u %7.2fx\n", threads, rate, (unsigned)reference.size(), 1.0);
+        }
+        else
+        {
+            printf("  %7u %9.2f %12u %7.2fx%s\n", threads, rate, (unsigned)table.size(), rate / single,
+                sameTable(table, reference) ? "" : "  MISMATCH");
+        }
+        if(threads == most)
+            break;
+    }
+}
+
+// Throughput of the print-time estimator over a pre-parsed job, alone and filling the
+// per-command finish times --progress uses
+static void estimateBenchmark()
+{
+    const size_t size = 128 << 20;
+    string job = makeSlicerJob(size);
+    CommandTable table;
+    buildCommandTable(job.data(), job.data() + job.size(), 0, table);
+    PrinterModel printer;
+    printf("%u MB of slicer output, %u commands, best of 3 passes\n\n", (unsigned)(job.size() >> 20), (unsigned)table.size());
+    printf("  %-22s %9s %14s %14s\n", "", "GB/s", "commands/s", "500 MB (s)");
+
+    for(int withFinish = 0; withFinish < 2; ++withFinish)
+    {
+        vector<float> finishTimes;
+        PrintEstimate estimate;
+        uint64_t best = 0;
+        for(int pass = 0; pass < 3; ++pass)
+        {
+            uint64_t start = monotonicMicros();
+            estimate = estimatePrintTime(table.columns(), printer, 16, withFinish ? &finishTimes : 0);
+            uint64_t elapsed = monotonicMicros() - start;
+            if(!pass || elapsed < best)
+                best = elapsed;
+        }
+        double rate = job.size() / (best * 1000.0);
+        printf("  %-22s %9.2f %14.0f %14.2f   (print time %s)\n", withFinish ? "with finish times" : "estimate",
+            rate, table.size() * 1000000.0 / best, 0.5 / rate, formatDuration(estimate.total).c_str());
+    }
+}
+
+void runBenchmark(const std::string& name)
+{
+    if(name == "noise")
+        noiseBenchmark();
+    else if(name == "estop")
+        estopBenchmark();
+    else if(name == "poll")
+        pollBenchmark();
+    else if(name == "reactor")
+        reactorBenchmark();
+    else if(name == "iocp")
+        iocpBenchmark();
+    else if(name == "tcp")
+        tcpBenchmark();
+    else if(name == "lexer")
+        lexerBenchmark();
+    else if(name == "estimate")
+        estimateBenchmark();
+    else if(name == "preparse")
+        preparseBenchmark();
+    else
+        throw runtime_error("unknown benchmark " + name + "; available: " + benchmarkNames);
+}
@@ -0,0 +1,209 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#include "CaptureAnalyzer.h"
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <stdexcept>
+
+using namespace std;
+
+void readCapture(const std::string& filename, std::vector<CaptureRecord>& records)
+{
+    shared_ptr<FILE> f(fopen(filename.c_str(), "rb"), [](FILE* f){if(f) fclose(f);});
+    if(!f)
+        throw runtime_error("can not open file " + filename);
+
+    CaptureFileHeader fileHeader;
+    if(fread(&fileHeader, sizeof(fileHeader), 1, &*f) != 1 || memcmp(fileHeader.magic, captureMagic, sizeof(captureMagic)))
+        throw runtime_error(filename + " is not a capture file");
+    if(fileHeader.version != captureVersion)
+        throw runtime_error(filename + " has an unsupported capture version");
+
+    records.clear();
+    CaptureRecordHeader header;
+    while(fread(&header, sizeof(header), 1, &*f) == 1)
+    {
+        CaptureRecord record;
+        record.time = header.time;
+        record.type = header.type;
+        record.data.resize(header.length);
+        if(header.length && fread(&record.data[0], 1, header.length, &*f) != header.length)
+            break;
+        records.push_back(move(record));
+    }
+}
+
+// Line number in a TX frame ("N123 ..."), or -1
+static long frameLineNumber(const string& frame)
+{
+    if(frame.empty() || frame[0] != 'N')
+        return -1;
+    return strtol(frame.c_str() + 1, 0, 10);
+}
+
+// Line number requested by "Resend: 123" or "rs 123", or -1 if this isn't a resend request
+static long resendLineNumber(const string& line)
+{
+    if(line.compare(0, 6, "Resend") && line.compare(0, 2, "rs"))
+        return -1;
+    size_t p = line.find_first_of("0123456789");
+    if(p == string::npos)
+        return -1;
+    return strtol(line.c_str() + p, 0, 10);
+}
+
+static double ms(uint64_t us)
+{
+    return us / 1000.0;
+}
+
+struct ResendChain
+{
+    long        line;           // Requested line number
+    unsigned    requests;       // Number of resend requests
+    uint64_t    begin;          // First request
+    uint64_t    end;            // A later line was sent
+};
+
+struct IdleGap
+{
+    uint64_t    begin;
+    uint64_t    length;
+    long        lastLine;       // Last line number sent before the gap
+};
+
+void analyzeCapture(const std::string& filename, unsigned idleGapMs)
+{
+    vector<CaptureRecord> records;
+    readCapture(filename, records);
+    if(records.empty())
+    {
+        printf("%s: no records\n", filename.c_str());
+        return;
+    }
+
+    uint64_t start = records.front().time;
+    unsigned txCount = 0, rxCount = 0, dropped = 0;
+    size_t txBytes = 0;
+    deque<uint64_t> outstanding;            // Frames waiting for "ok", oldest first
+    vector<uint64_t> rtts;
+    vector<ResendChain> chains;
+    bool inChain = false;
+    vector<IdleGap> gaps;
+    long lastLine = -1;
+    uint64_t lastTime = start;
+
+    for(size_t i = 0; i < records.size(); ++i)
+    {
+        const CaptureRecord& r = records[i];
+        if(r.time - lastTime >= (uint64_t)idleGapMs * 1000)
+        {
+            IdleGap gap = {lastTime, r.time - lastTime, lastLine};
+            gaps.push_back(gap);
+        }
+        lastTime = r.time;
+
+        if(r.type == captureTx)
+        {
+            ++txCount;
+            txBytes += r.data.size();
+            outstanding.push_back(r.time);
+            long line = frameLineNumber(r.data);
+            if(line >= 0)
+            {
+                if(inChain && line > chains.back().line)
+                {
+                    chains.back().end = r.time;
+                    inChain = false;
+                }
+                lastLine = line;
+            }
+        }
+        else if(r.type == captureRx)
+        {
+            ++rxCount;
+            long line = resendLineNumber(r.data);
+            if(line >= 0)
+            {
+                if(inChain && chains.back().line == line)
+                    ++chains.back().requests;
+                else
+                {
+                    if(inChain)
+                        chains.back().end = r.time;
+                    ResendChain chain = {line, 1, r.time, r.time};
+                    chains.push_back(chain);
+                    inChain = true;
+                }
+            }
+            else if(!r.data.compare(0, 2, "ok") && !outstanding.empty())
+            {
+                rtts.push_back(r.time - outstanding.front());
+                outstanding.pop_front();
+            }
+            else if(r.data == "start")
+                outstanding.clear();
+        }
+        else if(r.type == captureDropped && r.data.size() == sizeof(uint32_t))
+        {
+            uint32_t count;
+            memcpy(&count, r.data.data(), sizeof(count));
+            dropped += count;
+        }
+    }
+    if(inChain)
+        chains.back().end = lastTime;
+
+    uint64_t duration = records.back().time - start;
+    printf("%s: %u records over %.3f s\n", filename.c_str(), (unsigned)records.size(), duration / 1000000.0);
+    printf("  sent %u frames (%u bytes), received %u lines\n", txCount, (unsigned)txBytes, rxCount);
+    if(dropped)
+        printf("  WARNING: %u records were dropped during capture; results are incomplete\n", dropped);
+
+    if(!rtts.empty())
+    {
+        vector<uint64_t> sorted = rtts;
+        sort(sorted.begin(), sorted.end());
+        uint64_t total = 0;
+        for_each(sorted.begin(), sorted.end(), [&total](uint64_t t){total += t;});
+        printf("\nround trip (frame to ok), %u samples:\n", (unsigned)sorted.size());
+        printf("  min %.3f ms  avg %.3f ms  p50 %.3f ms  p95 %.3f ms  p99 %.3f ms  max %.3f ms\n",
+            ms(sorted.front()), ms(total / sorted.size()),
+            ms(sorted[sorted.size() / 2]), ms(sorted[sorted.size() * 95 / 100]),
+            ms(sorted[sorted.size() * 99 / 100]), ms(sorted.back()));
+    }
+
+    printf("\nresend chains: %u\n", (unsigned)chains.size());
+    if(!chains.empty())
+    {
+        uint64_t total = 0;
+        for_each(chains.begin(), chains.end(), [&total](const ResendChain& c){total += c.end - c.begin;});
+        printf("  total recovery time %.3f ms\n", ms(total));
+        sort(chains.begin(), chains.end(), [](const ResendChain& a, const ResendChain& b){
+            return a.end - a.begin > b.end - b.begin;});
+        for(size_t i = 0; i < chains.size() && i < 10; ++i)
+            printf("  at %10.3f s  line %-8ld %3u requests  %10.3f ms\n",
+                (chains[i].begin - start) / 1000000.0, chains[i].line, chains[i].requests, ms(chains[i].end - chains[i].begin));
+    }
+
+    printf("\nidle gaps of %u ms or more: %u\n", idleGapMs, (unsigned)gaps.size());
+    sort(gaps.begin(), gaps.end(), [](const IdleGap& a, const IdleGap& b){return a.length > b.length;});
+    for(size_t i = 0; i < gaps.size() && i < 10; ++i)
+        printf("  at %10.3f s  after line %-8ld %10.3f ms\n", (gaps[i].begin - start) / 1000000.0, gaps[i].lastLine, ms(gaps[i].length));
+}
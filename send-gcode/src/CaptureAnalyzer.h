@@ -0,0 +1,38 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#pragma once
+
+#include "SessionCapture.h"
+#include <string>
+#include <vector>
+
+// One record read back from a capture file
+struct CaptureRecord
+{
+    uint64_t    time;           // Microseconds
+    uint8_t     type;           // CaptureRecordType
+    std::string data;           // Payload
+};
+
+// Read an entire capture file; throws exception on failure. A truncated last record is ignored.
+void readCapture(const std::string& filename, std::vector<CaptureRecord>& records);
+
+// Print round-trip latencies, resend chains and idle gaps found in a capture
+void analyzeCapture(
+    const std::string& filename,
+    unsigned idleGapMs);        // Report gaps with no traffic at least this long
@@ -0,0 +1,160 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#include "Clock.h"
+#include <stdexcept>
+
+using namespace std;
+
+uint64_t monotonicMicros()
+{
+    static LARGE_INTEGER frequency;
+    if(!frequency.QuadPart)
+        QueryPerformanceFrequency(&frequency);
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000 +
+        (uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+}
+
+Clock::Clock():
+    nextTimerId(1)
+{
+}
+
+unsigned Clock::setTimer(uint64_t due, TimerHandler handler)
+{
+    Timer timer;
+    timer.id = nextTimerId++;
+    if(!nextTimerId)
+        nextTimerId = 1;
+    timer.handler = move(handler);
+    unsigned id = timer.id;
+    bool earliest = timers.empty() || due < timers.begin()->first;
+    timers.insert(make_pair(due, move(timer)));
+    if(earliest)
+        timersChanged();
+    return id;
+}
+
+void Clock::cancelTimer(unsigned id)
+{
+    if(!id)
+        return;
+    for(auto it = timers.begin(); it != timers.end(); ++it)
+    {
+        if(it->second.id == id)
+        {
+            bool earliest = it == timers.begin();
+            timers.erase(it);
+            if(earliest)
+                timersChanged();
+            return;
+        }
+    }
+}
+
+bool Clock::getNextDue(uint64_t& due) const
+{
+    if(timers.empty())
+        return false;
+    due = timers.begin()->first;
+    return true;
+}
+
+bool Clock::runNext(uint64_t t)
+{
+    if(timers.empty() || timers.begin()->first > t)
+        return false;
+
+    // Remove it first; the handler may set or cancel timers
+    TimerHandler handler = move(timers.begin()->second.handler);
+    timers.erase(timers.begin());
+    handler();
+    return true;
+}
+
+RealClock::RealClock():
+    waitableTimer(CreateWaitableTimer(0, false, 0))
+{
+    if(!waitableTimer)
+        throw runtime_error("CreateWaitableTimer failed");
+    events.push_back(Event(waitableTimer, [this](){onTimer();}));
+}
+
+RealClock::~RealClock()
+{
+    CloseHandle(waitableTimer);
+}
+
+void RealClock::timersChanged()
+{
+    uint64_t due;
+    if(!getNextDue(due))
+    {
+        CancelWaitableTimer(waitableTimer);
+        return;
+    }
+
+    // Negative means relative, in 100ns units. Round up so we never wake early.
+    uint64_t t = now();
+    LARGE_INTEGER relative;
+    relative.QuadPart = -(LONGLONG)(due > t ? (due - t) * 10 : 1);
+    if(!SetWaitableTimer(waitableTimer, &relative, 0, 0, 0, false))
+        throw runtime_error("SetWaitableTimer failed");
+}
+
+void RealClock::onTimer()
+{
+    while(runNext(now()))
+        ;
+    timersChanged();
+}
+
+VirtualClock::VirtualClock():
+    time(0),
+    readyEvent(CreateEvent(0, true, false, 0))
+{
+    if(!readyEvent)
+        throw runtime_error("CreateEvent failed");
+    events.push_back(Event(readyEvent, [this](){onReady();}));
+}
+
+VirtualClock::~VirtualClock()
+{
+    CloseHandle(readyEvent);
+}
+
+void VirtualClock::timersChanged()
+{
+    uint64_t due;
+    if(getNextDue(due))
+        SetEvent(readyEvent);
+    else
+        ResetEvent(readyEvent);
+}
+
+void VirtualClock::onReady()
+{
+    uint64_t due;
+    if(!getNextDue(due))
+        return;
+    if(due > time)
+        time = due;
+    runNext(time);
+    timersChanged();
+}
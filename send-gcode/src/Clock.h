@@ -0,0 +1,116 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#pragma once
+
+#include "Transport.h"
+#include <map>
+#include <stdint.h>
+
+// Timer callback; may throw exceptions
+typedef std::function<void()> TimerHandler;
+
+// Monotonic microseconds since an arbitrary starting point
+uint64_t monotonicMicros();
+
+// Time source and timer queue for the event loop. Times are in microseconds.
+class Clock
+{
+private:
+    struct Timer
+    {
+        unsigned id;
+        TimerHandler handler;
+    };
+
+    std::multimap<uint64_t, Timer> timers;      // Pending timers by due time
+    unsigned nextTimerId;                       // Id for the next setTimer()
+
+protected:
+    std::vector<Event> events;                  // Events needed by this class
+
+public:
+    Clock();
+    virtual ~Clock() {}
+
+public:
+    // Current time
+    virtual uint64_t now() = 0;
+
+    // Call handler at time due. Returns an id for cancelTimer(); ids are never 0.
+    unsigned setTimer(uint64_t due, TimerHandler handler);
+
+    // Cancel a pending timer. Ignores ids which already fired or were cancelled.
+    void cancelTimer(unsigned id);
+
+    // Get events for event loop
+    const std::vector<Event>& getEvents() {return events;}
+
+protected:
+    // The earliest due time may have changed
+    virtual void timersChanged() = 0;
+
+    // Is there a pending timer? If so, set due to the earliest due time.
+    bool getNextDue(uint64_t& due) const;
+
+    // Run the earliest timer if it's due at or before t. Returns false if nothing ran.
+    bool runNext(uint64_t t);
+};
+
+// Wall-clock time, with timers driven by a waitable timer
+class RealClock: public Clock
+{
+private:
+    HANDLE waitableTimer;
+
+public:
+    RealClock();
+    ~RealClock();
+
+public:
+    virtual uint64_t now() {return monotonicMicros();}
+
+protected:
+    virtual void timersChanged();
+
+private:
+    // Signaled when the waitable timer fires
+    void onTimer();
+};
+
+// Simulated time. Time jumps straight to the next due timer, so a session
+// with long waits runs as fast as its handlers allow.
+class VirtualClock: public Clock
+{
+private:
+    uint64_t time;                              // Current time
+    HANDLE readyEvent;                          // Signaled while any timer is pending
+
+public:
+    VirtualClock();
+    ~VirtualClock();
+
+public:
+    virtual uint64_t now() {return time;}
+
+protected:
+    virtual void timersChanged();
+
+private:
+    // Signaled while timers are pending; advances time to the earliest one
+    void onReady();
+};
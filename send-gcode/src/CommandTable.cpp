@@ -0,0 +1,367 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#include "CommandTable.h"
+#include "Format.h"
+#include "JobIndex.h"
+#include <algorithm>
+#include <float.h>
+#include <limits>
+#include <map>
+#include <stdexcept>
+#include <string.h>
+#include <Windows.h>
+
+using namespace std;
+
+static unsigned countBits(uint32_t v)
+{
+    v = v - ((v >> 1) & 0x55555555);
+    v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+    return (((v + (v >> 4)) & 0x0f0f0f0f) * 0x01010101) >> 24;
+}
+
+uint16_t makeOpcode(char letter, TextRange number)
+{
+    unsigned n;
+    if(!toUnsigned(number, n) || n > opcodeNumberMask)
+        return opcodeNone;
+    if(letter == 'G')
+        return (uint16_t)(opcodeG | n);
+    else if(letter == 'M')
+        return (uint16_t)(opcodeM | n);
+    else if(letter == 'T')
+        return (uint16_t)(opcodeT | n);
+    return opcodeNone;
+}
+
+std::string opcodeName(uint16_t opcode)
+{
+    static const char letters[] = {'-', 'G', 'M', 'T'};
+    if(opcode == opcodeNone)
+        return "(none)";
+    return letters[opcode >> 14] + toString(opcode & opcodeNumberMask);
+}
+
+CommandTable::CommandTable():
+    totalLines(0)
+{
+}
+
+void CommandTable::clear()
+{
+    opcodes.clear();
+    paramMasks.clear();
+    flags.clear();
+    valueStarts.clear();
+    values.clear();
+    offsets.clear();
+    sourceLines.clear();
+    totalLines = 0;
+}
+
+CommandColumns::CommandColumns():
+    commands(0),
+    opcodes(0),
+    paramMasks(0),
+    flags(0),
+    valueStarts(0),
+    values(0),
+    offsets(0),
+    sourceLines(0),
+    totalLines(0)
+{
+}
+
+bool CommandColumns::getValue(size_t i, char letter, float& value) const
+{
+    uint32_t bit = paramBit(letter);
+    if(!(paramMasks[i] & bit))
+        return false;
+    value = values[valueStarts[i] + countBits(paramMasks[i] & (bit - 1))];
+    return true;
+}
+
+CommandColumns CommandTable::columns() const
+{
+    CommandColumns c;
+    c.commands = size();
+    if(c.commands)
+    {
+        c.opcodes = &opcodes[0];
+        c.paramMasks = &paramMasks[0];
+        c.flags = &flags[0];
+        c.valueStarts = &valueStarts[0];
+        c.offsets = &offsets[0];
+        c.sourceLines = &sourceLines[0];
+    }
+    if(!values.empty())
+        c.values = &values[0];
+    c.totalLines = totalLines;
+    return c;
+}
+
+void CommandTable::add(const GCodeLine& line, uint64_t offset)
+{
+    uint8_t f = 0;
+    if(line.malformed)
+        f |= commandMalformed;
+    if(!line.argument.empty())
+        f |= commandHasArgument;
+    if(line.hasLineNumber)
+        f |= commandHasLineNumber;
+
+    uint16_t opcode = opcodeNone;
+    if(line.command.letter)
+    {
+        opcode = makeOpcode(line.command.letter, line.command.number);
+        if(opcode == opcodeNone)
+            f |= commandMalformed;
+    }
+
+    // Words can come in any order; values are stored in letter order
+    uint32_t mask = 0;
+    float byLetter[26];
+    for(unsigned i = 0; i < line.numWords; ++i)
+    {
+        const GCodeWord& word = line.words[i];
+        int letter = word.letter - 'A';
+        if(letter < 0 || letter >= 26 || (mask & (1u << letter)))
+        {
+            f |= commandMalformed;
+            continue;
+        }
+        double v;
+        if(word.number.empty())
+            byLetter[letter] = numeric_limits<float>::quiet_NaN();
+        else if(toDouble(word.number, v))
+            byLetter[letter] = (float)v;
+        else
+        {
+            f |= commandMalformed;
+            continue;
+        }
+        mask |= 1u << letter;
+    }
+
+    opcodes.push_back(opcode);
+    paramMasks.push_back(mask);
+    flags.push_back(f);
+    valueStarts.push_back((uint32_t)values.size());
+    for(int letter = 0; letter < 26; ++letter)
+        if(mask & (1u << letter))
+            values.push_back(byLetter[letter]);
+    offsets.push_back(offset);
+    sourceLines.push_back(line.sourceLine);
+}
+
+void CommandTable::append(const CommandTable& other)
+{
+    uint32_t valueBase = (uint32_t)values.size();
+    uint32_t lineBase = totalLines;
+    size_t n = size();
+
+    opcodes.insert(opcodes.end(), other.opcodes.begin(), other.opcodes.end());
+    paramMasks.insert(paramMasks.end(), other.paramMasks.begin(), other.paramMasks.end());
+    flags.insert(flags.end(), other.flags.begin(), other.flags.end());
+    valueStarts.insert(valueStarts.end(), other.valueStarts.begin(), other.valueStarts.end());
+    values.insert(values.end(), other.values.begin(), other.values.end());
+    offsets.insert(offsets.end(), other.offsets.begin(), other.offsets.end());
+    sourceLines.insert(sourceLines.end(), other.sourceLines.begin(), other.sourceLines.end());
+    for(size_t i = n; i < size(); ++i)
+    {
+        valueStarts[i] += valueBase;
+        sourceLines[i] += lineBase;
+    }
+    totalLines += other.totalLines;
+}
+
+namespace
+{
+    // One thread's share of the source
+    struct Chunk
+    {
+        const char* source;             // Start of the whole source
+        const char* b;
+        const char* e;
+        CommandTable table;             // Line numbers are relative to the chunk
+        string error;                   // Set if the thread failed
+    };
+
+    void parseChunk(Chunk& chunk)
+    {
+        // Slicers produce a command every 25-30 bytes
+        size_t expected = (chunk.e - chunk.b) / 24 + 16;
+        chunk.table.opcodes.reserve(expected);
+        chunk.table.paramMasks.reserve(expected);
+        chunk.table.flags.reserve(expected);
+        chunk.table.valueStarts.reserve(expected);
+        chunk.table.values.reserve(expected * 3);
+        chunk.table.offsets.reserve(expected);
+        chunk.table.sourceLines.reserve(expected);
+
+        GCodeLexer lexer(chunk.b, chunk.e);
+        GCodeLine line;
+        uint32_t lines = 0;
+        while(lexer.next(line))
+        {
+            ++lines;
+            if(line.hasCode())
+                chunk.table.add(line, line.text.b - chunk.source);
+        }
+        chunk.table.totalLines = lines;
+    }
+
+    DWORD WINAPI parseChunkThread(LPVOID param)
+    {
+        Chunk& chunk = *(Chunk*)param;
+        try
+        {
+            parseChunk(chunk);
+        }
+        catch(exception& e)
+        {
+            chunk.error = e.what();
+        }
+        return 0;
+    }
+}
+
+void buildCommandTable(const char* b, const char* e, unsigned threads, CommandTable& table)
+{
+    if(!threads)
+    {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        threads = info.dwNumberOfProcessors;
+    }
+
+    // Small chunks aren't worth a thread; WaitForMultipleObjects handles at most 64
+    threads = max(1u, min(threads, min((unsigned)((e - b) >> 20) + 1, (unsigned)MAXIMUM_WAIT_OBJECTS)));
+
+    // Chunks end just after a newline so no line is split
+    vector<Chunk> chunks(threads);
+    const char* p = b;
+    for(unsigned i = 0; i < threads; ++i)
+    {
+        chunks[i].source = b;
+        chunks[i].b = p;
+        if(i + 1 == threads)
+            p = e;
+        else
+        {
+            p = max(p, b + (e - b) / threads * (i + 1));
+            const char* nl = (const char*)memchr(p, '\n', e - p);
+            p = nl ? nl + 1 : e;
+        }
+        chunks[i].e = p;
+    }
+
+    // This thread takes the first chunk
+    vector<HANDLE> handles;
+    for(unsigned i = 1; i < threads; ++i)
+    {
+        HANDLE h = CreateThread(0, 0, parseChunkThread, &chunks[i], 0, 0);
+        if(!h)
+        {
+            if(!handles.empty())
+                WaitForMultipleObjects(handles.size(), &handles[0], true, INFINITE);
+            for_each(handles.begin(), handles.end(), CloseHandle);
+            throw runtime_error("CreateThread failed");
+        }
+        handles.push_back(h);
+    }
+    parseChunkThread(&chunks[0]);
+    if(!handles.empty())
+        WaitForMultipleObjects(handles.size(), &handles[0], true, INFINITE);
+    for_each(handles.begin(), handles.end(), CloseHandle);
+
+    // Merge in source order so line numbers and value indexes match a single-threaded parse
+    table.clear();
+    size_t commands = 0, values = 0;
+    for(unsigned i = 0; i < threads; ++i)
+    {
+        if(!chunks[i].error.empty())
+            throw runtime_error(chunks[i].error);
+        commands += chunks[i].table.size();
+        values += chunks[i].table.values.size();
+    }
+    table.opcodes.reserve(commands);
+    table.paramMasks.reserve(commands);
+    table.flags.reserve(commands);
+    table.valueStarts.reserve(commands);
+    table.values.reserve(values);
+    table.offsets.reserve(commands);
+    table.sourceLines.reserve(commands);
+    for(unsigned i = 0; i < threads; ++i)
+    {
+        table.append(chunks[i].table);
+    }
+}
+
+void printJobStats(const CommandColumns& table)
+{
+    unsigned malformed = 0;
+    map<uint16_t, unsigned> counts;
+    for(size_t i = 0; i < table.size(); ++i)
+    {
+        ++counts[table.opcodes[i]];
+        if(table.flags[i] & commandMalformed)
+        {
+            if(++malformed <= 5)
+                printf("malformed: line %u\n", table.sourceLines[i]);
+        }
+    }
+    printf("%u commands on %u lines, %u malformed\n", (unsigned)table.size(), table.totalLines, malformed);
+
+    // Follow the moves. Coordinates start at 0 as they do after a reset.
+    ModalState state;
+    double low[3] = {DBL_MAX, DBL_MAX, DBL_MAX};
+    double high[3] = {-DBL_MAX, -DBL_MAX, -DBL_MAX};
+    double filament = 0;
+    for(size_t i = 0; i < table.size(); ++i)
+    {
+        double e = state.position[3];
+        state.apply(table, i);
+        if(ModalState::isMove(table.opcodes[i], table.paramMasks[i]))
+        {
+            if(state.position[3] > e)
+                filament += state.position[3] - e;
+            for(int axis = 0; axis < 3; ++axis)
+            {
+                low[axis] = min(low[axis], state.position[axis]);
+                high[axis] = max(high[axis], state.position[axis]);
+            }
+        }
+    }
+    unsigned layers = (unsigned)JobIndex(table).getLayers();
+    if(low[0] <= high[0])
+        printf("extents: X %.3f..%.3f  Y %.3f..%.3f  Z %.3f..%.3f (%u layers)\n",
+            low[0], high[0], low[1], high[1], low[2], high[2], layers);
+    printf("filament: %.1f mm\n", filament);
+
+    // Most common first
+    vector<pair<unsigned, uint16_t>> byCount;
+    for(map<uint16_t, unsigned>::const_iterator it = counts.begin(); it != counts.end(); ++it)
+        byCount.push_back(make_pair(it->second, it->first));
+    sort(byCount.begin(), byCount.end(), [](const pair<unsigned, uint16_t>& a, const pair<unsigned, uint16_t>& b) {
+        return a.first > b.first || (a.first == b.first && a.second < b.second);});
+    printf("commands:");
+    for(size_t i = 0; i < byCount.size(); ++i)
+        printf("%s %s %u", i ? "," : "", opcodeName(byCount[i].second).c_str(), byCount[i].first);
+    printf("\n");
+}
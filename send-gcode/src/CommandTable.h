@@ -0,0 +1,108 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#pragma once
+
+#include "GCodeLexer.h"
+#include <stdint.h>
+#include <vector>
+
+// Opcode: command letter in the top 2 bits, number in the rest
+enum
+{
+    opcodeNone = 0,                     // Parameters only, e.g. a modal "X10 Y20"
+    opcodeG = 1 << 14,
+    opcodeM = 2 << 14,
+    opcodeT = 3 << 14,
+    opcodeNumberMask = (1 << 14) - 1,
+};
+
+// Per-command flags
+enum
+{
+    commandMalformed = 1,               // Lexer or number conversion found a problem
+    commandHasArgument = 2,             // Text argument (M117 etc.); read it from the source
+    commandHasLineNumber = 4,           // Source has its own N word
+};
+
+// Make an opcode; returns opcodeNone if the command has no usable number, e.g. G38.2
+uint16_t makeOpcode(char letter, TextRange number);
+
+// Format an opcode as G1, M104, etc.
+std::string opcodeName(uint16_t opcode);
+
+// Bit for a parameter letter in CommandTable::paramMasks
+inline uint32_t paramBit(char letter) {return 1u << (letter - 'A');}
+
+// A command table's columns, read in place wherever they are: a CommandTable in memory or a
+// mapped table file. Parameter values are packed in letter order: command i's value for
+// letter L is values[valueStarts[i] + number of bits in paramMasks[i] below paramBit(L)].
+// A parameter without a number (G28 X) has a NaN value. flags may have bits set besides the
+// ones above. Only valid while what it reads is alive and unchanged.
+struct CommandColumns
+{
+    size_t commands;
+    const uint16_t* opcodes;
+    const uint32_t* paramMasks;
+    const uint8_t* flags;
+    const uint32_t* valueStarts;
+    const float* values;
+    const uint64_t* offsets;            // Start of line in source
+    const uint32_t* sourceLines;        // 1-based line number in source
+    uint32_t totalLines;                // Lines in source, including blank and comment-only lines
+
+    CommandColumns();                   // No commands
+
+    size_t size() const {return commands;}
+
+    // Get command i's value for letter; returns false if absent
+    bool getValue(size_t i, char letter, float& value) const;
+};
+
+// Every line which has code, as parallel arrays indexed by command; see CommandColumns
+struct CommandTable
+{
+    std::vector<uint16_t> opcodes;
+    std::vector<uint32_t> paramMasks;
+    std::vector<uint8_t> flags;
+    std::vector<uint32_t> valueStarts;
+    std::vector<float> values;
+    std::vector<uint64_t> offsets;
+    std::vector<uint32_t> sourceLines;
+    uint32_t totalLines;
+
+    CommandTable();
+
+    size_t size() const {return opcodes.size();}
+    void clear();
+
+    // The columns to read; valid until the table changes
+    CommandColumns columns() const;
+
+    // Append a lexed line. offset is relative to the start of the source.
+    void add(const GCodeLine& line, uint64_t offset);
+
+    // Append another table whose source follows this one's
+    void append(const CommandTable& other);
+};
+
+// Lex [b, e) into table, splitting the work across threads at line boundaries.
+// threads == 0 uses one per processor. The result doesn't depend on the number of threads.
+void buildCommandTable(const char* b, const char* e, unsigned threads, CommandTable& table);
+
+// Print a summary of a job: command counts, malformed lines, extents
+void printJobStats(const CommandColumns& table);
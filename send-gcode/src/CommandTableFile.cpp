@@ -0,0 +1,402 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#include "CommandTableFile.h"
+#include <algorithm>
+#include <limits.h>
+#include <limits>
+#include <math.h>
+#include <stdexcept>
+#include <string.h>
+
+using namespace std;
+
+const char tableMagic[8] = {'S', 'G', 'T', 'A', 'B', 'L', 'E', 0};
+
+// Decimal places kept for a letter; 9 keeps any value below 2 in an int32_t
+static const int maxDecimals = 9;
+
+static const double powersOf10[] = {1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9};
+
+static unsigned countBits(uint32_t v)
+{
+    v = v - ((v >> 1) & 0x55555555);
+    v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+    return (((v + (v >> 4)) & 0x0f0f0f0f) * 0x01010101) >> 24;
+}
+
+// Significant digits after the point, e.g. 2 for 1.250
+static int fractionDigits(TextRange number)
+{
+    const char* point = find(number.b, number.e, '.');
+    if(point == number.e)
+        return 0;
+    const char* e = number.e;
+    while(e != point + 1 && e[-1] == '0')
+        --e;
+    return (int)(e - point - 1);
+}
+
+static size_t align8(size_t n)
+{
+    return (n + 7) & ~(size_t)7;
+}
+
+// Call f(letter, number, value) for each word CommandTable::add put in the table, in the same
+// way: the first valid word for each letter counts. value is only set if number isn't empty.
+template<typename F>
+static void forEachValue(const GCodeLine& line, F f)
+{
+    uint32_t seen = 0;
+    for(unsigned i = 0; i < line.numWords; ++i)
+    {
+        const GCodeWord& word = line.words[i];
+        int letter = word.letter - 'A';
+        double v = 0;
+        if(letter < 0 || letter >= 26 || (seen & (1u << letter)) || (!word.number.empty() && !toDouble(word.number, v)))
+            continue;
+        seen |= 1u << letter;
+        f(letter, word.number, v);
+    }
+}
+
+bool isCommandTableFile(const MappedFile& file)
+{
+    return file.getSize() >= sizeof(tableMagic) && !memcmp(file.begin(), tableMagic, sizeof(tableMagic));
+}
+
+uint64_t saveCommandTable(const std::string& filename, const CommandTable& table, const char* source, uint64_t sourceSize)
+{
+    const char* sourceEnd = source + sourceSize;
+    size_t n = table.size();
+
+    // Pass 1: pick a scale for each letter which keeps its digits, if the range allows
+    int decimals[26];
+    double largest[26];
+    fill(decimals, decimals + 26, 0);
+    fill(largest, largest + 26, 0.0);
+    uint64_t texts = 0, textBytes = 0;
+    string code;
+    for(size_t i = 0; i < n; ++i)
+    {
+        GCodeLine line;
+        GCodeLexer(source + table.offsets[i], sourceEnd).next(line);
+        if(table.flags[i] & commandMalformed)
+        {
+            code.clear();
+            appendCode(line, code);
+            ++texts;
+            textBytes += code.size();
+        }
+        else if(table.flags[i] & commandHasArgument)
+        {
+            ++texts;
+            textBytes += line.argument.size();
+        }
+        forEachValue(line, [&](int letter, TextRange number, double v){
+            if(number.empty())
+                return;
+            decimals[letter] = max(decimals[letter], min(maxDecimals, fractionDigits(number)));
+            largest[letter] = max(largest[letter], fabs(v));
+        });
+    }
+    TableFileHeader header;
+    memset(&header, 0, sizeof(header));
+    for(int letter = 0; letter < 26; ++letter)
+    {
+        while(decimals[letter] && floor(largest[letter] * powersOf10[decimals[letter]] + 0.5) > INT_MAX)
+            --decimals[letter];
+        if(floor(largest[letter] + 0.5) > INT_MAX)
+            throw runtime_error(string("value of ") + (char)('A' + letter) + " too large for a table file");
+        header.decimals[letter] = (int8_t)decimals[letter];
+    }
+
+    // Pass 2: convert. Numbers come from the text, not the table's floats. A number with more
+    // decimal places than its letter's scale would be rounded, so its command goes as text.
+    vector<int32_t> fixedValues(table.values.size(), tableNoNumber);
+    vector<uint8_t> flags(table.flags);
+    vector<uint64_t> textCommands;
+    vector<uint64_t> textStarts;
+    string text;
+    uint64_t rounded = 0;
+    textCommands.reserve((size_t)texts);
+    textStarts.reserve((size_t)texts + 1);
+    text.reserve((size_t)textBytes);
+    for(size_t i = 0; i < n; ++i)
+    {
+        GCodeLine line;
+        GCodeLexer(source + table.offsets[i], sourceEnd).next(line);
+        bool exact = true;
+        forEachValue(line, [&](int letter, TextRange number, double){
+            if(fractionDigits(number) > decimals[letter])
+                exact = false;
+        });
+        if(!exact && !(table.flags[i] & commandMalformed))
+            ++rounded;
+        if(!exact || (table.flags[i] & commandMalformed))
+        {
+            flags[i] |= commandCodeText;
+            textCommands.push_back(i);
+            textStarts.push_back(text.size());
+            appendCode(line, text);
+        }
+        else if(table.flags[i] & commandHasArgument)
+        {
+            textCommands.push_back(i);
+            textStarts.push_back(text.size());
+            text.append(line.argument.b, line.argument.e);
+        }
+        uint32_t mask = table.paramMasks[i];
+        uint32_t start = table.valueStarts[i];
+        forEachValue(line, [&](int letter, TextRange number, double v){
+            if(!number.empty())
+                fixedValues[start + countBits(mask & ((1u << letter) - 1))] =
+                    (int32_t)floor(v * powersOf10[decimals[letter]] + 0.5);
+        });
+    }
+    textStarts.push_back(text.size());
+
+    memcpy(header.magic, tableMagic, sizeof(header.magic));
+    header.version = tableVersion;
+    header.headerSize = sizeof(header);
+    header.commands = n;
+    header.values = table.values.size();
+    header.texts = textCommands.size();
+    header.textBytes = text.size();
+    header.sourceSize = sourceSize;
+    header.totalLines = table.totalLines;
+
+    // Sections in file order
+    struct Section
+    {
+        uint64_t* offset;
+        const void* data;
+        size_t size;
+    };
+    Section sections[] = {
+        {&header.opcodes,       n ? &table.opcodes[0] : 0,          n * sizeof(uint16_t)},
+        {&header.flags,         n ? &flags[0] : 0,                  n * sizeof(uint8_t)},
+        {&header.paramMasks,    n ? &table.paramMasks[0] : 0,       n * sizeof(uint32_t)},
+        {&header.valueStarts,   n ? &table.valueStarts[0] : 0,      n * sizeof(uint32_t)},
+        {&header.sourceLines,   n ? &table.sourceLines[0] : 0,      n * sizeof(uint32_t)},
+        {&header.offsets,       n ? &table.offsets[0] : 0,          n * sizeof(uint64_t)},
+        {&header.floatValues,   table.values.empty() ? 0 : &table.values[0], table.values.size() * sizeof(float)},
+        {&header.fixedValues,   fixedValues.empty() ? 0 : &fixedValues[0], fixedValues.size() * sizeof(int32_t)},
+        {&header.textCommands,  textCommands.empty() ? 0 : &textCommands[0], textCommands.size() * sizeof(uint64_t)},
+        {&header.textStarts,    &textStarts[0],                     textStarts.size() * sizeof(uint64_t)},
+        {&header.text,          text.data(),                        text.size()},
+    };
+    const size_t numSections = sizeof(sections) / sizeof(sections[0]);
+    size_t pos = align8(sizeof(header));
+    for(size_t i = 0; i < numSections; ++i)
+    {
+        *sections[i].offset = pos;
+        pos = align8(pos + sections[i].size);
+    }
+
+    HANDLE h = CreateFileA(filename.c_str(), GENERIC_WRITE, 0, 0, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+    if(h == INVALID_HANDLE_VALUE)
+        throw runtime_error("can not create table file " + filename);
+    shared_ptr<void> file(h, CloseHandle);
+    static const char padding[8] = {0};
+    auto write = [&](const void* data, size_t size) {
+        // WriteFile takes a DWORD size
+        const char* p = (const char*)data;
+        while(size)
+        {
+            DWORD chunk = (DWORD)min<size_t>(size, 1 << 30);
+            DWORD numWritten = 0;
+            if(!WriteFile(h, p, chunk, &numWritten, 0) || numWritten != chunk)
+                throw runtime_error("can not write table file " + filename);
+            p += chunk;
+            size -= chunk;
+        }
+    };
+    write(&header, sizeof(header));
+    write(padding, align8(sizeof(header)) - sizeof(header));
+    for(size_t i = 0; i < numSections; ++i)
+    {
+        write(sections[i].data, sections[i].size);
+        write(padding, align8(sections[i].size) - sections[i].size);
+    }
+    return rounded;
+}
+
+CommandTableFile::CommandTableFile(const MappedFile& file):
+    file(file),
+    header((const TableFileHeader*)file.begin())
+{
+    uint64_t size = file.getSize();
+    if(size < sizeof(TableFileHeader) || !isCommandTableFile(file))
+        throw runtime_error("not a table file");
+    if(header->version != tableVersion || header->headerSize != sizeof(TableFileHeader))
+        throw runtime_error("unsupported table file version");
+
+    // Every section must be aligned and lie within the file. Counts are checked against the
+    // file size first so the size calculations can't overflow.
+    uint64_t n = header->commands;
+    if(n > size || header->values > size || header->texts > size || header->textBytes > size)
+        throw runtime_error("table file is corrupt");
+    auto section = [&](uint64_t offset, uint64_t bytes) -> const char* {
+        if((offset & 7) || offset < sizeof(TableFileHeader) || offset > size || bytes > size - offset)
+            throw runtime_error("table file is corrupt");
+        return file.begin() + offset;
+    };
+    opcodes = (const uint16_t*)section(header->opcodes, n * sizeof(uint16_t));
+    flags = (const uint8_t*)section(header->flags, n * sizeof(uint8_t));
+    paramMasks = (const uint32_t*)section(header->paramMasks, n * sizeof(uint32_t));
+    valueStarts = (const uint32_t*)section(header->valueStarts, n * sizeof(uint32_t));
+    sourceLines = (const uint32_t*)section(header->sourceLines, n * sizeof(uint32_t));
+    offsets = (const uint64_t*)section(header->offsets, n * sizeof(uint64_t));
+    const float* floatValues = (const float*)section(header->floatValues, header->values * sizeof(float));
+    fixedValues = (const int32_t*)section(header->fixedValues, header->values * sizeof(int32_t));
+    textCommands = (const uint64_t*)section(header->textCommands, header->texts * sizeof(uint64_t));
+    textStarts = (const uint64_t*)section(header->textStarts, (header->texts + 1) * sizeof(uint64_t));
+    text = section(header->text, header->textBytes);
+
+    // Checked once here so accessors can trust the file
+    for(int letter = 0; letter < 26; ++letter)
+        if(header->decimals[letter] < 0 || header->decimals[letter] > maxDecimals)
+            throw runtime_error("table file is corrupt");
+    for(uint64_t i = 0; i < n; ++i)
+        if(valueStarts[i] > header->values || countBits(paramMasks[i]) > header->values - valueStarts[i] ||
+            (paramMasks[i] >> 26))
+            throw runtime_error("table file is corrupt");
+    for(uint64_t i = 0; i < header->texts; ++i)
+        if(textCommands[i] >= n || (i && textCommands[i] <= textCommands[i - 1]) ||
+            textStarts[i] > textStarts[i + 1])
+            throw runtime_error("table file is corrupt");
+    if(textStarts[0] != 0 || textStarts[header->texts] > header->textBytes)
+        throw runtime_error("table file is corrupt");
+
+    view.commands = (size_t)n;
+    view.opcodes = opcodes;
+    view.paramMasks = paramMasks;
+    view.flags = flags;
+    view.valueStarts = valueStarts;
+    view.values = floatValues;
+    view.offsets = offsets;
+    view.sourceLines = sourceLines;
+    view.totalLines = header->totalLines;
+}
+
+bool CommandTableFile::getValue(size_t i, char letter, double& value) const
+{
+    uint32_t bit = paramBit(letter);
+    if(!(paramMasks[i] & bit))
+        return false;
+    int32_t v = fixedValues[valueStarts[i] + countBits(paramMasks[i] & (bit - 1))];
+    if(v == tableNoNumber)
+        value = numeric_limits<double>::quiet_NaN();
+    else
+        value = v / powersOf10[header->decimals[letter - 'A']];
+    return true;
+}
+
+bool CommandTableFile::getText(size_t i, TextRange& range) const
+{
+    const uint64_t* end = textCommands + header->texts;
+    const uint64_t* p = lower_bound(textCommands, end, (uint64_t)i);
+    if(p == end || *p != i)
+        return false;
+    size_t k = p - textCommands;
+    range = TextRange(text + textStarts[k], text + textStarts[k + 1]);
+    return true;
+}
+
+// Append a fixed-point number without trailing zeros, e.g. 12340 with 3 decimals is 12.34
+static void appendFixed(int32_t v, int decimals, std::string& s)
+{
+    char buf[16];
+    char* e = buf + sizeof(buf);
+    char* p = e;
+    uint32_t magnitude = v < 0 ? 0u - (uint32_t)v : (uint32_t)v;
+    while(decimals && magnitude % 10 == 0)
+    {
+        magnitude /= 10;
+        --decimals;
+    }
+    for(int digit = 0; digit < decimals; ++digit)
+    {
+        *--p = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    }
+    if(decimals)
+        *--p = '.';
+    do
+    {
+        *--p = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while(magnitude);
+    if(v < 0)
+        *--p = '-';
+    s.append(p, e);
+}
+
+void CommandTableFile::appendCode(size_t i, std::string& s) const
+{
+    TextRange range;
+    if(flags[i] & commandCodeText)
+    {
+        getText(i, range);
+        s.append(range.b, range.e);
+        return;
+    }
+
+    size_t start = s.size();
+    if(opcodes[i] != opcodeNone)
+        s += opcodeName(opcodes[i]);
+    uint32_t mask = paramMasks[i];
+    const int32_t* v = fixedValues + valueStarts[i];
+    for(int letter = 0; letter < 26; ++letter)
+    {
+        if(!(mask & (1u << letter)))
+            continue;
+        if(s.size() != start)
+            s += ' ';
+        s += (char)('A' + letter);
+        if(*v != tableNoNumber)
+            appendFixed(*v, header->decimals[letter], s);
+        ++v;
+    }
+    if((flags[i] & commandHasArgument) && getText(i, range))
+    {
+        if(s.size() != start)
+            s += ' ';
+        s.append(range.b, range.e);
+    }
+}
+
+TableLineSource::TableLineSource(const CommandTableFile& table):
+    table(table),
+    index(0)
+{
+}
+
+bool TableLineSource::next(uint64_t& id, std::string& s)
+{
+    if(index >= table.size())
+        return false;
+    id = index;
+    table.appendCode(index++, s);
+    return true;
+}
+
+void TableLineSource::get(uint64_t id, std::string& s)
+{
+    table.appendCode((size_t)id, s);
+}
@@ -0,0 +1,135 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#pragma once
+
+#include "CommandTable.h"
+#include "LineSource.h"
+#include "MappedFile.h"
+
+// Command table file layout:
+//      TableFileHeader
+//      sections at the offsets given in the header, each 8-byte aligned
+// All fields are little endian. Parameter values are stored twice: as floats, which are read
+// in place as CommandColumns::values, and as fixed point with a scale per letter, which is
+// what's sent. The scale is chosen when saving so every value in the job fits an int32_t with
+// as many of its decimal places as the range allows; a command with a number which would lose
+// digits at that scale is stored as text instead. The file is used in place through a mapping.
+
+#pragma pack(push, 1)
+struct TableFileHeader
+{
+    char        magic[8];               // tableMagic
+    uint32_t    version;                // tableVersion
+    uint32_t    headerSize;             // sizeof(TableFileHeader)
+    uint64_t    commands;
+    uint64_t    values;
+    uint64_t    texts;                  // Commands with text: an argument, or code the table can't hold exactly
+    uint64_t    textBytes;
+    uint64_t    sourceSize;             // Size of the G-code the table came from
+    uint32_t    totalLines;             // Lines in the source
+    int8_t      decimals[26];           // Per parameter letter: value = stored / 10^decimals
+    uint8_t     reserved[2];
+    uint64_t    opcodes;                // Section offsets: uint16_t[commands]
+    uint64_t    flags;                  // uint8_t[commands]
+    uint64_t    paramMasks;             // uint32_t[commands]
+    uint64_t    valueStarts;            // uint32_t[commands]
+    uint64_t    sourceLines;            // uint32_t[commands]
+    uint64_t    offsets;                // uint64_t[commands]
+    uint64_t    floatValues;            // float[values]; NaN for a letter without a number
+    uint64_t    fixedValues;            // int32_t[values]; tableNoNumber for a letter without a number
+    uint64_t    textCommands;           // uint64_t[texts], ascending
+    uint64_t    textStarts;             // uint64_t[texts + 1], into text
+    uint64_t    text;                   // char[textBytes]
+};
+#pragma pack(pop)
+
+extern const char tableMagic[8];
+const uint32_t tableVersion = 2;
+const int32_t tableNoNumber = (int32_t)0x80000000;
+
+// Flag in the file: the command's code is stored as text, e.g. G38.2, a repeated letter, or a
+// number with more decimal places than its letter's scale. The text is what appendCode() in
+// GCodeLexer.h sends: the source line without its line number, checksum or comments.
+const uint8_t commandCodeText = 0x80;
+
+// Does the file start like a command table?
+bool isCommandTableFile(const MappedFile& file);
+
+// Save table, which was built from source. Numbers are taken from the source text so
+// they aren't limited to float precision. Returns the number of commands stored as text
+// to keep all their decimal places. Throws exception on failure.
+uint64_t saveCommandTable(const std::string& filename, const CommandTable& table, const char* source, uint64_t sourceSize);
+
+// A command table file, used in place. Throws exception if the file isn't valid.
+class CommandTableFile
+{
+private:
+    MappedFile file;
+    const TableFileHeader* header;
+    const uint16_t* opcodes;
+    const uint8_t* flags;
+    const uint32_t* paramMasks;
+    const uint32_t* valueStarts;
+    const uint32_t* sourceLines;
+    const uint64_t* offsets;
+    const int32_t* fixedValues;
+    CommandColumns view;                // Reads the sections above in place
+    const uint64_t* textCommands;
+    const uint64_t* textStarts;
+    const char* text;
+
+public:
+    CommandTableFile(const MappedFile& file);
+
+    size_t size() const {return (size_t)header->commands;}
+    uint32_t getTotalLines() const {return header->totalLines;}
+    uint16_t getOpcode(size_t i) const {return opcodes[i];}
+    uint8_t getFlags(size_t i) const {return flags[i] & ~commandCodeText;}
+    uint32_t getParamMask(size_t i) const {return paramMasks[i];}
+    uint32_t getSourceLine(size_t i) const {return sourceLines[i];}
+    uint64_t getOffset(size_t i) const {return offsets[i];}
+
+    // Get command i's value for letter; returns false if absent. NaN if the letter has no number.
+    bool getValue(size_t i, char letter, double& value) const;
+
+    // Append command i as G-code without line number or checksum
+    void appendCode(size_t i, std::string& s) const;
+
+    // The table, read in place; valid while this is alive
+    const CommandColumns& columns() const {return view;}
+
+private:
+    // Text of command i; returns false if it has none
+    bool getText(size_t i, TextRange& range) const;
+};
+
+// Commands from a table file; ids are command indexes
+class TableLineSource: public LineSource
+{
+private:
+    const CommandTableFile& table;
+    size_t index;                       // Next command
+
+public:
+    TableLineSource(const CommandTableFile& table);     // Caller must keep table alive
+
+    virtual bool next(uint64_t& id, std::string& s);
+    virtual void get(uint64_t id, std::string& s);
+    virtual void rewind(uint64_t id) {index = (size_t)id;}
+    virtual void seek(const CommandColumns&, size_t i) {index = i;}
+};
@@ -0,0 +1,39 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#pragma once
+
+// Stackless coroutines for event-driven code. The body of a coroutine is a member function
+// which is called again for every event; COROUTINE_AWAIT returns to the caller, and the next
+// call carries on after it. The body is a switch on the resume point, so an await costs a
+// store and a return and allocates nothing. Locals don't survive an await, so keep state in
+// members, and don't await inside a switch of your own.
+//
+// Resume points are numbered by hand, each unique within its coroutine and above 0; __LINE__
+// isn't a constant when compiling for Edit and Continue.
+
+// Value of the resume point when the body has run to the end
+const int coroutineFinished = -1;
+
+// Start the body; point is an int member, 0 to start from the top
+#define COROUTINE_BEGIN(point) switch(point) { case 0:
+
+// Return, and continue from here on the next call
+#define COROUTINE_AWAIT(point, n) do { point = (n); return; case (n):; } while(0)
+
+// End the body; later calls do nothing
+#define COROUTINE_END(point) } point = coroutineFinished;
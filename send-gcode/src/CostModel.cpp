@@ -0,0 +1,188 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#include "CostModel.h"
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <stdio.h>
+#include <string.h>
+#include <Windows.h>
+
+using namespace std;
+
+const char costMagic[8] = {'S', 'G', 'C', 'O', 'S', 'T', 0, 0};
+
+// A cell is halved when it has this many answers, so older jobs count for less
+static const uint32_t costHalfLife = 1024;
+
+// Fewer answers than this are too few to go on. Homing and heating come only a few times
+// a job, so it can't be many; timeouts are from the top of a bucket, doubled, to allow for it.
+static const uint32_t costMinAnswers = 3;
+
+template<typename GetValue>
+static unsigned makeKey(uint16_t opcode, uint32_t mask, GetValue getValue)
+{
+    float v;
+    if(opcode == (opcodeG | 0) || opcode == (opcodeG | 1) || (opcode == opcodeNone && mask))
+        return ((mask & paramBit('E')) ? costExtrude : costTravel) * costSizes;
+    else if(opcode == (opcodeG | 28))
+    {
+        unsigned axes = !!(mask & paramBit('X')) + !!(mask & paramBit('Y')) + !!(mask & paramBit('Z'));
+        return costHome * costSizes + (axes ? axes : 3);
+    }
+    else if(opcode == (opcodeG | 4))
+    {
+        double seconds = 0;
+        if(getValue('P', v) && v == v)
+            seconds = v / 1000;
+        else if(getValue('S', v) && v == v)
+            seconds = v;
+        unsigned size = 0;
+        for(double steps = seconds * 10; steps >= 1 && size < costSizes - 1; steps /= 2)
+            ++size;
+        return costDwell * costSizes + size;
+    }
+    else if(opcode == (opcodeM | 109) || opcode == (opcodeM | 190))
+    {
+        unsigned size = 0;
+        if(((getValue('S', v) && v == v) || (getValue('R', v) && v == v)) && v > 0)
+            size = min(costSizes - 1, (unsigned)(v / 32));
+        return (opcode == (opcodeM | 109) ? costHeatHotend : costHeatBed) * costSizes + size;
+    }
+    else if(opcode == (opcodeM | 104) || opcode == (opcodeM | 140))
+        return costSetTemperature * costSizes;
+    else if(opcode == (opcodeM | 105))
+        return costReport * costSizes;
+    else if(opcode == (opcodeM | 400))
+        return costFinishMoves * costSizes;
+    return costOther * costSizes;
+}
+
+unsigned costKey(const GCodeLine& line)
+{
+    uint16_t opcode = line.command.letter ? makeOpcode(line.command.letter, line.command.number) : opcodeNone;
+    if(line.command.letter && opcode == opcodeNone)
+        return costOther * costSizes;
+    uint32_t mask = 0;
+    for(unsigned i = 0; i < line.numWords; ++i)
+        if(line.words[i].letter >= 'A' && line.words[i].letter <= 'Z')
+            mask |= paramBit(line.words[i].letter);
+    return makeKey(opcode, mask, [&](char letter, float& v) -> bool {
+        const GCodeWord* word = line.find(letter);
+        if(!word)
+            return false;
+        double d;
+        v = !word->number.empty() && toDouble(word->number, d) ? (float)d : numeric_limits<float>::quiet_NaN();
+        return true;
+    });
+}
+
+unsigned costKey(const CommandColumns& table, size_t i)
+{
+    return makeKey(table.opcodes[i], table.paramMasks[i], [&](char letter, float& v) {
+        return table.getValue(i, letter, v);});
+}
+
+CostModel::CostModel():
+    recorded(0)
+{
+    memset(cells, 0, sizeof(cells));
+}
+
+bool CostModel::load(const std::string& filename)
+{
+    shared_ptr<FILE> f(fopen(filename.c_str(), "rb"), [](FILE* f){if(f) fclose(f);});
+    if(!f)
+        return false;
+
+    CostFileHeader header;
+    if(fread(&header, sizeof(header), 1, &*f) != 1 || memcmp(header.magic, costMagic, sizeof(costMagic)))
+        throw runtime_error(filename + " is not a cost model file");
+    if(header.version != costVersion || header.cells != costCells)
+        throw runtime_error(filename + " has an unsupported cost model version");
+    if(fread(cells, sizeof(cells), 1, &*f) != 1)
+        throw runtime_error(filename + " is corrupt");
+    return true;
+}
+
+void CostModel::save(const std::string& filename) const
+{
+    HANDLE h = CreateFileA(filename.c_str(), GENERIC_WRITE, 0, 0, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+    if(h == INVALID_HANDLE_VALUE)
+        throw runtime_error("can not create cost model file " + filename);
+    shared_ptr<void> file(h, CloseHandle);
+
+    CostFileHeader header;
+    memcpy(header.magic, costMagic, sizeof(header.magic));
+    header.version = costVersion;
+    header.cells = costCells;
+    DWORD numWritten = 0;
+    if(!WriteFile(h, &header, sizeof(header), &numWritten, 0) || numWritten != sizeof(header) ||
+        !WriteFile(h, cells, sizeof(cells), &numWritten, 0) || numWritten != sizeof(cells))
+    {
+        throw runtime_error("can not write cost model file " + filename);
+    }
+}
+
+void CostModel::record(unsigned key, uint64_t latencyUs)
+{
+    if(key >= costCells)
+        return;
+    CostCell& cell = cells[key];
+    if(cell.count >= costHalfLife)
+    {
+        // Round up, so a bucket with anything in it keeps something
+        uint32_t count = 0;
+        for(unsigned i = 0; i < costBuckets; ++i)
+        {
+            cell.latency[i] -= cell.latency[i] / 2;
+            count += cell.latency[i];
+        }
+        cell.totalUs = (uint64_t)((double)cell.totalUs * count / cell.count);
+        cell.count = count;
+    }
+
+    unsigned bucket = 0;
+    for(uint64_t t = latencyUs / costUnitUs; t > 1 && bucket < costBuckets - 1; t >>= 1)
+        ++bucket;
+    ++cell.latency[bucket];
+    ++cell.count;
+    cell.totalUs += latencyUs;
+    ++recorded;
+}
+
+double CostModel::getMean(unsigned key) const
+{
+    if(key >= costCells || cells[key].count < costMinAnswers)
+        return 0;
+    return cells[key].totalUs / 1000000.0 / cells[key].count;
+}
+
+unsigned CostModel::getTimeoutMs(unsigned key) const
+{
+    if(key >= costCells || cells[key].count < costMinAnswers)
+        return 0;
+    const CostCell& cell = cells[key];
+    uint32_t within = cell.count - cell.count / 100;
+    uint32_t sum = 0;
+    unsigned bucket = 0;
+    while(bucket < costBuckets - 1 && (sum += cell.latency[bucket]) < within)
+        ++bucket;
+    return (unsigned)(2 * ((uint64_t)costUnitUs << (bucket + 1)) / 1000);
+}
@@ -0,0 +1,108 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#pragma once
+
+#include "CommandTable.h"
+#include <string>
+
+// Cost model file layout:
+//      CostFileHeader
+//      CostCell[costCells]
+// All fields are little endian. The whole file is rewritten after each job.
+
+// Kinds of command whose answers are timed separately
+enum CostClass
+{
+    costTravel,                         // G0 or G1 without E; also a modal move
+    costExtrude,                        // G0 or G1 with E
+    costHome,                           // G28; parameter class is the number of axes homed
+    costDwell,                          // G4; parameter class is log2 of the dwell in 100 ms steps
+    costSetTemperature,                 // M104 or M140
+    costHeatHotend,                     // M109; parameter class is the target in 32 degree steps
+    costHeatBed,                        // M190; likewise
+    costReport,                         // M105
+    costFinishMoves,                    // M400
+    costOther,
+    costClasses,
+};
+
+// Parameter classes of each CostClass, and cells in a model
+const unsigned costSizes = 8;
+const unsigned costCells = costClasses * costSizes;
+
+// Buckets of CostCell::latency. Bucket i counts answers which took from 2^i to 2^(i+1)
+// times costUnitUs, except that bucket 0 starts at 0 and the last bucket has no end.
+const unsigned costBuckets = 20;
+const unsigned costUnitUs = 1000;
+
+#pragma pack(push, 1)
+struct CostFileHeader
+{
+    char        magic[8];               // costMagic
+    uint32_t    version;                // costVersion
+    uint32_t    cells;                  // costCells
+};
+
+struct CostCell
+{
+    uint32_t    count;                  // Answers; the sum of latency[]
+    uint32_t    latency[costBuckets];
+    uint64_t    totalUs;                // Sum of their times
+};
+#pragma pack(pop)
+
+extern const char costMagic[8];
+const uint32_t costVersion = 1;
+
+// Cell of a command: CostClass * costSizes + parameter class
+unsigned costKey(const GCodeLine& line);
+unsigned costKey(const CommandColumns& table, size_t i);
+
+// How long one printer takes to answer each kind of command, learned from the time between
+// sending a numbered frame and its "ok". Recording only adds to a fixed table, so it costs
+// the same however long the job is. Once a cell has costHalfLife answers they are all
+// halved, so the model follows a printer whose firmware or hardware changes.
+class CostModel
+{
+private:
+    CostCell cells[costCells];
+    unsigned recorded;                  // Answers recorded since construction
+
+public:
+    CostModel();
+
+    // Read a model saved by save(). Returns false if the file doesn't exist.
+    // Throws exception if it isn't a cost model.
+    bool load(const std::string& filename);
+
+    // Write the model; throws exception on failure
+    void save(const std::string& filename) const;
+
+    // The firmware answered a command with key after latencyUs
+    void record(unsigned key, uint64_t latencyUs);
+
+    // Answers recorded since construction
+    unsigned getRecorded() const {return recorded;}
+
+    // Mean seconds to answer a command with key; 0 if too few have been answered to go on
+    double getMean(unsigned key) const;
+
+    // How long (ms) to wait for an answer to a command with key before suspecting it was lost:
+    // twice the time within which 99% of them were answered. 0 if too few have been answered.
+    unsigned getTimeoutMs(unsigned key) const;
+};
@@ -0,0 +1,35 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#include "EventLoop.h"
+#include <stdexcept>
+
+using namespace std;
+
+void runEventLoop(const std::vector<Event>& events, std::function<bool()> done, bool failWhenIdle)
+{
+    WaitReactor reactor;
+    reactor.add(events);
+    runReactor(reactor, done, failWhenIdle);
+}
+
+void runReactor(Reactor& reactor, std::function<bool()> done, bool failWhenIdle)
+{
+    while(!done())
+        if(!reactor.step(failWhenIdle ? 0 : INFINITE) && failWhenIdle)
+            throw runtime_error("stalled: nothing left to wait for");
+}
@@ -0,0 +1,29 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#pragma once
+
+#include "Reactor.h"
+
+// Dispatch events until done() returns true. If failWhenIdle is set, throw instead of
+// blocking when no event is signaled; with only virtual-clock events that means the session
+// has stalled and would otherwise wait forever.
+void runEventLoop(const std::vector<Event>& events, std::function<bool()> done, bool failWhenIdle);
+
+// Step reactor until done() returns true. If failWhenIdle is set, steps don't wait, and
+// throw if nothing was signaled.
+void runReactor(Reactor& reactor, std::function<bool()> done, bool failWhenIdle);
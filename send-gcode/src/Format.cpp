@@ -0,0 +1,43 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#include "Format.h"
+#include <stdio.h>
+
+using namespace std;
+
+std::string toString(unsigned n)
+{
+    if(!n)
+        return "0";
+
+    string s;
+    while(n)
+    {
+        s = string(1, char('0' + n%10)) + s;
+        n /= 10;
+    }
+    return s;
+}
+
+std::string formatDuration(double seconds)
+{
+    unsigned s = seconds > 0 ? (unsigned)(seconds + 0.5) : 0;
+    char buf[32];
+    sprintf(buf, "%u:%02u:%02u", s / 3600, s / 60 % 60, s % 60);
+    return buf;
+}
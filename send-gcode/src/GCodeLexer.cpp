@@ -0,0 +1,340 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#include "GCodeLexer.h"
+#include <string.h>
+
+using namespace std;
+
+namespace
+{
+    enum CharClass
+    {
+        otherChar,
+        spaceChar,
+        letterChar,
+        numberChar,                     // Digits, sign and decimal point
+        semicolonChar,
+        parenChar,
+        starChar,
+    };
+
+    // Looking up a table is faster than a chain of comparisons in the inner loop
+    struct CharClasses
+    {
+        unsigned char classes[256];
+
+        CharClasses()
+        {
+            memset(classes, otherChar, sizeof(classes));
+            classes[' '] = classes['\t'] = classes['\r'] = classes['\v'] = classes['\f'] = spaceChar;
+            for(int ch = 'A'; ch <= 'Z'; ++ch)
+                classes[ch] = classes[ch + 'a' - 'A'] = letterChar;
+            for(int ch = '0'; ch <= '9'; ++ch)
+                classes[ch] = numberChar;
+            classes['-'] = classes['+'] = classes['.'] = numberChar;
+            classes[';'] = semicolonChar;
+            classes['('] = parenChar;
+            classes['*'] = starChar;
+        }
+    };
+
+    // Built before main() so threads can share it
+    const CharClasses charClasses;
+
+    inline unsigned classOf(char ch)
+    {
+        return charClasses.classes[(unsigned char)ch];
+    }
+
+    // Commands whose argument is free text, e.g. M117 Printing... or M118 Hello
+    bool hasTextArgument(const GCodeWord& command)
+    {
+        unsigned code;
+        return command.letter == 'M' && toUnsigned(command.number, code) &&
+            (code == 23 || code == 28 || code == 30 || code == 32 || code == 33 ||
+            code == 117 || code == 118 || code == 928);
+    }
+}
+
+const GCodeWord* GCodeLine::find(char letter) const
+{
+    for(unsigned i = 0; i < numWords; ++i)
+        if(words[i].letter == letter)
+            return &words[i];
+    return 0;
+}
+
+GCodeLexer::GCodeLexer(const char* b, const char* e, unsigned firstSourceLine):
+    pos(b),
+    end(e),
+    sourceLine(firstSourceLine)
+{
+}
+
+bool GCodeLexer::next(GCodeLine& line)
+{
+    if(pos == end)
+        return false;
+
+    const char* b = pos;
+    const char* nl = (const char*)memchr(b, '\n', end - b);
+    const char* e = nl ? nl : end;
+    pos = nl ? nl + 1 : end;
+    if(e != b && e[-1] == '\r')
+        --e;
+
+    line.sourceLine = sourceLine++;
+    line.text = TextRange(b, e);
+    line.hasLineNumber = false;
+    line.lineNumber = 0;
+    line.lineNumberWord = TextRange();
+    line.checksumStart = 0;
+    line.checksum = 0;
+    line.command.letter = 0;
+    line.command.number = TextRange();
+    line.numWords = 0;
+    line.argument = TextRange();
+    line.hasComment = false;
+    line.malformed = false;
+
+    const char* p = b;
+    while(p != e)
+    {
+        switch(classOf(*p))
+        {
+        case spaceChar:
+            ++p;
+            break;
+
+        case semicolonChar:
+            line.hasComment = true;
+            p = e;
+            break;
+
+        case parenChar:
+            line.hasComment = true;
+            while(p != e && *p != ')')
+                ++p;
+            if(p != e)
+                ++p;
+            break;
+
+        case starChar:
+        {
+            line.checksumStart = p;
+            const char* digits = ++p;
+            while(p != e && *p >= '0' && *p <= '9')
+                ++p;
+            if(!toUnsigned(TextRange(digits, p), line.checksum))
+                line.malformed = true;
+            while(p != e && classOf(*p) == spaceChar)
+                ++p;
+            if(p != e)
+                line.malformed = true;
+            p = e;
+            break;
+        }
+
+        case letterChar:
+        {
+            GCodeWord word;
+            word.letter = *p & ~0x20;
+            const char* number = ++p;
+            while(p != e && classOf(*p) == numberChar)
+                ++p;
+            word.number = TextRange(number, p);
+
+            if(line.command.letter || line.numWords)
+            {
+                if(line.numWords < GCodeLine::maxWords)
+                    line.words[line.numWords++] = word;
+                else
+                    line.malformed = true;
+            }
+            else if(word.letter == 'N' && !line.hasLineNumber)
+            {
+                line.hasLineNumber = true;
+                line.lineNumberWord = TextRange(number - 1, p);
+                if(!toUnsigned(word.number, line.lineNumber))
+                    line.malformed = true;
+            }
+            else if(word.letter == 'G' || word.letter == 'M' || word.letter == 'T')
+            {
+                line.command = word;
+                if(hasTextArgument(word))
+                {
+                    // Runs to the checksum or comment; a single separating space isn't part of it
+                    if(p != e && *p == ' ')
+                        ++p;
+                    const char* argument = p;
+                    while(p != e && *p != '*' && *p != ';')
+                        ++p;
+                    const char* argumentEnd = p;
+                    while(argumentEnd != argument && classOf(argumentEnd[-1]) == spaceChar)
+                        --argumentEnd;
+                    line.argument = TextRange(argument, argumentEnd);
+                }
+            }
+            else
+                line.words[line.numWords++] = word;
+            break;
+        }
+
+        default:
+            line.malformed = true;
+            ++p;
+            break;
+        }
+    }
+    return true;
+}
+
+// Append the text of a line the lexer couldn't make sense of, without comments, N word or
+// checksum; the firmware may still understand it
+static void appendText(const GCodeLine& line, std::string& s)
+{
+    const char* p = line.text.b;
+    const char* e = line.checksumStart ? line.checksumStart : line.text.e;
+
+    size_t start = s.size();
+    bool space = false;
+    while(p != e)
+    {
+        if(*p == ';')
+            break;
+        if(line.hasLineNumber && p == line.lineNumberWord.b)
+        {
+            // After leading space or a comment, or wherever else the lexer found it
+            p = line.lineNumberWord.e;
+            space = true;
+            continue;
+        }
+        if(*p == '(')
+        {
+            while(p != e && *p != ')')
+                ++p;
+            if(p != e)
+                ++p;
+            space = true;
+            continue;
+        }
+        if(classOf(*p) == spaceChar)
+            space = true;
+        else
+        {
+            if(space && s.size() != start)
+                s += ' ';
+            space = false;
+            s += *p;
+        }
+        ++p;
+    }
+}
+
+void appendCode(const GCodeLine& line, std::string& s)
+{
+    if(line.malformed)
+    {
+        appendText(line, s);
+        return;
+    }
+
+    size_t start = s.size();
+    if(line.command.letter)
+    {
+        s += line.command.letter;
+        s.append(line.command.number.b, line.command.number.e);
+    }
+    for(unsigned i = 0; i < line.numWords; ++i)
+    {
+        if(s.size() != start)
+            s += ' ';
+        s += line.words[i].letter;
+        s.append(line.words[i].number.b, line.words[i].number.e);
+    }
+    if(!line.argument.empty())
+    {
+        if(s.size() != start)
+            s += ' ';
+        s.append(line.argument.b, line.argument.e);
+    }
+}
+
+uint8_t checksum(const char* b, const char* e)
+{
+    uint8_t cs = 0;
+    while(b != e)
+        cs ^= *b++;
+    return cs;
+}
+
+bool toDouble(TextRange number, double& value)
+{
+    static const double scale[] = {1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18};
+
+    const char* p = number.b;
+    bool negative = false;
+    if(p != number.e && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+
+    // Digits beyond what a uint64_t holds can only be insignificant fraction digits
+    uint64_t mantissa = 0;
+    unsigned fractionDigits = 0;
+    unsigned digits = 0;
+    bool point = false;
+    for(; p != number.e; ++p)
+    {
+        if(*p >= '0' && *p <= '9')
+        {
+            if(digits < 18)
+            {
+                mantissa = mantissa * 10 + (*p - '0');
+                if(point)
+                    ++fractionDigits;
+            }
+            else if(!point)
+                return false;
+            ++digits;
+        }
+        else if(*p == '.' && !point)
+            point = true;
+        else
+            return false;
+    }
+    if(!digits)
+        return false;
+
+    value = mantissa / scale[fractionDigits];
+    if(negative)
+        value = -value;
+    return true;
+}
+
+bool toUnsigned(TextRange number, unsigned& value)
+{
+    if(number.empty() || number.size() > 9)
+        return false;
+    value = 0;
+    for(const char* p = number.b; p != number.e; ++p)
+    {
+        if(*p < '0' || *p > '9')
+            return false;
+        value = value * 10 + (*p - '0');
+    }
+    return true;
+}
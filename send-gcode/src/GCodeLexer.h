@@ -0,0 +1,96 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+// A view of text owned by someone else
+struct TextRange
+{
+    const char* b;
+    const char* e;
+
+    TextRange(): b(0), e(0) {}
+    TextRange(const char* b, const char* e): b(b), e(e) {}
+
+    bool empty() const {return b == e;}
+    size_t size() const {return e - b;}
+};
+
+// A letter and the number after it, e.g. X-1.5
+struct GCodeWord
+{
+    char letter;                        // Upper case
+    TextRange number;                   // May be empty
+};
+
+// One line of G-code, split into words. All text is a view into the lexer's input.
+struct GCodeLine
+{
+    enum {maxWords = 24};
+
+    unsigned sourceLine;                // 1-based line number in the input
+    TextRange text;                     // Whole line without the line ending
+    bool hasLineNumber;                 // N word present
+    unsigned lineNumber;                // Value of N word
+    TextRange lineNumberWord;           // The N word itself, wherever it is, e.g. "N12"; empty if none
+    const char* checksumStart;          // '*', or null if no checksum. The checksum covers [text.b, checksumStart)
+    unsigned checksum;                  // Value after '*'
+    GCodeWord command;                  // G, M or T word; letter is 0 if the line has none
+    GCodeWord words[maxWords];          // Parameters in order
+    unsigned numWords;
+    TextRange argument;                 // Text argument of M23, M28, M30, M32 and M117
+    bool hasComment;                    // ; or ( ) comment present
+    bool malformed;                     // Stray characters or too many words; the words lexed so far are kept
+
+    // Is there anything to send?
+    bool hasCode() const {return command.letter || numWords || !argument.empty();}
+
+    // Find parameter by upper-case letter; returns null if absent
+    const GCodeWord* find(char letter) const;
+};
+
+// Splits text into lines of words without copying or allocating
+class GCodeLexer
+{
+private:
+    const char* pos;
+    const char* end;
+    unsigned sourceLine;
+
+public:
+    GCodeLexer(const char* b, const char* e, unsigned firstSourceLine = 1);
+
+    // Lex the next line; returns false at end of input
+    bool next(GCodeLine& line);
+
+    // Start of the next line
+    const char* position() const {return pos;}
+};
+
+// Append line's code without comments, line number or checksum. A malformed line keeps the rest
+// of its text as it is, so nothing the lexer didn't understand is dropped.
+void appendCode(const GCodeLine& line, std::string& s);
+
+// XOR checksum used by RepRap firmware
+uint8_t checksum(const char* b, const char* e);
+
+// Convert a word's number; returns false if it isn't a valid number
+bool toDouble(TextRange number, double& value);
+bool toUnsigned(TextRange number, unsigned& value);
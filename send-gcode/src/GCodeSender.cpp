@@ -16,108 +16,612 @@
 // Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
 
 #include "GCodeSender.h"
+#include "CostModel.h"
+#include "JobProgress.h"
+#include "ProgressJournal.h"
+#include "SessionCapture.h"
+#include "Telemetry.h"
+#include "TrafficLog.h"
 
 #include <algorithm>
+#include <stdexcept>
 #include <stdint.h>
 
 using namespace std;
 
-std::string toString(unsigned n)
+// Line number requested by "Resend: 123" or "rs 123"
+static bool parseResend(const char* b, const char* e, unsigned& line)
 {
-    if(!n)
-        return "0";
+    while(b != e && !isdigit((unsigned char)*b))
+        ++b;
+    if(b == e)
+        return false;
+    line = 0;
+    while(b != e && isdigit((unsigned char)*b))
+        line = line * 10 + (*b++ - '0');
+    return true;
+}
 
-    string s;
-    while(n)
-    {
-        s = string(1, char('0' + n%10)) + s;
-        n /= 10;
-    }
-    return s;
+std::string operatorCode(const std::string& text, uint16_t& opcode)
+{
+    GCodeLexer lexer(text.data(), text.data() + text.size());
+    GCodeLine line, more;
+    if(!lexer.next(line) || !line.hasCode())
+        throw runtime_error("no code in \"" + text + "\"");
+    while(lexer.next(more))
+        if(more.hasCode())
+            throw runtime_error("more than one line in \"" + text + "\"");
+    opcode = line.command.letter ? makeOpcode(line.command.letter, line.command.number) : opcodeNone;
+    if(line.malformed || (line.command.letter && opcode == opcodeNone))
+        throw runtime_error("can not make sense of \"" + text + "\"");
+    string code;
+    appendCode(line, code);
+    return code;
+}
+
+SenderOptions::SenderOptions():
+    log(0),
+    capture(0),
+    timeoutMs(0),
+    progress(0),
+    journal(0),
+    sendM73(false),
+    firstIndex(0),
+    onReset(resetStop),
+    temperatureMs(0),
+    telemetry(0),
+    statusWriter([](const char* s){printf("%s", s);}),
+    window(1),
+    costs(0),
+    holdFailures(false)
+{
 }
 
 GCodeSender::GCodeSender(
-    const char* port,
-    unsigned bps,
-    const char* content,
-    const char* contentEnd,
-    bool verbose):
-        serial(
-            [this](const char* b, const char* e){receiveLine(b, e);},
-            [](const char* s){printf("%s", s);}),
-        verbose(verbose),
-        pos(content),
-        contentEnd(contentEnd),
-        lastSent(content),
+    Clock& clock,
+    TransportFactory transportFactory,
+    std::unique_ptr<LineSource> source,
+    const SenderOptions& options):
+        clock(clock),
+        transport(transportFactory(
+            [this](const char* b, const char* e){guard([&](){receiveLine(b, e);});},
+            options.statusWriter)),
+        options(options),
+        source(move(source)),
+        sentAny(false),
+        firstId(0),
+        anyAccepted(false),
+        acceptedId(0),
+        acceptedIndex(0),
+        state(options.state),
+        preamble(options.preamble),
+        nextIndex(options.firstIndex),
+        preambleSent(0),
         lastChecksumLine(0),
-        sentM110(false),
-        done(false)
+        nextLine(1),
+        window(1),
+        staleFrames(0),
+        frontRejected(false),
+        answerTime(0),
+        probes(0),
+        probeWaits(0),
+        resumePoint(0),
+        stopped(false),
+        failed(false),
+        timeoutTimer(0),
+        pollTimer(0),
+        pollPending(false)
+{
+    memset(&stats, 0, sizeof(stats));
+    for(int i = 0; i < 64; ++i)
+        history[i].number = 0;
+    this->options.window = max(1u, min(maxWindow, options.window));
+    if(options.holdFailures)
+    {
+        const vector<Event>& inner = transport->getEvents();
+        for(size_t i = 0; i < inner.size(); ++i)
+        {
+            function<void()> handler = get<1>(inner[i]);
+            events.push_back(Event(get<0>(inner[i]), [this, handler](){guard(handler);}));
+        }
+    }
+    if(options.temperatureMs)
+        pollTimer = clock.setTimer(clock.now() + options.temperatureMs * (uint64_t)1000, [this](){guard([this](){onPoll();});});
+    run(eventStart);
+}
+
+GCodeSender::~GCodeSender()
+{
+    clock.cancelTimer(timeoutTimer);
+    clock.cancelTimer(pollTimer);
+}
+
+// History id of the M110 which starts numbering
+static const uint64_t m110Id = (uint64_t)-1;
+
+// History ids of M73 lines have this bit set, with the percentage and minutes below it
+static const uint64_t m73Id = (uint64_t)1 << 63;
+
+// History ids of preamble lines have this bit set, with the index in the preamble below it
+static const uint64_t preambleId = (uint64_t)1 << 62;
+
+// History id of a priority line; its code is in the history. LineSource ids are below it.
+static const uint64_t priorityId = (uint64_t)1 << 61;
+
+static void appendM73(uint64_t id, std::string& s)
+{
+    s += "M73 P" + toString((unsigned)(id >> 32 & 0xff)) + " R" + toString((unsigned)id);
+}
+
+void GCodeSender::run(SenderEvent event, unsigned line)
+{
+    if(getFinished())
+        return;
+    if(event == eventReset)
+    {
+        onReset();
+        resumePoint = 0;
+    }
+
+    COROUTINE_BEGIN(resumePoint)
+        window = options.window;
+        sendNew(m110Id, 0, "N" + toString(lastChecksumLine + 1) + " M110");
+        do
+        {
+            while(inFlight.size() >= window || probes)
+            {
+                COROUTINE_AWAIT(resumePoint, 1);
+                handleEvent(event, line);
+            }
+        }
+        while(sendNext());
+
+        if(window > 1)
+        {
+            // Answers to streamed frames are counted rather than matched, and noise can throw the count
+            // off. Only the answer to a probe sent after them all shows the firmware has handled them.
+            sendProbe();
+            do
+            {
+                COROUTINE_AWAIT(resumePoint, 2);
+                handleEvent(event, line);
+                if(event == eventTimeout && !probes)
+                    sendProbe();
+            }
+            while(event != eventTemperatureOk || probes);
+
+            // Then finish with a frame sent on its own. The firmware takes it only if it took every
+            // frame before it, and otherwise asks for the first one it's missing.
+            window = 1;
+            sendPriority("M105");
+            do
+            {
+                while(!inFlight.empty() || probes)
+                {
+                    COROUTINE_AWAIT(resumePoint, 3);
+                    handleEvent(event, line);
+                }
+            }
+            while(sendNext());
+        }
+
+        clock.cancelTimer(timeoutTimer);
+        timeoutTimer = 0;
+        clock.cancelTimer(pollTimer);
+        pollTimer = 0;
+    COROUTINE_END(resumePoint)
+}
+
+void GCodeSender::handleEvent(SenderEvent event, unsigned line)
+{
+    if(event == eventTemperatureOk && probes)
+    {
+        // Numbered frames are never sent while a probe is out, so its answer covers them all
+        --probes;
+        while(!inFlight.empty())
+        {
+            bool accepted = !frontRejected && !staleFrames;
+            frontRejected = false;
+            answered(accepted);
+        }
+    }
+    else if(event == eventOk || event == eventTemperatureOk)
+    {
+        // The firmware answers frames in order. An "ok" with only probes out answers a garbled probe.
+        if(inFlight.empty())
+        {
+            if(probes)
+                --probes;
+        }
+        else if(frontRejected)
+        {
+            frontRejected = false;
+            answered(false);
+        }
+        else
+        {
+            // Taking a frame means the firmware has seen every frame sent before the last rewind;
+            // any of those still here lost their newline or went missing, so never got an answer
+            while(staleFrames && inFlight.size() > 1)
+                answered(false);
+            answered(true);
+        }
+    }
+    else if(event == eventResend)
+    {
+        // If it wants a line we haven't sent, the last one got through and there's nothing to repeat.
+        // Otherwise the "ok" which follows refuses the oldest frame. Every frame already sent after the
+        // one it wants is refused with the same request, so only the first request rewinds.
+        if(line <= lastChecksumLine)
+        {
+            if(!staleFrames)
+            {
+                // Frames before the one it wants were taken, even if an "ok" went missing
+                while(!inFlight.empty() && inFlight.front() < line)
+                    answered(true);
+                nextLine = line;
+                staleFrames = inFlight.size();
+            }
+            frontRejected = !inFlight.empty();
+        }
+    }
+    else if(event == eventTimeout)
+    {
+        // Either the "ok" was lost or it's late. Repeating the frame would leave two frames in flight
+        // if it's late, and every answer after that would be misread. Instead ask for the temperature;
+        // its distinct "ok T:" means everything sent before it has been handled. If a frame itself
+        // was lost, the firmware will ask for it when the next one arrives. A long move can outlast
+        // several timeouts, so only probe again if the last probe seems lost too.
+        if(inFlight.empty())
+            probes = 0;     // Everything else was answered, so nothing is holding up the probes; they were lost
+        else if(probes && ++probeWaits < 3)
+            armTimeout();
+        else
+            sendProbe();
+    }
+}
+
+bool GCodeSender::sendNext()
+{
+    if(nextLine <= lastChecksumLine)
+    {
+        // Repeating lines the firmware asked for
+        const SentLine& sent = history[nextLine % 64];
+        if(sent.number != nextLine)
+            throw runtime_error("firmware asked for line " + toString(nextLine) + ", which is too old to resend");
+        string s = "N" + toString(nextLine++) + " ";
+        if(sent.id == m110Id)
+            s += "M110";
+        else if(sent.id & m73Id)
+            appendM73(sent.id, s);
+        else if(sent.id & preambleId)
+            s += preamble[(size_t)(sent.id & ~preambleId)];
+        else if(sent.id == priorityId)
+            s += sent.code;
+        else
+            source->get(sent.id, s);
+        sendNumbered(nextLine - 1, move(s));
+        return true;
+    }
+
+    uint64_t id;
+    string s = "N" + toString(lastChecksumLine + 1) + " ";
+    unsigned percent, minutes;
+    if(!priority.empty())
+    {
+        SentLine& sent = history[(lastChecksumLine + 1) % 64];
+        s += priority.front().code;
+        sent.code.swap(priority.front().code);
+        sent.reply.swap(priority.front().reply);
+        priority.pop_front();
+        sendNew(priorityId, 0, move(s));
+    }
+    else if(preambleSent < preamble.size())
+    {
+        id = preambleId | preambleSent;
+        s += preamble[preambleSent++];
+        sendNew(id, 0, move(s));
+    }
+    else if(options.sendM73 && options.progress && options.progress->m73Before((size_t)nextIndex, percent, minutes))
+    {
+        id = m73Id | (uint64_t)percent << 32 | minutes;
+        appendM73(id, s);
+        sendNew(id, 0, move(s));
+    }
+    else if(source->next(id, s))
+    {
+        if(!sentAny)
+        {
+            sentAny = true;
+            firstId = id;
+        }
+        uint64_t index = nextIndex++;
+        sendNew(id, index, move(s));
+    }
+    else
+        return false;
+    return true;
+}
+
+void GCodeSender::sendPriority(const std::string& code, LineHandler reply)
 {
-    serial.open(port, bps);
-    send();
+    // run() always has frames out until it's done, and takes this when there's room
+    if(getFinished())
+        return;
+    PriorityLine line;
+    line.code = code;
+    line.reply = reply;
+    priority.push_back(line);
 }
 
-void GCodeSender::send()
+void GCodeSender::guard(const std::function<void()>& handler)
 {
-    if(!sentM110)
+    if(!options.holdFailures)
     {
-        string s = "N" + toString(++lastChecksumLine) + " M110";
-        uint8_t cs = 0;
-        for_each(s.begin(), s.end(), [&cs](char ch){
-            cs = cs ^ ch;});
-        s += "*" + toString(cs) + "\n";
-        if(verbose)
-            printf("send: %s", s.c_str());
-        serial.send(move(s));
-        sentM110 = true;
+        handler();
         return;
     }
+    try
+    {
+        handler();
+    }
+    catch(exception& e)
+    {
+        fail(e.what());
+    }
+}
 
-    bool sentLine = false;
-    while(pos != contentEnd && !sentLine)
+void GCodeSender::fail(const std::string& error)
+{
+    if(failed)
+        return;
+    failed = true;
+    this->error = error;
+    resumePoint = coroutineFinished;
+    clock.cancelTimer(timeoutTimer);
+    timeoutTimer = 0;
+    clock.cancelTimer(pollTimer);
+    pollTimer = 0;
+}
+
+void GCodeSender::emergencyStop()
+{
+    string s = "M112\n";
+    if(options.log)
+        options.log->sent(s.data(), s.data() + s.size());
+    if(options.capture)
+        options.capture->tx(s.data(), s.data() + s.size());
+    ++stats.framesSent;
+    stats.bytesSent += s.size();
+    transport->sendUrgent(move(s));
+    resumePoint = coroutineFinished;
+    stopped = true;
+    clock.cancelTimer(timeoutTimer);
+    timeoutTimer = 0;
+    clock.cancelTimer(pollTimer);
+    pollTimer = 0;
+}
+
+void GCodeSender::sendNew(uint64_t id, uint64_t index, std::string&& s)
+{
+    nextLine = ++lastChecksumLine + 1;
+    SentLine& sent = history[lastChecksumLine % 64];
+    sent.number = lastChecksumLine;
+    sent.id = id;
+    sent.index = index;
+    GCodeLine line;
+    if(options.costs)
+        sent.costKey = GCodeLexer(s.data(), s.data() + s.size()).next(line) ? costKey(line) : costOther * costSizes;
+    sendNumbered(lastChecksumLine, move(s));
+}
+
+void GCodeSender::answered(bool accepted)
+{
+    unsigned number = inFlight.front();
+    inFlight.pop_front();
+    if(staleFrames)
+        --staleFrames;
+
+    const SentLine& sent = history[number % 64];
+    uint64_t now = clock.now();
+    unsigned bucket = 0;
+    for(uint64_t t = (now - sent.sentTime) / okLatencyUnitUs; t > 1 && bucket < okLatencyBuckets - 1; t >>= 1)
+        ++bucket;
+    ++stats.okLatency[bucket];
+
+    // A streamed frame waits for the ones ahead of it; its cost starts when they're done
+    if(accepted && options.costs && sent.number == number)
+        options.costs->record(sent.costKey, now - max(sent.sentTime, answerTime));
+    answerTime = now;
+
+    if(accepted)
+        acknowledged(number);
+}
+
+void GCodeSender::acknowledged(unsigned number)
+{
+    const SentLine& sent = history[number % 64];
+    if(sent.number != number || sent.id >= priorityId)
+        return;
+
+    // Only the job's own lines change its state; a preamble puts the printer into it
+    GCodeLine line;
+    if(GCodeLexer(sent.frame.data(), sent.frame.data() + sent.frame.size()).next(line))
+        state.apply(line);
+    anyAccepted = true;
+    acceptedId = sent.id;
+    acceptedIndex = sent.index;
+    if(options.progress)
+        options.progress->acknowledge((size_t)sent.index);
+    if(options.journal)
+        options.journal->acknowledge((size_t)sent.index);
+}
+
+void GCodeSender::sendNumbered(unsigned number, std::string&& s)
+{
+    s += "*" + toString(checksum(s.data(), s.data() + s.size())) + "\n";
+    SentLine& sent = history[number % 64];
+    sent.frame.assign(s);
+    sent.sentTime = clock.now();
+    inFlight.push_back(number);
+    sendFrame(move(s));
+}
+
+void GCodeSender::sendFrame(std::string&& s)
+{
+    if(options.log)
+        options.log->sent(s.data(), s.data() + s.size());
+    if(options.capture)
+        options.capture->tx(s.data(), s.data() + s.size());
+    ++stats.framesSent;
+    stats.bytesSent += s.size();
+    transport->send(move(s));
+    armTimeout();
+}
+
+void GCodeSender::armTimeout()
+{
+    if(!options.timeoutMs || getFinished())
+        return;
+
+    // Commands this printer is known to take longer over (G28, M109) get longer
+    uint64_t ms = options.timeoutMs;
+    if(options.costs && !inFlight.empty())
+        ms = max(ms, (uint64_t)options.costs->getTimeoutMs(history[inFlight.front() % 64].costKey));
+    clock.cancelTimer(timeoutTimer);
+    timeoutTimer = clock.setTimer(clock.now() + ms * 1000, [this](){guard([this](){onTimeout();});});
+}
+
+void GCodeSender::onTimeout()
+{
+    timeoutTimer = 0;
+    ++stats.timeouts;
+    run(eventTimeout);
+}
+
+void GCodeSender::sendProbe()
+{
+    if(options.log)
+    {
+        char msg[80];
+        sprintf(msg, "no reply for line %u; sending M105\n", nextLine - 1);
+        options.log->note(msg);
+    }
+    ++probes;
+    probeWaits = 0;
+    sendFrame("M105\n");
+}
+
+void GCodeSender::onReset()
+{
+    if(!anyAccepted)
+    {
+        // Boards reset when the port opens; nothing of the job has run, so start it again
+        if(sentAny)
+            source->rewind(firstId);
+        nextIndex = options.firstIndex;
+        preambleSent = 0;
+    }
+    else if(options.onReset == resetStop)
+        throw runtime_error("firmware reset after command " + toString((unsigned)acceptedIndex + 1) + " of the job; stopping");
+    else
     {
-        while(pos != contentEnd && isspace((unsigned char)*pos))
-            ++pos;
-        const char* e = pos;
-        while(e != contentEnd && *e != '\r' && *e != '\n' && *e != '(' && *e != ';')
-            ++e;
-        if(pos != e)
+        if(options.onReset == resetRecover)
         {
-            lastSent = pos;
-            string s = "N" + toString(++lastChecksumLine) + " " + string(pos, e);
-            uint8_t cs = 0;
-            for_each(s.begin(), s.end(), [&cs](char ch){
-                cs = cs ^ ch;});
-            s += "*" + toString(cs) + "\n";
-            if(verbose)
-                printf("send: %s", s.c_str());
-            serial.send(move(s));
-            sentLine = true;
+            // Moves the firmware had planned but not made are lost with it
+            char msg[80];
+            sprintf(msg, "firmware reset after command %u of the job; restoring state\n", (unsigned)acceptedIndex + 1);
+            options.statusWriter(msg);
+            preamble.clear();
+            state.appendRestore(preamble);
+            preambleSent = 0;
         }
-        while(e != contentEnd && *e != '\r' && *e != '\n')
-            ++e;
-        pos = e;
+
+        // Carry on after the last accepted line; lines in flight may or may not have run
+        uint64_t id;
+        string skipped;
+        source->rewind(acceptedId);
+        source->next(id, skipped);
+        nextIndex = acceptedIndex + 1;
+    }
+
+    // An outstanding poll won't be answered
+    pollPending = false;
+
+    // Line numbers must not repeat ones the firmware might still see from before the reset
+    lastChecksumLine += 20;
+    inFlight.clear();
+    staleFrames = 0;
+    frontRejected = false;
+    probes = 0;
+}
+
+void GCodeSender::onPoll()
+{
+    pollTimer = clock.setTimer(clock.now() + options.temperatureMs * (uint64_t)1000, [this](){guard([this](){onPoll();});});
+
+    // A slow answer (e.g. during M109) shouldn't pile up more polls behind it. Nor should a poll
+    // wait behind a command the printer is known to take longer over than the polling interval;
+    // firmware reports temperatures by itself while it heats.
+    if(pollPending)
+        return;
+    if(options.costs && !inFlight.empty() &&
+        options.costs->getMean(history[inFlight.front() % 64].costKey) * 1000 > options.temperatureMs)
+    {
+        return;
     }
-    if(!sentLine)
-        done = true;
+    pollPending = true;
+    sendPriority("M105", [this](const char* b, const char* e){
+        if(e-b >= 2 && !strncmp(b, "ok", 2))
+            pollPending = false;
+    });
 }
 
 void GCodeSender::receiveLine(const char* b, const char* e)
 {
-    if(verbose)
-        printf("recv: %s\n", string(b, e).c_str());
-    if(e-b == 5 && !strncmp(b, "start", 5))
+    if(options.capture)
+        options.capture->rx(b, e);
+    if(options.log)
+        options.log->received(b, e);
+
+    // Anything from the firmware means it's alive; a long command may be reporting progress
+    if(timeoutTimer)
+        armTimeout();
+
+    // Answers to polls, probes and the operator's M105, and reports during M109 and M190
+    TemperatureReport report;
+    if(options.telemetry && parseTemperatures(b, e, report))
     {
-        pos = lastSent;
-        sentM110 = false;
-        lastChecksumLine += 20;
-        send();
+        report.time = clock.now();
+        options.telemetry->push(report);
     }
-    else if(e-b >= 6 && !strncmp(b, "Resend", 6))
+
+    // Answers to an operator command also go to whoever sent it; the firmware is working on the oldest frame in flight
+    SentLine& front = history[(inFlight.empty() ? 0 : inFlight.front()) % 64];
+    bool forOperator = !inFlight.empty() && front.number == inFlight.front() && front.id == priorityId && front.reply;
+
+    unsigned requested;
+    if(e-b == 5 && !strncmp(b, "start", 5))
+        run(eventReset);
+    else if((e-b >= 6 && !strncmp(b, "Resend", 6)) || (e-b >= 3 && !strncmp(b, "rs ", 3)))
     {
-        pos = lastSent;
-        --lastChecksumLine;
+        ++stats.resendRequests;
+        if(!parseResend(b, e, requested))
+            requested = nextLine - 1;
+        run(eventResend, requested);
     }
     else if(e-b >= 2 && !strncmp(b, "ok", 2))
-        send();
+    {
+        ++stats.oksReceived;
+        if(forOperator)
+        {
+            LineHandler reply;
+            reply.swap(front.reply);
+            reply(b, e);
+        }
+
+        run(e-b >= 5 && !strncmp(b + 2, " T:", 3) ? eventTemperatureOk : eventOk);
+    }
+    else if(forOperator)
+        front.reply(b, e);
 }
@@ -15,39 +15,238 @@
 // along with this program; if not, write to the Free Software
 // Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
 
-#include "Serial.h"
+#pragma once
 
-std::string toString(unsigned n);
+#include "Clock.h"
+#include "Coroutine.h"
+#include "Format.h"
+#include "JobIndex.h"
+#include "LineSource.h"
+#include <deque>
+
+class CostModel;
+class JobProgress;
+class ProgressJournal;
+class SessionCapture;
+class TelemetryRing;
+class TrafficLog;
+
+// Code of an operator's command for sendPriority(): one line without comments, N word or
+// checksum, which would make the firmware refuse the frame. Sets opcode (see CommandTable.h)
+// so M112 can be told apart. Throws exception if text isn't a line of G-code.
+std::string operatorCode(const std::string& text, uint16_t& opcode);
+
+// What to do when the firmware resets ("start") during a job
+enum ResetAction
+{
+    resetStop,                              // Give up; the reset lost the temperatures and position
+    resetRecover,                           // Re-heat, re-home X and Y, restore state and carry on after the last accepted line
+    resetContinue,                          // Carry on from the first line that wasn't answered, as if nothing was lost
+};
+
+struct SenderOptions
+{
+    TrafficLog* log;                        // Prints communications traffic; may be null. Caller must keep this alive
+    SessionCapture* capture;                // Records traffic; may be null. Caller must keep this alive
+    unsigned timeoutMs;                     // Assume the "ok" was lost if the firmware is silent this long; 0 disables
+    JobProgress* progress;                  // Told which commands were accepted; may be null. Caller must keep this alive
+    ProgressJournal* journal;               // Records which commands were accepted; may be null. Caller must keep this alive
+    bool sendM73;                           // Send M73 progress from progress as the percentage changes
+    std::vector<std::string> preamble;      // Sent before the source, e.g. to restore state when resuming
+    uint64_t firstIndex;                    // Position in the job of the source's first command
+    ModalState state;                       // State of the job before the source's first command
+    ResetAction onReset;                    // A reset before the job's first command is accepted always starts again
+    unsigned temperatureMs;                 // Send M105 this often, between lines of the job; 0 never
+    TelemetryRing* telemetry;               // Gets every temperature report; may be null. Caller must keep this alive
+    StatusWriter statusWriter;              // Warnings and notices; defaults to stdout
+    unsigned window;                        // Numbered frames sent ahead of their "ok", up to maxWindow; 1 waits for each.
+                                            // More than 1 streams the job and relies on the link's flow control
+    CostModel* costs;                       // Learns how long each kind of command takes to answer, and sets timeouts
+                                            // and temperature polls by it; may be null. Caller must keep this alive
+    bool holdFailures;                      // An exception from the sender's handlers or its transport's events fails
+                                            // the sender (getFailed()) instead of leaving the reactor, so one job's
+                                            // failure doesn't stop others sharing the reactor
+
+    SenderOptions();
+};
+
+// Buckets of SenderStats::okLatency. Bucket i counts answers which took from 2^i to 2^(i+1)
+// times okLatencyUnitUs, except that bucket 0 starts at 0 and the last bucket has no end.
+const unsigned okLatencyBuckets = 16;
+const unsigned okLatencyUnitUs = 100;
+
+// Largest SenderOptions::window; half the resend history, so a resend can always reach back
+// past every frame in flight
+const unsigned maxWindow = 32;
+
+struct SenderStats
+{
+    unsigned framesSent;                    // Including resent frames
+    uint64_t bytesSent;
+    unsigned oksReceived;
+    unsigned resendRequests;                // "Resend" lines received
+    unsigned timeouts;                      // Times the firmware was silent for timeoutMs
+    unsigned okLatency[okLatencyBuckets];   // Time from sending a numbered frame to its "ok"
+};
+
+// A numbered line which may need to be resent
+struct SentLine
+{
+    unsigned number;                        // Line number used for checksum
+    uint64_t id;                            // LineSource id, or m110Id, an M73 or a preamble line
+    uint64_t index;                         // Position of a LineSource command in the job
+    std::string code;                       // Code of a priority line
+    LineHandler reply;                      // Where the firmware's answers to a priority line go; may be empty
+    std::string frame;                      // Frame as last sent, for the job's state once it's accepted
+    uint64_t sentTime;                      // When it was last sent
+    unsigned costKey;                       // See costKey(); only set if SenderOptions::costs isn't null
+};
+
+// What the protocol coroutine is resumed for
+enum SenderEvent
+{
+    eventStart,                             // Begin the session
+    eventOk,                                // "ok"
+    eventTemperatureOk,                     // "ok T:...", the answer to M105
+    eventResend,                            // The firmware asked for a line again
+    eventTimeout,                           // The firmware was silent for timeoutMs
+    eventReset,                             // The firmware reset ("start")
+};
+
+// An operator command waiting to be sent
+struct PriorityLine
+{
+    std::string code;
+    LineHandler reply;                      // May be empty
+};
 
 class GCodeSender
 {
 private:
-    Serial serial;                  // Serial port
-    bool verbose;                   // Print communications traffic
-    const char* pos;                // Current position
-    const char* contentEnd;         // End of content
-    const char* lastSent;           // Position of last line sent
-    unsigned lastChecksumLine;      // Last line number used for checksum
-    bool sentM110;                  // Has M110 (set line number) been sent?
-    bool done;                      // Last line has been sent and acknowledged
+    Clock& clock;                           // Times out unanswered frames
+    std::unique_ptr<Transport> transport;   // Link to the firmware
+    SenderOptions options;
+    std::unique_ptr<LineSource> source;     // Code to send
+    bool sentAny;                           // Has source given us anything?
+    uint64_t firstId;                       // Id of the first line from source
+    bool anyAccepted;                       // Has the firmware accepted a line from source?
+    uint64_t acceptedId;                    // Id of the last line from source the firmware accepted
+    uint64_t acceptedIndex;                 // Its position in the job
+    ModalState state;                       // State of the job after that line
+    std::vector<std::string> preamble;      // Sent before source: options.preamble, or state to restore after a reset
+    std::deque<PriorityLine> priority;      // Operator commands; they go ahead of everything but resends
+    uint64_t nextIndex;                     // Position of the next new line from source
+    size_t preambleSent;                    // Lines of options.preamble sent
+    unsigned lastChecksumLine;              // Last line number used for checksum
+    unsigned nextLine;                      // Number of next frame; <= lastChecksumLine while resending
+    SentLine history[64];                   // Recent lines by number % 64, for "Resend"
+    unsigned window;                        // Frames allowed in flight: options.window, then 1 to finish
+    std::deque<unsigned> inFlight;          // Numbers of frames sent and not yet answered, oldest first
+    unsigned staleFrames;                   // Frames at the front of inFlight sent before the last rewind for a resend
+    bool frontRejected;                     // The firmware asked for a resend instead of taking the front of inFlight
+    uint64_t answerTime;                    // When the last frame was answered
+    unsigned probes;                        // M105 probes sent after a timeout and not yet answered
+    unsigned probeWaits;                    // Timeouts since the last probe
+    int resumePoint;                        // Where run() carries on; coroutineFinished once the last line is acknowledged
+    bool stopped;                           // Done because of an emergency stop
+    bool failed;                            // Done because a handler threw; see error
+    std::string error;                      // Why it failed
+    std::vector<Event> events;              // Transport's events, wrapped by guard(); only with options.holdFailures
+    unsigned timeoutTimer;                  // Pending timeout, or 0
+    unsigned pollTimer;                     // Pending temperature poll, or 0
+    bool pollPending;                       // A temperature poll hasn't been answered
+    SenderStats stats;
 
 public:
     GCodeSender(
-        const char* port,           // e.g. "COM2"
-        unsigned bps,               // Speed (bps), *NOT* BAUD_n define!
-        const char* content,        // Content; caller must keep this alive
-        const char* contentEnd,     // End of content
-        bool verbose);              // Print communications traffic
+        Clock& clock,                       // Caller must keep this alive
+        TransportFactory transportFactory,  // Creates the link to the firmware
+        std::unique_ptr<LineSource> source, // Code to send
+        const SenderOptions& options);
+    ~GCodeSender();
 
     // Get events for event loop
-    const std::vector<Event>& getEvents() {return serial.getEvents();}
+    const std::vector<Event>& getEvents() {return options.holdFailures ? events : transport->getEvents();}
 
-    // Has the last line been sent and acknowledged?
-    bool getDone() {return done;}
+    // The link to the firmware
+    Transport& getTransport() {return *transport;}
+
+    // Has the last line been sent and acknowledged? After emergencyStop(), not until the M112
+    // has been handed to the driver, so it's safe to close the link once this is true.
+    bool getDone() {return getFinished() && !(stopped && transport->getWritePending());}
+
+    // Was the job ended by emergencyStop()?
+    bool getStopped() {return stopped;}
+
+    // Was the job ended by a failure (see SenderOptions::holdFailures)? If so, getError() says why.
+    bool getFailed() {return failed;}
+    const std::string& getError() {return error;}
+
+    // Something the sender depends on, e.g. its transport's I/O completions, failed; stop sending
+    void fail(const std::string& error);
+
+    // Traffic so far
+    const SenderStats& getStats() {return stats;}
+
+    // Commands of the job up to and including the last one the firmware accepted
+    uint64_t getPosition() {return anyAccepted ? acceptedIndex + 1 : options.firstIndex;}
+
+    // Send code as a numbered line as soon as there's room in the window, ahead of the rest of
+    // the job. Lines the firmware sends while it's outstanding, up to and
+    // including its "ok", go to reply as well as the usual handling.
+    void sendPriority(const std::string& code, LineHandler reply = LineHandler());
+
+    // Send M112 ahead of anything queued, unnumbered so the firmware's emergency parser sees it
+    // straight away, and stop sending
+    void emergencyStop();
 
 private:
-    // Send next line
-    void send();
+    // Nothing more will be sent, bar an emergency stop still on its way out
+    bool getFinished() {return resumePoint == coroutineFinished;}
+
+    // Run a handler; with options.holdFailures, an exception fails the sender instead of leaving
+    void guard(const std::function<void()>& handler);
+
+    // The protocol: send M110, then each frame in turn while fewer than options.window are
+    // unanswered and no probe is out, then wait for the rest. A coroutine; resumed for every
+    // event, with the resend line for eventResend.
+    void run(SenderEvent event, unsigned line = 0);
+
+    // Account for an event while run() is waiting
+    void handleEvent(SenderEvent event, unsigned line);
+
+    // Send the next frame; false if there's nothing left
+    bool sendNext();
+
+    // Number a line which hasn't been sent before, remember it for resends, and send it
+    void sendNew(uint64_t id, uint64_t index, std::string&& s);
+
+    // The oldest frame in flight was answered, by an "ok" or a probe's answer; accepted unless refused
+    void answered(bool accepted);
+
+    // The firmware accepted frame number
+    void acknowledged(unsigned number);
+
+    // Add checksum to numbered line, send it, and wait for its answer
+    void sendNumbered(unsigned number, std::string&& s);
+
+    // Send a complete frame
+    void sendFrame(std::string&& s);
+
+    // (Re)start the timeout for the outstanding frame
+    void armTimeout();
+
+    // The firmware didn't answer in time
+    void onTimeout();
+
+    // Ask for the temperature after a timeout
+    void sendProbe();
+
+    // The firmware reset; rewind for run() to start over
+    void onReset();
+
+    // Time for the next temperature poll
+    void onPoll();
 
     // Received line
     void receiveLine(const char* b, const char* e);
@@ -0,0 +1,217 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#include "IocpReactor.h"
+#include <exception>
+#include <stdexcept>
+
+using namespace std;
+
+IocpReactor::IocpReactor():
+    nextKey(1),
+    nextId(1),
+    failedTarget(0)
+{
+    // Resolved at run time so the program still loads on XP
+    getQueuedCompletionStatusEx = (GetQueuedCompletionStatusExFn)GetProcAddress(
+        GetModuleHandleA("kernel32.dll"), "GetQueuedCompletionStatusEx");
+    port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, 0, 0, 1);
+    if(!port)
+        throw runtime_error("CreateIoCompletionPort failed");
+}
+
+IocpReactor::~IocpReactor()
+{
+    for(unordered_map<ULONG_PTR, Registration*>::iterator i = registrations.begin(); i != registrations.end(); ++i)
+    {
+        UnregisterWaitEx(i->second->wait, INVALID_HANDLE_VALUE);
+        delete i->second;
+    }
+    CloseHandle(port);
+}
+
+ULONG_PTR IocpReactor::associate(HANDLE file, IocpTarget* target)
+{
+    ULONG_PTR key = nextKey++;
+    if(CreateIoCompletionPort(file, port, key, 0) != port)
+        throw runtime_error("CreateIoCompletionPort failed");
+    targets[key] = target;
+    return key;
+}
+
+void IocpReactor::release(ULONG_PTR key)
+{
+    targets.erase(key);
+}
+
+// Runs on a thread pool thread
+void CALLBACK IocpReactor::onSignaled(PVOID registration, BOOLEAN)
+{
+    Registration* r = (Registration*)registration;
+    PostQueuedCompletionStatus(r->port, 0, eventKey, (OVERLAPPED*)r->id);
+}
+
+// Wait for registration's event once more. A wait which fires only once can't signal again
+// while its handler runs, so an event is never dispatched twice for one signal.
+void IocpReactor::arm(Registration* registration)
+{
+    if(registration->wait)
+        UnregisterWaitEx(registration->wait, 0);    // Already fired; this only frees it
+    registration->wait = 0;
+    if(!RegisterWaitForSingleObject(&registration->wait, get<0>(registration->event), onSignaled, registration, INFINITE, WT_EXECUTEONLYONCE))
+    {
+        registration->wait = 0;
+        throw runtime_error("RegisterWaitForSingleObject failed");
+    }
+}
+
+void IocpReactor::add(const std::vector<Event>& events)
+{
+    for(size_t i = 0; i < events.size(); ++i)
+    {
+        Registration* registration = new Registration;
+        registration->port = port;
+        registration->id = nextId++;
+        registration->event = events[i];
+        registration->wait = 0;
+        try
+        {
+            arm(registration);
+        }
+        catch(...)
+        {
+            delete registration;
+            throw;
+        }
+        registrations[registration->id] = registration;
+    }
+}
+
+void IocpReactor::remove(const std::vector<Event>& events)
+{
+    for(size_t i = 0; i < events.size(); ++i)
+    {
+        for(unordered_map<ULONG_PTR, Registration*>::iterator r = registrations.begin(); r != registrations.end(); ++r)
+        {
+            if(get<0>(r->second->event) != get<0>(events[i]))
+                continue;
+
+            // Blocks until a running onSignaled() is done with it. A completion it already
+            // posted finds no registration and is dropped.
+            UnregisterWaitEx(r->second->wait, INVALID_HANDLE_VALUE);
+            delete r->second;
+            registrations.erase(r);
+            break;
+        }
+    }
+}
+
+unsigned IocpReactor::step(DWORD timeoutMs)
+{
+    failedTarget = 0;
+    ULONG n = 0;
+    if(getQueuedCompletionStatusEx)
+    {
+        if(!getQueuedCompletionStatusEx(port, completions, maxCompletions, &n, timeoutMs, false))
+        {
+            if(GetLastError() != WAIT_TIMEOUT)
+                throw runtime_error("GetQueuedCompletionStatusEx failed");
+            n = 0;
+        }
+    }
+    else
+    {
+        // Fails with an OVERLAPPED when the operation failed; that is still a completion
+        DWORD bytes = 0;
+        ULONG_PTR key = 0;
+        OVERLAPPED* overlapped = 0;
+        if(GetQueuedCompletionStatus(port, &bytes, &key, &overlapped, timeoutMs) || overlapped)
+        {
+            completions[0].lpCompletionKey = key;
+            completions[0].lpOverlapped = overlapped;
+            completions[0].dwNumberOfBytesTransferred = bytes;
+            n = 1;
+        }
+        else if(GetLastError() != WAIT_TIMEOUT)
+            throw runtime_error("GetQueuedCompletionStatus failed");
+    }
+
+    // A handler may release any target or remove any event, including ones later in this
+    // batch. The batch can't be taken again, so it is finished before a failure leaves.
+    unsigned dispatched = 0;
+    bool failed = false;
+    exception_ptr failure;
+    for(ULONG i = 0; i < n; ++i)
+    {
+        if(completions[i].lpCompletionKey == eventKey)
+        {
+            ULONG_PTR id = (ULONG_PTR)completions[i].lpOverlapped;
+            unordered_map<ULONG_PTR, Registration*>::iterator registration = registrations.find(id);
+            if(registration == registrations.end())
+                continue;
+
+            // The handler may change events, so copy it out first
+            function<void()> handler = get<1>(registration->second->event);
+            try
+            {
+                handler();
+                registration = registrations.find(id);
+                if(registration != registrations.end())
+                    arm(registration->second);
+            }
+            catch(...)
+            {
+                if(!failed)
+                {
+                    failed = true;
+                    failure = current_exception();
+                }
+            }
+            ++dispatched;
+            continue;
+        }
+
+        unordered_map<ULONG_PTR, IocpTarget*>::iterator target = targets.find(completions[i].lpCompletionKey);
+        if(target == targets.end())
+            continue;
+        IocpTarget* t = target->second;
+        try
+        {
+            t->onCompletion(completions[i].lpOverlapped);
+        }
+        catch(...)
+        {
+            if(!failed)
+            {
+                failed = true;
+                failedTarget = t;
+                failure = current_exception();
+            }
+        }
+        ++dispatched;
+    }
+    if(failed)
+        rethrow_exception(failure);
+    return dispatched;
+}
+
+BOOL cancelPortIo(HANDLE file)
+{
+    typedef BOOL (WINAPI* CancelIoExFn)(HANDLE, OVERLAPPED*);
+    static CancelIoExFn cancelIoEx = (CancelIoExFn)GetProcAddress(GetModuleHandleA("kernel32.dll"), "CancelIoEx");
+    return cancelIoEx ? cancelIoEx(file, 0) : CancelIo(file);
+}
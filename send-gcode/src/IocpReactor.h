@@ -0,0 +1,99 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#pragma once
+
+#include "Reactor.h"
+#include <unordered_map>
+
+// Told when overlapped I/O on a handle associated with an IocpReactor finishes
+class IocpTarget
+{
+public:
+    virtual ~IocpTarget() {}
+
+    // An operation started with overlapped finished, well or badly; use GetOverlappedResult()
+    // to find out which
+    virtual void onCompletion(OVERLAPPED* overlapped) = 0;
+};
+
+// Reactor built on an I/O completion port. Transports such as IocpSerial associate their
+// handles with it and get their completions through it, so one GetQueuedCompletionStatusEx()
+// call collects finished reads and writes from any number of ports. Ordinary Events (e.g. a
+// RealClock's) are waited for by the system thread pool, which posts a completion when one is
+// signaled; so step() blocks on the port alone and never polls. On XP, which lacks
+// GetQueuedCompletionStatusEx(), each wait takes one completion with GetQueuedCompletionStatus().
+class IocpReactor: public Reactor
+{
+private:
+    enum {maxCompletions = 64};                 // Taken per step
+    enum {eventKey = 0};                        // Completion key of signaled events; associate() starts at 1
+
+    typedef BOOL (WINAPI* GetQueuedCompletionStatusExFn)(HANDLE, OVERLAPPED_ENTRY*, ULONG, ULONG*, DWORD, BOOL);
+
+    // An ordinary event and the thread pool's wait for it
+    struct Registration
+    {
+        HANDLE port;
+        ULONG_PTR id;                           // Posted as the completion's OVERLAPPED pointer
+        Event event;
+        HANDLE wait;                            // From RegisterWaitForSingleObject()
+    };
+
+    HANDLE port;
+    std::unordered_map<ULONG_PTR, IocpTarget*> targets;    // By completion key
+    ULONG_PTR nextKey;                          // Keys aren't reused, so a stale completion can't reach a new target
+    std::unordered_map<ULONG_PTR, Registration*> registrations;    // By id
+    ULONG_PTR nextId;                           // Nor are ids, so a stale signal can't reach a new event
+    GetQueuedCompletionStatusExFn getQueuedCompletionStatusEx;     // Null before Vista
+    IocpTarget* failedTarget;                   // Target whose onCompletion() threw in the last step()
+    OVERLAPPED_ENTRY completions[maxCompletions];
+    std::vector<HANDLE> noHandles;
+
+    static void CALLBACK onSignaled(PVOID registration, BOOLEAN timedOut);
+    void arm(Registration* registration);
+    void dispatchEvent(ULONG_PTR id);
+
+public:
+    IocpReactor();
+    ~IocpReactor();
+
+public:
+    // Send completions of overlapped I/O on file to target. Returns a key for release().
+    ULONG_PTR associate(HANDLE file, IocpTarget* target);
+
+    // Drop completions for key from now on; call before destroying its target
+    void release(ULONG_PTR key);
+
+    virtual void add(const std::vector<Event>& events);
+    virtual void remove(const std::vector<Event>& events);
+    // A handler or target which throws doesn't stop the rest of the batch; the first exception
+    // leaves once the batch is done, and getFailedTarget() says whose it was
+    virtual unsigned step(DWORD timeoutMs);
+
+    // Target whose completion threw out of the last step(); null if none did or an event's handler did
+    IocpTarget* getFailedTarget() {return failedTarget;}
+
+    // Always empty: the thread pool's waits consume auto-reset events, so nobody else may wait
+    // on them. A host loop calls step() with a timeout instead.
+    virtual const std::vector<HANDLE>& getHandles() {return noHandles;}
+};
+
+// Cancel all overlapped I/O on file. Uses CancelIoEx() where there is one (Vista and later);
+// XP's CancelIo() only cancels the calling thread's operations, which is enough for handles
+// associated with an IocpReactor, since their I/O starts on the reactor's thread.
+BOOL cancelPortIo(HANDLE file);
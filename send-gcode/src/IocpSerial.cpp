@@ -0,0 +1,236 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#include "IocpSerial.h"
+#include "Serial.h"
+#include <stdexcept>
+
+using namespace std;
+
+IocpSerial::IocpSerial(IocpReactor& reactor, LineHandler receivedLine, StatusWriter statusWriter):
+    reactor(reactor),
+    receivedLine(receivedLine),
+    statusWriter(statusWriter),
+    handle(INVALID_HANDLE_VALUE),
+    key(0),
+    commEventMask(0),
+    reading(false),
+    writing(false),
+    watching(false),
+    bytesInReadBuffer(0)
+{
+    memset(&overlappedRead, 0, sizeof(OVERLAPPED));
+    memset(&overlappedWrite, 0, sizeof(OVERLAPPED));
+    memset(&overlappedCommEvent, 0, sizeof(OVERLAPPED));
+}
+
+IocpSerial::~IocpSerial()
+{
+    close();
+}
+
+void IocpSerial::open(const std::string& port, unsigned bps, FlowControl flow)
+{
+    if(handle != INVALID_HANDLE_VALUE)
+        throw runtime_error("connection is already open");
+
+    HANDLE h = openCommPort(port, bps, flow);
+
+    // A read finishes as soon as at least one byte is in, or after a second with nothing
+    COMMTIMEOUTS timeouts;
+    timeouts.ReadIntervalTimeout = MAXDWORD;
+    timeouts.ReadTotalTimeoutConstant = 1000;
+    timeouts.ReadTotalTimeoutMultiplier = MAXDWORD;
+    timeouts.WriteTotalTimeoutConstant = 0;
+    timeouts.WriteTotalTimeoutMultiplier = 0;
+    if(!SetCommTimeouts(h, &timeouts) || !SetCommMask(h, EV_ERR))
+    {
+        CloseHandle(h);
+        throw runtime_error("can not open port " + port);
+    }
+
+    statusWriter(describeCommPort(port, h).c_str());
+    attach(h);
+}
+
+void IocpSerial::attach(HANDLE handle)
+{
+    if(this->handle != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(handle);
+        throw runtime_error("connection is already open");
+    }
+
+    try
+    {
+        key = reactor.associate(handle, this);
+    }
+    catch(...)
+    {
+        CloseHandle(handle);
+        throw;
+    }
+    this->handle = handle;
+    bytesInReadBuffer = 0;
+    startRead();
+
+    // Only a serial port has line errors to watch for; a pipe has no comm mask
+    DWORD mask = 0;
+    if(GetCommMask(handle, &mask) && (mask & EV_ERR))
+        startCommEvent();
+}
+
+void IocpSerial::close()
+{
+    if(handle == INVALID_HANDLE_VALUE)
+        return;
+
+    // The cancelled operations still post completions; release() makes the reactor drop them,
+    // but the OVERLAPPEDs and buffers must stay put until the operations are really over.
+    reactor.release(key);
+    cancelPortIo(handle);
+    DWORD dummy;
+    if(reading)
+        GetOverlappedResult(handle, &overlappedRead, &dummy, true);
+    if(writing)
+        GetOverlappedResult(handle, &overlappedWrite, &dummy, true);
+    if(watching)
+        GetOverlappedResult(handle, &overlappedCommEvent, &dummy, true);
+    CloseHandle(handle);
+
+    handle = INVALID_HANDLE_VALUE;
+    reading = false;
+    writing = false;
+    watching = false;
+    writeQueue.clear();
+    batch.clear();
+    bytesInReadBuffer = 0;
+}
+
+void IocpSerial::send(std::string&& data)
+{
+    if(handle == INVALID_HANDLE_VALUE)
+        return;
+    writeQueue.push_back(move(data));
+    startWrite();
+}
+
+void IocpSerial::sendUrgent(std::string&& data)
+{
+    // The batch under way has already left writeQueue
+    if(handle == INVALID_HANDLE_VALUE)
+        return;
+    writeQueue.push_front(move(data));
+    startWrite();
+}
+
+void IocpSerial::onCompletion(OVERLAPPED* overlapped)
+{
+    if(overlapped == &overlappedRead)
+        onRead();
+    else if(overlapped == &overlappedWrite)
+        onWrite();
+    else if(overlapped == &overlappedCommEvent)
+        onCommEvent();
+}
+
+void IocpSerial::startRead()
+{
+    // Even an immediate success is reported through the completion port
+    if(!ReadFile(handle, readBuffer + bytesInReadBuffer, readBufferSize - bytesInReadBuffer, 0, &overlappedRead) &&
+        GetLastError() != ERROR_IO_PENDING)
+    {
+        close();
+        throw runtime_error("serial read failed");
+    }
+    reading = true;
+}
+
+void IocpSerial::onRead()
+{
+    reading = false;
+    DWORD numRead = 0;
+    if(!GetOverlappedResult(handle, &overlappedRead, &numRead, false))
+    {
+        close();
+        throw runtime_error("serial read failed");
+    }
+
+    if(numRead)
+    {
+        bytesInReadBuffer += numRead;
+        dispatchLines(readBuffer, bytesInReadBuffer, readBufferSize, receivedLine, statusWriter);
+    }
+    if(handle != INVALID_HANDLE_VALUE && !reading)
+        startRead();
+}
+
+void IocpSerial::startWrite()
+{
+    if(writing || writeQueue.empty())
+        return;
+    batch.clear();
+    while(!writeQueue.empty())
+    {
+        batch += writeQueue.front();
+        writeQueue.pop_front();
+    }
+    if(!WriteFile(handle, batch.data(), batch.size(), 0, &overlappedWrite) && GetLastError() != ERROR_IO_PENDING)
+    {
+        close();
+        throw runtime_error("serial write error");
+    }
+    writing = true;
+}
+
+void IocpSerial::onWrite()
+{
+    writing = false;
+    DWORD numWritten = 0;
+    if(!GetOverlappedResult(handle, &overlappedWrite, &numWritten, false) || numWritten != batch.size())
+    {
+        close();
+        throw runtime_error("serial write error");
+    }
+    startWrite();
+}
+
+void IocpSerial::startCommEvent()
+{
+    // Like ReadFile(), an immediate success is still reported through the completion port
+    if(!WaitCommEvent(handle, &commEventMask, &overlappedCommEvent) && GetLastError() != ERROR_IO_PENDING)
+    {
+        close();
+        throw runtime_error("WaitCommEvent failed");
+    }
+    watching = true;
+}
+
+void IocpSerial::onCommEvent()
+{
+    watching = false;
+    DWORD dummy;
+    if(!GetOverlappedResult(handle, &overlappedCommEvent, &dummy, false))
+    {
+        close();
+        throw runtime_error("WaitCommEvent failed");
+    }
+    if(commEventMask & EV_ERR)
+        reportCommErrors(handle, statusWriter);
+    if(handle != INVALID_HANDLE_VALUE)
+        startCommEvent();
+}
@@ -0,0 +1,102 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#pragma once
+
+#include "IocpReactor.h"
+#include "Serial.h"
+#include <list>
+
+// Serial port (or any overlapped byte stream, e.g. a pipe) driven by an IocpReactor instead of
+// events. A read is always outstanding on the port's own buffer and is restarted as soon as it
+// completes, and everything queued while a write is under way goes out in the next WriteFile(),
+// so each port costs about one system call per burst of traffic and no wait handles. A serial
+// port also has a WaitCommEvent() outstanding for EV_ERR, so line errors are reported.
+class IocpSerial: public Transport, public IocpTarget
+{
+private:
+    IocpReactor& reactor;
+    LineHandler receivedLine;                   // This function is called for every received line
+    StatusWriter statusWriter;                  // This function is called to indicate warnings
+    std::vector<Event> events;                  // Always empty; completions come through reactor
+
+    HANDLE handle;                              // Port; INVALID_HANDLE_VALUE if closed
+    ULONG_PTR key;                              // Completion key from reactor
+    OVERLAPPED overlappedRead;                  // Async ReadFile()
+    OVERLAPPED overlappedWrite;                 // Async WriteFile()
+    OVERLAPPED overlappedCommEvent;             // Async WaitCommEvent()
+    DWORD commEventMask;                        // Receives the events WaitCommEvent() saw
+    bool reading;                               // ReadFile() is under way
+    bool writing;                               // batch is being sent
+    bool watching;                              // WaitCommEvent() is under way
+    std::list<std::string> writeQueue;          // Strings to send after batch
+    std::string batch;                          // Strings being sent, joined
+    static const size_t readBufferSize = 1024;  // Maximum size of a received line
+    char readBuffer[readBufferSize];            // Receives incoming data
+    size_t bytesInReadBuffer;                   // Amount of data in readBuffer
+
+public:
+    IocpSerial(IocpReactor& reactor, LineHandler receivedLine, StatusWriter statusWriter);
+    ~IocpSerial();
+
+public:
+    // Open port; throws exception on failure
+    void open(
+        const std::string& port,                // e.g. COM2
+        unsigned bps,                           // Speed (bps), *NOT* BAUD_n define!
+        FlowControl flow = flowNone);
+
+    // Use an already open handle, which must have been opened for overlapped I/O and isn't
+    // associated with a completion port yet; takes ownership. Throws exception on failure.
+    void attach(HANDLE handle);
+
+    // Close port
+    void close();
+
+    // Send data. Async; returns immediately
+    virtual void send(std::string&& data);
+
+    // Send data as soon as the write in progress finishes
+    virtual void sendUrgent(std::string&& data);
+
+    // Data waiting for or in a WriteFile()
+    virtual bool getWritePending() {return writing || !writeQueue.empty();}
+
+    // Nothing to wait on; add the reactor's own handles instead
+    virtual const std::vector<Event>& getEvents() {return events;}
+
+    virtual void onCompletion(OVERLAPPED* overlapped);
+
+private:
+    // Read whatever arrives next
+    void startRead();
+
+    // Send everything in writeQueue
+    void startWrite();
+
+    // Wait for a line error
+    void startCommEvent();
+
+    // Called when ReadFile() is done
+    void onRead();
+
+    // Called when WriteFile() is done
+    void onWrite();
+
+    // Called when WaitCommEvent() is done
+    void onCommEvent();
+};
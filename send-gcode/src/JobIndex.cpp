@@ -0,0 +1,233 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#include "JobIndex.h"
+#include <algorithm>
+#include <float.h>
+#include <limits>
+#include <stdio.h>
+
+using namespace std;
+
+static const char axes[4] = {'X', 'Y', 'Z', 'E'};
+static const double restoreTravelFeedrate = 3000;     // mm/min, for the move back over the print
+
+ModalState::ModalState():
+    relative(false),
+    relativeE(false),
+    inches(false),
+    feedrate(0),
+    hotendTarget(0),
+    bedTarget(0),
+    fan(0)
+{
+    fill(position, position + 4, 0.0);
+}
+
+bool ModalState::isMove(uint16_t opcode, uint32_t mask)
+{
+    return opcode == (opcodeG | 0) || opcode == (opcodeG | 1) || opcode == (opcodeG | 2) || opcode == (opcodeG | 3) ||
+        (opcode == opcodeNone && mask);
+}
+
+// Update state for a command. getValue(letter, v) returns false if the letter is absent and
+// sets v to NaN if it has no number.
+template<typename GetValue>
+static void applyCommand(ModalState& state, uint16_t opcode, uint32_t mask, GetValue getValue)
+{
+    double v;
+    double scale = state.inches ? 25.4 : 1;
+    if(ModalState::isMove(opcode, mask))
+    {
+        for(int axis = 0; axis < 4; ++axis)
+            if(getValue(axes[axis], v) && v == v)
+                state.position[axis] = (state.relative || (axis == 3 && state.relativeE)) ? state.position[axis] + v * scale : v * scale;
+        if(getValue('F', v) && v > 0)
+            state.feedrate = (float)(v * scale);
+    }
+    else if(opcode == (opcodeG | 20))
+        state.inches = true;
+    else if(opcode == (opcodeG | 21))
+        state.inches = false;
+    else if(opcode == (opcodeG | 28))
+    {
+        bool any = (mask & (paramBit('X') | paramBit('Y') | paramBit('Z'))) != 0;
+        for(int axis = 0; axis < 3; ++axis)
+            if(!any || (mask & paramBit(axes[axis])))
+                state.position[axis] = 0;
+    }
+    else if(opcode == (opcodeG | 90))
+        state.relative = false;
+    else if(opcode == (opcodeG | 91))
+        state.relative = true;
+    else if(opcode == (opcodeG | 92))
+    {
+        for(int axis = 0; axis < 4; ++axis)
+            if(getValue(axes[axis], v) && v == v)
+                state.position[axis] = v * scale;
+    }
+    else if(opcode == (opcodeM | 82))
+        state.relativeE = false;
+    else if(opcode == (opcodeM | 83))
+        state.relativeE = true;
+    else if(opcode == (opcodeM | 104) || opcode == (opcodeM | 109))
+    {
+        if(getValue('S', v) && v == v)
+            state.hotendTarget = (float)v;
+    }
+    else if(opcode == (opcodeM | 140) || opcode == (opcodeM | 190))
+    {
+        if(getValue('S', v) && v == v)
+            state.bedTarget = (float)v;
+    }
+    else if(opcode == (opcodeM | 106))
+        state.fan = getValue('S', v) && v == v ? (float)v : 255;
+    else if(opcode == (opcodeM | 107))
+        state.fan = 0;
+}
+
+void ModalState::apply(const CommandColumns& table, size_t i)
+{
+    applyCommand(*this, table.opcodes[i], table.paramMasks[i], [&](char letter, double& v) -> bool {
+        float f;
+        if(!table.getValue(i, letter, f))
+            return false;
+        v = f;
+        return true;});
+}
+
+void ModalState::apply(const GCodeLine& line)
+{
+    uint16_t opcode = line.command.letter ? makeOpcode(line.command.letter, line.command.number) : opcodeNone;
+    if(line.command.letter && opcode == opcodeNone)
+        return;
+    uint32_t mask = 0;
+    for(unsigned i = 0; i < line.numWords; ++i)
+        if(line.words[i].letter >= 'A' && line.words[i].letter <= 'Z')
+            mask |= paramBit(line.words[i].letter);
+    applyCommand(*this, opcode, mask, [&](char letter, double& v) -> bool {
+        const GCodeWord* word = line.find(letter);
+        if(!word)
+            return false;
+        if(word->number.empty() || !toDouble(word->number, v))
+            v = numeric_limits<double>::quiet_NaN();
+        return true;});
+}
+
+void ModalState::appendRestore(std::vector<std::string>& lines) const
+{
+    char buf[128];
+
+    // Start both heating, then wait for the slower one first
+    if(bedTarget > 0)
+    {
+        sprintf(buf, "M140 S%g", bedTarget);
+        lines.push_back(buf);
+    }
+    if(hotendTarget > 0)
+    {
+        sprintf(buf, "M104 S%g", hotendTarget);
+        lines.push_back(buf);
+    }
+    if(bedTarget > 0)
+    {
+        sprintf(buf, "M190 S%g", bedTarget);
+        lines.push_back(buf);
+    }
+    if(hotendTarget > 0)
+    {
+        sprintf(buf, "M109 S%g", hotendTarget);
+        lines.push_back(buf);
+    }
+
+    // The firmware may have lost G20, so the restore itself is in mm. The travel gets its own
+    // feedrate; whatever homing left behind may be a crawl.
+    lines.push_back("G21");
+    lines.push_back("G90");
+    lines.push_back("G28 X0 Y0");
+    sprintf(buf, "G92 Z%.3f E%.5f", position[2], position[3]);
+    lines.push_back(buf);
+    sprintf(buf, "G1 X%.3f Y%.3f F%g", position[0], position[1], restoreTravelFeedrate);
+    lines.push_back(buf);
+    if(fan > 0)
+    {
+        sprintf(buf, "M106 S%g", fan);
+        lines.push_back(buf);
+    }
+    else
+        lines.push_back("M107");
+    lines.push_back(relativeE ? "M83" : "M82");
+    if(relative)
+        lines.push_back("G91");
+    // The job's own feedrate comes back even if it never set one; the travel's mustn't linger
+    sprintf(buf, "G1 F%g", feedrate > 0 ? feedrate : restoreTravelFeedrate);
+    lines.push_back(buf);
+    if(inches)
+        lines.push_back("G20");
+}
+
+JobIndex::JobIndex(const CommandColumns& table):
+    table(table)
+{
+    checkpoints.reserve(table.size() / checkpointInterval + 1);
+    ModalState state;
+    double layerZ = -DBL_MAX;
+    size_t reachedZ = table.size();             // Move which took the nozzle to its Z; table.size() if G28 or G92 set it
+    for(size_t i = 0; i < table.size(); ++i)
+    {
+        if(i % checkpointInterval == 0)
+            checkpoints.push_back(state);
+        double z = state.position[2];
+        double e = state.position[3];
+        state.apply(table, i);
+
+        bool move = ModalState::isMove(table.opcodes[i], table.paramMasks[i]);
+        if(state.position[2] != z)
+            reachedZ = move ? i : table.size();
+
+        // A layer starts with the move to a new, higher Z which is first extruded at. A Z hop
+        // doesn't extrude, so it isn't one. The layer includes the travel to its Z.
+        if(move && state.position[3] > e && state.position[2] > layerZ)
+        {
+            layerZ = state.position[2];
+            layerStarts.push_back(reachedZ < i ? reachedZ : i);
+            layerHeights.push_back((float)layerZ);
+        }
+    }
+}
+
+size_t JobIndex::getLayerOf(size_t i) const
+{
+    return upper_bound(layerStarts.begin(), layerStarts.end(), i) - layerStarts.begin();
+}
+
+size_t JobIndex::findLine(unsigned sourceLine) const
+{
+    return lower_bound(table.sourceLines, table.sourceLines + table.size(), sourceLine) - table.sourceLines;
+}
+
+ModalState JobIndex::getStateBefore(size_t i) const
+{
+    if(checkpoints.empty())
+        return ModalState();
+    i = min(i, table.size());
+    size_t k = min(i / checkpointInterval, checkpoints.size() - 1);
+    ModalState state = checkpoints[k];
+    for(size_t j = k * checkpointInterval; j < i; ++j)
+        state.apply(table, j);
+    return state;
+}
@@ -0,0 +1,84 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#pragma once
+
+#include "CommandTable.h"
+#include <string>
+#include <vector>
+
+// Machine state which commands leave behind for the ones after them
+struct ModalState
+{
+    bool relative;                              // G91
+    bool relativeE;                             // M83
+    bool inches;                                // G20; positions and feedrate are kept in mm regardless
+    double position[4];                         // X, Y, Z, E in mm; double so a long job's E doesn't drift
+    float feedrate;                             // mm/min; 0 until the first F word
+    float hotendTarget;                         // Degrees C; 0 is off
+    float bedTarget;                            // Degrees C; 0 is off
+    float fan;                                  // M106 S value; 0 is off
+
+    ModalState();                               // Power-up state
+
+    // Whether a command moves the axes: G0 to G3, or parameters alone (a modal "X10 Y20").
+    // An arc only matters for where it ends.
+    static bool isMove(uint16_t opcode, uint32_t mask);
+
+    // Update for command i of table
+    void apply(const CommandColumns& table, size_t i);
+
+    // Update for a lexed line
+    void apply(const GCodeLine& line);
+
+    // Append commands which restore this state on a printer which lost it, e.g. after a reset.
+    // X and Y are homed; Z can't be with a print on the bed, so the nozzle must already be at
+    // position[2] when they run. Everything is sent in mm, then G20 follows if the job was in inches.
+    void appendRestore(std::vector<std::string>& lines) const;
+};
+
+// Finds where to resume a job: layers, and the state before any command. Seeks take
+// O(log n) time plus replaying at most checkpointInterval commands from a checkpoint.
+class JobIndex
+{
+private:
+    enum {checkpointInterval = 4096};
+
+    CommandColumns table;
+    std::vector<ModalState> checkpoints;        // State before command k * checkpointInterval
+    std::vector<size_t> layerStarts;            // Move to each new, higher Z which is extruded at
+    std::vector<float> layerHeights;
+
+public:
+    JobIndex(const CommandColumns& table);      // Caller must keep what table reads alive
+
+    // Number of layers
+    size_t getLayers() const {return layerStarts.size();}
+
+    // First command of layer (0-based) and its Z
+    size_t getLayerStart(size_t layer) const {return layerStarts[layer];}
+    float getLayerHeight(size_t layer) const {return layerHeights[layer];}
+
+    // Number of layers which start at or before command i; i.e. the 1-based layer it's in, or 0 before the first
+    size_t getLayerOf(size_t i) const;
+
+    // First command on or after a 1-based source line; table.size() if none
+    size_t findLine(unsigned sourceLine) const;
+
+    // State just before command i runs
+    ModalState getStateBefore(size_t i) const;
+};
@@ -0,0 +1,124 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#include "JobProgress.h"
+#include "Format.h"
+#include "Telemetry.h"
+#include "TrafficLog.h"
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+
+using namespace std;
+
+// The estimate isn't corrected until this much of it has passed; before then the
+// ratio is mostly noise from heating and the first moves
+static const double minCorrectionSeconds = 60;
+
+JobProgress::JobProgress(
+    Clock& clock,
+    std::vector<float>&& finishTimes,
+    unsigned reportSeconds,
+    TrafficLog* log,
+    const TelemetryRing* telemetry):
+        clock(clock),
+        finishTimes(move(finishTimes)),
+        total(0),
+        reportSeconds(reportSeconds),
+        log(log),
+        telemetry(telemetry),
+        started(false),
+        startTime(0),
+        startEstimate(0),
+        lastReport(0),
+        acknowledged(0),
+        m73Percent(101)
+{
+    if(!this->finishTimes.empty())
+        total = this->finishTimes.back();
+}
+
+void JobProgress::acknowledge(size_t index)
+{
+    uint64_t now = clock.now();
+    if(!started)
+    {
+        started = true;
+        startTime = now;
+        lastReport = now;
+        if(index && index <= finishTimes.size())
+            startEstimate = finishTimes[index - 1];
+    }
+    acknowledged = max(acknowledged, min(index + 1, finishTimes.size()));
+    if(reportSeconds && log && now - lastReport >= reportSeconds * (uint64_t)1000000)
+    {
+        lastReport = now;
+        report();
+    }
+}
+
+double JobProgress::getFraction() const
+{
+    if(!acknowledged || total <= 0)
+        return 0;
+    return finishTimes[acknowledged - 1] / total;
+}
+
+double JobProgress::getElapsed() const
+{
+    return started ? (clock.now() - startTime) / 1000000.0 : 0;
+}
+
+double JobProgress::getRemaining() const
+{
+    double estimated = acknowledged ? finishTimes[acknowledged - 1] : 0;
+    double scale = 1;
+    if(estimated - startEstimate >= minCorrectionSeconds)
+        scale = getElapsed() / (estimated - startEstimate);
+    return max(0.0, (total - estimated) * scale);
+}
+
+bool JobProgress::m73Before(size_t index, unsigned& percent, unsigned& minutes)
+{
+    if(total <= 0 || index >= finishTimes.size())
+        return false;
+    double done = index ? finishTimes[index - 1] : 0;
+    percent = min(100u, (unsigned)(done * 100 / total));
+    if(percent == m73Percent)
+        return false;
+    m73Percent = percent;
+    minutes = (unsigned)(getRemaining() / 60 + 0.5);
+    return true;
+}
+
+void JobProgress::report()
+{
+    if(!log)
+        return;
+    char buf[160];
+    int n = sprintf(buf, "progress: %.1f%%, elapsed %s, remaining %s",
+        getFraction() * 100, formatDuration(getElapsed()).c_str(), formatDuration(getRemaining()).c_str());
+    if(telemetry && telemetry->size())
+    {
+        const TemperatureReport& t = telemetry->get(0);
+        n += sprintf(buf + n, ", hotend %.1f/%.0f", t.hotend, t.hotendTarget);
+        if(t.hasBed)
+            n += sprintf(buf + n, ", bed %.1f/%.0f", t.bed, t.bedTarget);
+    }
+    strcpy(buf + n, "\n");
+    log->note(buf);
+}
@@ -0,0 +1,71 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#pragma once
+
+#include "Clock.h"
+#include <stdint.h>
+#include <vector>
+
+class TelemetryRing;
+class TrafficLog;
+
+// Tracks how far a job has got from the estimated finish time of each command
+// (see estimatePrintTime). Estimates are corrected by how long the job has really taken.
+class JobProgress
+{
+private:
+    Clock& clock;
+    std::vector<float> finishTimes;             // Estimated seconds until each command is done
+    double total;                               // Estimated seconds for the whole job
+    unsigned reportSeconds;                     // Print progress this often; 0 never
+    TrafficLog* log;                            // Progress lines are printed through this
+    const TelemetryRing* telemetry;             // Latest temperatures go in the report; may be null
+    bool started;                               // Has anything been acknowledged?
+    uint64_t startTime;                         // First acknowledgement
+    double startEstimate;                       // Estimated time before it; not 0 when resuming a job
+    uint64_t lastReport;
+    size_t acknowledged;                        // Commands the firmware has accepted
+    unsigned m73Percent;                        // Last M73 sent; above 100 if none
+
+public:
+    JobProgress(
+        Clock& clock,                           // Caller must keep this alive
+        std::vector<float>&& finishTimes,
+        unsigned reportSeconds,
+        TrafficLog* log,                        // May be null if reportSeconds is 0. Caller must keep this alive
+        const TelemetryRing* telemetry);        // May be null. Caller must keep this alive
+
+    // The firmware accepted command index (0-based, in source order)
+    void acknowledge(size_t index);
+
+    // Fraction of the estimated time which has passed, 0 to 1
+    double getFraction() const;
+
+    // Seconds since the first acknowledgement
+    double getElapsed() const;
+
+    // Estimated seconds left, scaled by how the job has gone so far
+    double getRemaining() const;
+
+    // Should an M73 go before command index? Returns false if the percentage hasn't changed.
+    bool m73Before(size_t index, unsigned& percent, unsigned& minutes);
+
+    // Queue a progress line on the log. Only formatting happens here; acknowledge() calls
+    // this on the I/O path, and the log's thread does the console write.
+    void report();
+};
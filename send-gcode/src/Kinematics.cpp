@@ -0,0 +1,61 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#include "Kinematics.h"
+#include <algorithm>
+#include <math.h>
+
+using namespace std;
+
+PrinterModel::PrinterModel():
+    acceleration(1000),
+    maxFeedrate(200),
+    junctionDeviation(0.05),
+    defaultFeedrate(25),
+    homingTime(10),
+    hotendHeatRate(2),
+    bedHeatRate(0.5),
+    ambient(20)
+{
+    axisMaxFeedrate[0] = 200;
+    axisMaxFeedrate[1] = 200;
+    axisMaxFeedrate[2] = 5;
+    axisMaxFeedrate[3] = 25;
+}
+
+double restToRestTime(double distance, double speed, double acceleration)
+{
+    return trapezoidTime(distance, 0, 0, speed, acceleration);
+}
+
+double trapezoidTime(double distance, double entry, double exit, double speed, double acceleration)
+{
+    if(distance <= 0 || speed <= 0)
+        return 0;
+    entry = min(entry, speed);
+    exit = min(exit, speed);
+
+    // Triangle profile if we can't reach speed before we have to slow down again
+    double accelDistance = (speed * speed - entry * entry) / (2 * acceleration);
+    double decelDistance = (speed * speed - exit * exit) / (2 * acceleration);
+    if(accelDistance + decelDistance >= distance)
+    {
+        double peak = sqrt(max(0.0, acceleration * distance + (entry * entry + exit * exit) / 2));
+        return (max(0.0, peak - entry) + max(0.0, peak - exit)) / acceleration;
+    }
+    return (speed - entry + speed - exit) / acceleration + (distance - accelDistance - decelDistance) / speed;
+}
@@ -0,0 +1,41 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#pragma once
+
+// Physical limits of a printer. Distances are mm, times are seconds.
+struct PrinterModel
+{
+    double acceleration;                        // mm/s^2
+    double maxFeedrate;                         // mm/s
+    double axisMaxFeedrate[4];                  // mm/s for X, Y, Z and E on their own
+    double junctionDeviation;                   // mm; larger values take corners faster
+    double defaultFeedrate;                     // mm/s, until the first F word
+    double homingTime;                          // G28
+    double hotendHeatRate;                      // Degrees C per second
+    double bedHeatRate;                         // Degrees C per second
+    double ambient;                             // Degrees C at power up
+
+    PrinterModel();                             // Typical RepRap values
+};
+
+// Time to move distance starting and ending at rest, accelerating up to at most speed
+double restToRestTime(double distance, double speed, double acceleration);
+
+// Time to move distance entering at speed entry and leaving at speed exit, accelerating up to
+// at most speed in between. exit must be reachable from entry within distance.
+double trapezoidTime(double distance, double entry, double exit, double speed, double acceleration);
@@ -0,0 +1,59 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#include "LineSource.h"
+
+using namespace std;
+
+TextLineSource::TextLineSource(const char* b, const char* e):
+    b(b),
+    e(e),
+    lexer(b, e)
+{
+}
+
+bool TextLineSource::next(uint64_t& id, std::string& s)
+{
+    GCodeLine line;
+    while(lexer.next(line))
+    {
+        if(line.hasCode())
+        {
+            id = line.text.b - b;
+            appendCode(line, s);
+            return true;
+        }
+    }
+    return false;
+}
+
+void TextLineSource::get(uint64_t id, std::string& s)
+{
+    GCodeLine line;
+    GCodeLexer(b + id, e).next(line);
+    appendCode(line, s);
+}
+
+void TextLineSource::rewind(uint64_t id)
+{
+    lexer = GCodeLexer(b + id, e);
+}
+
+void TextLineSource::seek(const CommandColumns& table, size_t i)
+{
+    rewind(i < table.size() ? table.offsets[i] : e - b);
+}
@@ -0,0 +1,59 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#pragma once
+
+#include "CommandTable.h"
+#include <stdint.h>
+#include <string>
+
+// Where GCodeSender gets the code it sends. The source picks an id for each command
+// so the sender can ask for it again; ids must be below 2^61.
+class LineSource
+{
+public:
+    virtual ~LineSource() {}
+
+    // Append the next command's code, without line number or checksum; returns false at the end
+    virtual bool next(uint64_t& id, std::string& s) = 0;
+
+    // Append the code of a command next() returned earlier
+    virtual void get(uint64_t id, std::string& s) = 0;
+
+    // Make next() return command id again
+    virtual void rewind(uint64_t id) = 0;
+
+    // Make next() return command i of table, which was built from the same job
+    virtual void seek(const CommandColumns& table, size_t i) = 0;
+};
+
+// G-code text; ids are offsets of lines. Comment-only and blank lines are skipped.
+class TextLineSource: public LineSource
+{
+private:
+    const char* b;
+    const char* e;
+    GCodeLexer lexer;
+
+public:
+    TextLineSource(const char* b, const char* e);
+
+    virtual bool next(uint64_t& id, std::string& s);
+    virtual void get(uint64_t id, std::string& s);
+    virtual void rewind(uint64_t id);
+    virtual void seek(const CommandColumns& table, size_t i);
+};
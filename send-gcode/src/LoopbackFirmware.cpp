@@ -0,0 +1,192 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+// Winsock 2 must come before Windows.h, which LoopbackFirmware.h includes
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+#include "LoopbackFirmware.h"
+#include "Format.h"
+#include "GCodeLexer.h"
+#include <algorithm>
+#include <stdexcept>
+
+using namespace std;
+
+// Wait up to ms for s to have something to read
+static bool readable(SOCKET s, unsigned ms)
+{
+    fd_set set;
+    FD_ZERO(&set);
+    FD_SET(s, &set);
+    timeval timeout;
+    timeout.tv_sec = ms / 1000;
+    timeout.tv_usec = ms % 1000 * 1000;
+    return select((int)s + 1, &set, 0, 0, &timeout) > 0;
+}
+
+static void sendAll(SOCKET s, const string& data)
+{
+    ::send(s, data.data(), (int)data.size(), 0);
+}
+
+LoopbackFirmware::LoopbackFirmware(unsigned dropEvery):
+    listener(INVALID_SOCKET),
+    port(0),
+    dropEvery(dropEvery),
+    stopping(0),
+    thread(0)
+{
+    memset(&stats, 0, sizeof(stats));
+    WSADATA data;
+    if(WSAStartup(MAKEWORD(2, 2), &data))
+        throw runtime_error("WSAStartup failed");
+
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0;
+    int length = sizeof(address);
+    SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if( s == INVALID_SOCKET ||
+        bind(s, (sockaddr*)&address, sizeof(address)) ||
+        listen(s, 1) ||
+        getsockname(s, (sockaddr*)&address, &length))
+    {
+        if(s != INVALID_SOCKET)
+            closesocket(s);
+        WSACleanup();
+        throw runtime_error("can not listen on 127.0.0.1");
+    }
+    listener = s;
+    port = ntohs(address.sin_port);
+
+    thread = CreateThread(0, 0, threadProc, this, 0, 0);
+    if(!thread)
+    {
+        closesocket(s);
+        WSACleanup();
+        throw runtime_error("CreateThread failed");
+    }
+} // LoopbackFirmware::LoopbackFirmware
+
+LoopbackFirmware::~LoopbackFirmware()
+{
+    stop();
+    closesocket((SOCKET)listener);
+    WSACleanup();
+}
+
+void LoopbackFirmware::stop()
+{
+    if(!thread)
+        return;
+    InterlockedExchange(&stopping, 1);
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+    thread = 0;
+}
+
+DWORD WINAPI LoopbackFirmware::threadProc(LPVOID param)
+{
+    ((LoopbackFirmware*)param)->run();
+    return 0;
+}
+
+void LoopbackFirmware::run()
+{
+    // Line numbers outlive connections, as they do in firmware behind a bridge
+    unsigned expectedLine = 1;
+    while(!stopping)
+    {
+        if(!readable((SOCKET)listener, pollMs))
+            continue;
+        SOCKET client = accept((SOCKET)listener, 0, 0);
+        if(client == INVALID_SOCKET)
+            continue;
+        ++stats.connections;
+
+        char buffer[1024];
+        size_t bytesInBuffer = 0;
+        bool open = true;
+        while(open && !stopping)
+        {
+            if(!readable(client, pollMs))
+                continue;
+            int n = recv(client, buffer + bytesInBuffer, (int)(sizeof(buffer) - bytesInBuffer), 0);
+            if(n <= 0)
+                break;
+            bytesInBuffer += n;
+
+            char* b = buffer;
+            char* end = buffer + bytesInBuffer;
+            char* nl;
+            while(open && (nl = find(b, end, '\n')) != end)
+            {
+                open = answer(client, b, nl, expectedLine);
+                b = nl + 1;
+            }
+            bytesInBuffer = end - b;
+            memmove(buffer, b, bytesInBuffer);
+            if(bytesInBuffer == sizeof(buffer))
+                bytesInBuffer = 0;
+        }
+        closesocket(client);
+    }
+}
+
+bool LoopbackFirmware::answer(UINT_PTR client, const char* b, const char* e, unsigned& expectedLine)
+{
+    while(e != b && (e[-1] == '\r' || isspace((unsigned char)e[-1])))
+        --e;
+    if(b == e)
+        return true;            // The newline which ends a fragment cut off by a drop
+
+    // Numbered lines need a good checksum and the next number, unless they're M110
+    const char* star = find(b, e, '*');
+    const char* command = b;
+    if(*b == 'N')
+    {
+        char* end;
+        unsigned long line = strtoul(b + 1, &end, 10);
+        command = end;
+        while(command != star && *command == ' ')
+            ++command;
+        bool isM110 = star - command >= 4 && !strncmp(command, "M110", 4);
+        bool valid = star != e && strtoul(star + 1, 0, 10) == checksum(b, star);
+        if(!valid || (!isM110 && line != expectedLine))
+        {
+            ++stats.resendsRequested;
+            sendAll((SOCKET)client, "Resend: " + toString(expectedLine) + "\nok\n");
+            return true;
+        }
+        expectedLine = line + 1;
+        ++stats.linesAccepted;
+        if(dropEvery && stats.linesAccepted % dropEvery == 0)
+        {
+            ++stats.drops;
+            return false;
+        }
+    }
+
+    if(star - command >= 4 && !strncmp(command, "M105", 4))
+        sendAll((SOCKET)client, "ok T:20.0 /0.0 B:20.0 /0.0\n");
+    else
+        sendAll((SOCKET)client, "ok\n");
+    return true;
+}
@@ -0,0 +1,67 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#pragma once
+
+#include "Transport.h"
+
+struct LoopbackStats
+{
+    unsigned linesAccepted;                     // Numbered lines, in order and with good checksums
+    unsigned resendsRequested;
+    unsigned connections;
+    unsigned drops;                             // Connections it closed on purpose
+};
+
+// Firmware stand-in on a local TCP port, for trying TcpTransport without a printer or bridge.
+// It runs on its own thread, checks line numbers and checksums the way firmware does, answers
+// every line with "ok" (M105 with temperatures), and can close the connection every so many
+// lines, after accepting a line but before answering it, the way a flaky bridge loses an "ok".
+class LoopbackFirmware
+{
+private:
+    enum {pollMs = 20};                         // How often the thread looks at stopping
+
+    UINT_PTR listener;                          // SOCKET
+    unsigned short port;
+    unsigned dropEvery;                         // 0 never
+    volatile LONG stopping;
+    LoopbackStats stats;                        // Only touched by the thread until it ends
+    HANDLE thread;
+
+public:
+    LoopbackFirmware(unsigned dropEvery);       // Throws exception on failure
+    ~LoopbackFirmware();
+
+public:
+    // Port it listens on, at 127.0.0.1
+    unsigned short getPort() {return port;}
+
+    // Stop the thread; call before getStats()
+    void stop();
+
+    const LoopbackStats& getStats() {return stats;}
+
+private:
+    static DWORD WINAPI threadProc(LPVOID param);
+
+    // Accept connections and answer them until stopping
+    void run();
+
+    // Answer one line; returns false to close the connection
+    bool answer(UINT_PTR client, const char* b, const char* e, unsigned& expectedLine);
+};
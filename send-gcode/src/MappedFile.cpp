@@ -0,0 +1,56 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#include "MappedFile.h"
+#include <stdexcept>
+
+using namespace std;
+
+MappedFile::MappedFile(const std::string& filename):
+    size(0)
+{
+    HANDLE h = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if(h == INVALID_HANDLE_VALUE)
+        throw runtime_error("can not open file " + filename);
+    file = shared_ptr<void>(h, CloseHandle);
+
+    LARGE_INTEGER fileSize;
+    if(!GetFileSizeEx(h, &fileSize))
+        throw runtime_error("can not read " + filename);
+    if((ULONGLONG)fileSize.QuadPart > (size_t)-1)
+        throw runtime_error(filename + " is too large to map; use the x64 build");
+    size = (size_t)fileSize.QuadPart;
+
+    // Windows refuses to map an empty file
+    if(!size)
+    {
+        static const char empty[1] = {0};
+        view = shared_ptr<const char>(empty, [](const char*){});
+        return;
+    }
+
+    h = CreateFileMappingA(h, 0, PAGE_READONLY, 0, 0, 0);
+    if(!h)
+        throw runtime_error("can not map " + filename);
+    mapping = shared_ptr<void>(h, CloseHandle);
+
+    // A 32-bit process rarely has more than about 1 GB of contiguous address space free
+    const char* p = (const char*)MapViewOfFile(h, FILE_MAP_READ, 0, 0, 0);
+    if(!p)
+        throw runtime_error("can not map " + filename + (sizeof(void*) < 8 ? "; files over about 1 GB need the x64 build" : ""));
+    view = shared_ptr<const char>(p, [](const char* p){UnmapViewOfFile(p);});
+}
@@ -0,0 +1,40 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <Windows.h>
+
+// A whole file mapped read-only into memory, in one view. A 32-bit process can map about
+// 1 GB at most; larger files need the x64 build. Throws exception on failure.
+class MappedFile
+{
+private:
+    std::shared_ptr<void> file;
+    std::shared_ptr<void> mapping;
+    std::shared_ptr<const char> view;
+    size_t size;
+
+public:
+    MappedFile(const std::string& filename);
+
+    const char* begin() const {return view.get();}
+    const char* end() const {return view.get() + size;}
+    size_t getSize() const {return size;}
+};
@@ -0,0 +1,103 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#include "NoisyTransport.h"
+
+using namespace std;
+
+NoiseConfig::NoiseConfig():
+    bitFlipRate(0),
+    dropByteRate(0),
+    dropOkRate(0),
+    resetRate(0),
+    seed(1)
+{
+}
+
+NoisyTransport::NoisyTransport(
+    const NoiseConfig& config,
+    TransportFactory innerFactory,
+    LineHandler receivedLine,
+    StatusWriter statusWriter):
+        config(config),
+        receivedLine(receivedLine),
+        random(config.seed ? config.seed : 1),
+        stats(),
+        inner(innerFactory([this](const char* b, const char* e){onLine(b, e);}, statusWriter))
+{
+}
+
+void NoisyTransport::send(std::string&& data)
+{
+    corrupt(data);
+    inner->send(move(data));
+}
+
+void NoisyTransport::sendUrgent(std::string&& data)
+{
+    corrupt(data);
+    inner->sendUrgent(move(data));
+}
+
+void NoisyTransport::corrupt(std::string& data)
+{
+    if(config.bitFlipRate > 0 || config.dropByteRate > 0)
+    {
+        size_t out = 0;
+        for(size_t i = 0; i < data.size(); ++i)
+        {
+            if(nextRandom() < config.dropByteRate)
+            {
+                ++stats.bytesDropped;
+                continue;
+            }
+            char ch = data[i];
+            if(nextRandom() < config.bitFlipRate)
+            {
+                ch ^= (char)(1 << (unsigned)(nextRandom() * 8));
+                ++stats.bitsFlipped;
+            }
+            data[out++] = ch;
+        }
+        data.resize(out);
+    }
+}
+
+double NoisyTransport::nextRandom()
+{
+    // xorshift32
+    random ^= random << 13;
+    random ^= random >> 17;
+    random ^= random << 5;
+    return random / 4294967296.0;
+}
+
+void NoisyTransport::onLine(const char* b, const char* e)
+{
+    if(config.resetRate > 0 && nextRandom() < config.resetRate)
+    {
+        ++stats.resetsInjected;
+        static const char start[] = "start";
+        receivedLine(start, start + 5);
+    }
+    if(e - b >= 2 && !strncmp(b, "ok", 2) && config.dropOkRate > 0 && nextRandom() < config.dropOkRate)
+    {
+        ++stats.oksDropped;
+        return;
+    }
+    receivedLine(b, e);
+}
@@ -0,0 +1,84 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#pragma once
+
+#include "Transport.h"
+#include <stdint.h>
+
+struct NoiseConfig
+{
+    double bitFlipRate;                         // Per byte sent: probability of flipping one bit
+    double dropByteRate;                        // Per byte sent: probability of losing it
+    double dropOkRate;                          // Per "ok" received: probability of losing it
+    double resetRate;                           // Per line received: probability of a spurious "start" before it
+    uint32_t seed;                              // Same seed, same faults
+
+    NoiseConfig();                              // No noise
+};
+
+struct NoiseStats
+{
+    unsigned bitsFlipped;
+    unsigned bytesDropped;
+    unsigned oksDropped;
+    unsigned resetsInjected;
+};
+
+// Wraps another transport and corrupts traffic at the configured rates. Faults come from a
+// seeded generator so a run can be repeated exactly.
+class NoisyTransport: public Transport
+{
+private:
+    NoiseConfig config;
+    LineHandler receivedLine;                   // Sender's line handler
+    uint32_t random;                            // Generator state
+    NoiseStats stats;
+    std::unique_ptr<Transport> inner;           // Must be last; it may call back during construction
+
+public:
+    NoisyTransport(
+        const NoiseConfig& config,
+        TransportFactory innerFactory,          // Creates the transport to corrupt
+        LineHandler receivedLine,
+        StatusWriter statusWriter);
+
+public:
+    // Corrupt data and pass it on
+    virtual void send(std::string&& data);
+    virtual void sendUrgent(std::string&& data);
+    virtual bool getWritePending() {return inner->getWritePending();}
+
+    // Get events for event loop
+    virtual const std::vector<Event>& getEvents() {return inner->getEvents();}
+
+    // Faults injected so far
+    const NoiseStats& getStats() {return stats;}
+
+    // Total number of faults injected so far
+    unsigned getFaults() {return stats.bitsFlipped + stats.bytesDropped + stats.oksDropped + stats.resetsInjected;}
+
+private:
+    // Uniform in [0, 1)
+    double nextRandom();
+
+    // Drop and flip bytes of data
+    void corrupt(std::string& data);
+
+    // Line from the inner transport
+    void onLine(const char* b, const char* e);
+};
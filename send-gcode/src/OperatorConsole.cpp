@@ -0,0 +1,303 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#include "OperatorConsole.h"
+#include <stdexcept>
+
+using namespace std;
+
+// Hand each complete, non-blank line at the front of buffer to handler, trimmed, and keep the rest
+template<typename Handler>
+static void splitLines(char* buffer, size_t& bytesInBuffer, size_t bufferSize, Handler handler)
+{
+    while(1)
+    {
+        size_t p = 0;
+        while(p < bytesInBuffer && buffer[p] != '\r' && buffer[p] != '\n')
+            ++p;
+        if(p < bytesInBuffer)
+        {
+            const char* b = buffer;
+            const char* e = buffer + p;
+            while(b != e && isspace((unsigned char)*b))
+                ++b;
+            while(e != b && isspace((unsigned char)e[-1]))
+                --e;
+            if(b != e)
+                handler(b, e);
+            while(p < bytesInBuffer && (buffer[p] == '\r' || buffer[p] == '\n'))
+                ++p;
+            memmove(buffer, buffer + p, bytesInBuffer - p);
+            bytesInBuffer -= p;
+        }
+        else
+        {
+            if(bytesInBuffer == bufferSize)
+                bytesInBuffer = 0;      // Too long to be a command
+            return;
+        }
+    }
+}
+
+OperatorConsole::OperatorConsole(
+    CommandHandler handler,
+    bool readStdin,
+    const std::string& pipeName):
+        handler(handler),
+        stdinThread(0),
+        stopping(0),
+        stdinReady(0),
+        pipe(INVALID_HANDLE_VALUE),
+        connected(false),
+        reading(false),
+        client(0),
+        writing(false),
+        bytesInReadBuffer(0)
+{
+    InitializeCriticalSection(&stdinLock);
+    memset(&overlappedConnect, 0, sizeof(OVERLAPPED));
+    memset(&overlappedRead, 0, sizeof(OVERLAPPED));
+    memset(&overlappedWrite, 0, sizeof(OVERLAPPED));
+
+    try
+    {
+        if(readStdin)
+        {
+            stdinReady = CreateEvent(0, false, false, 0);
+            if(!stdinReady)
+                throw runtime_error("CreateEvent failed");
+            events.push_back(Event(stdinReady, [this](){onStdin();}));
+            stdinThread = CreateThread(0, 0, stdinThreadProc, this, 0, 0);
+            if(!stdinThread)
+                throw runtime_error("CreateThread failed");
+        }
+
+        if(!pipeName.empty())
+        {
+            overlappedConnect.hEvent = CreateEvent(0, true, false, 0);
+            overlappedRead.hEvent = CreateEvent(0, true, false, 0);
+            overlappedWrite.hEvent = CreateEvent(0, true, false, 0);
+            if(!overlappedConnect.hEvent || !overlappedRead.hEvent || !overlappedWrite.hEvent)
+                throw runtime_error("CreateEvent failed");
+
+            string name = "\\\\.\\pipe\\" + pipeName;
+            pipe = CreateNamedPipeA(name.c_str(), PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+                PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT, 1, 4096, 4096, 0, 0);
+            if(pipe == INVALID_HANDLE_VALUE)
+                throw runtime_error("can not create pipe " + name);
+            events.push_back(Event(overlappedConnect.hEvent, [this](){onConnect();}));
+            events.push_back(Event(overlappedRead.hEvent, [this](){onRead();}));
+            events.push_back(Event(overlappedWrite.hEvent, [this](){onWrite();}));
+            startConnect();
+        }
+    }
+    catch(...)
+    {
+        release();
+        DeleteCriticalSection(&stdinLock);
+        throw;
+    }
+} // OperatorConsole::OperatorConsole
+
+OperatorConsole::~OperatorConsole()
+{
+    release();
+    DeleteCriticalSection(&stdinLock);
+}
+
+void OperatorConsole::release()
+{
+    if(stdinThread)
+    {
+        // The thread is usually blocked reading the console; keep cancelling until it notices
+        InterlockedExchange(&stopping, 1);
+        do
+            CancelSynchronousIo(stdinThread);
+        while(WaitForSingleObject(stdinThread, 10) == WAIT_TIMEOUT);
+        CloseHandle(stdinThread);
+        stdinThread = 0;
+    }
+    if(stdinReady)
+        CloseHandle(stdinReady);
+    stdinReady = 0;
+
+    if(pipe != INVALID_HANDLE_VALUE)
+    {
+        CancelIo(pipe);
+        CloseHandle(pipe);
+    }
+    pipe = INVALID_HANDLE_VALUE;
+    if(overlappedConnect.hEvent)
+        CloseHandle(overlappedConnect.hEvent);
+    if(overlappedRead.hEvent)
+        CloseHandle(overlappedRead.hEvent);
+    if(overlappedWrite.hEvent)
+        CloseHandle(overlappedWrite.hEvent);
+    overlappedConnect.hEvent = overlappedRead.hEvent = overlappedWrite.hEvent = 0;
+}
+
+DWORD WINAPI OperatorConsole::stdinThreadProc(LPVOID param)
+{
+    OperatorConsole* self = (OperatorConsole*)param;
+    HANDLE in = GetStdHandle(STD_INPUT_HANDLE);
+    char buffer[readBufferSize];
+    size_t bytesInBuffer = 0;
+    DWORD numRead;
+    while(!self->stopping && ReadFile(in, buffer + bytesInBuffer, readBufferSize - bytesInBuffer, &numRead, 0) && numRead)
+    {
+        bytesInBuffer += numRead;
+        splitLines(buffer, bytesInBuffer, readBufferSize, [self](const char* b, const char* e){
+            EnterCriticalSection(&self->stdinLock);
+            self->stdinLines.push_back(string(b, e));
+            LeaveCriticalSection(&self->stdinLock);
+            SetEvent(self->stdinReady);
+        });
+    }
+    return 0;
+}
+
+void OperatorConsole::onStdin()
+{
+    deque<string> lines;
+    EnterCriticalSection(&stdinLock);
+    lines.swap(stdinLines);
+    LeaveCriticalSection(&stdinLock);
+
+    for(size_t i = 0; i < lines.size(); ++i)
+        handler(lines[i], [](const char* b, const char* e){printf("%s\n", string(b, e).c_str());});
+}
+
+void OperatorConsole::startConnect()
+{
+    connected = false;
+    ResetEvent(overlappedConnect.hEvent);
+    if(!ConnectNamedPipe(pipe, &overlappedConnect))
+    {
+        DWORD err = GetLastError();
+        if(err == ERROR_PIPE_CONNECTED)
+            onClient();         // A client got in before we started waiting
+        else if(err != ERROR_IO_PENDING)
+            throw runtime_error("ConnectNamedPipe failed");
+    }
+}
+
+void OperatorConsole::onConnect()
+{
+    ResetEvent(overlappedConnect.hEvent);
+    if(connected)
+        return;
+    DWORD dummy;
+    if(!GetOverlappedResult(pipe, &overlappedConnect, &dummy, false))
+    {
+        if(GetLastError() != ERROR_IO_INCOMPLETE)
+            disconnect();
+        return;
+    }
+    onClient();
+}
+
+void OperatorConsole::onClient()
+{
+    connected = true;
+    ++client;
+    bytesInReadBuffer = 0;
+    startRead();
+}
+
+void OperatorConsole::startRead()
+{
+    ResetEvent(overlappedRead.hEvent);
+    if(!ReadFile(pipe, readBuffer + bytesInReadBuffer, readBufferSize - bytesInReadBuffer, 0, &overlappedRead) && GetLastError() != ERROR_IO_PENDING)
+        disconnect();
+    else
+        reading = true;         // The event is signaled whether it finished now or later
+}
+
+void OperatorConsole::onRead()
+{
+    ResetEvent(overlappedRead.hEvent);
+    if(!reading)
+        return;
+    reading = false;
+    DWORD numRead = 0;
+    if(!GetOverlappedResult(pipe, &overlappedRead, &numRead, false) || !numRead)
+    {
+        disconnect();
+        return;
+    }
+
+    bytesInReadBuffer += numRead;
+    unsigned forClient = client;
+    splitLines(readBuffer, bytesInReadBuffer, readBufferSize, [this, forClient](const char* b, const char* e){
+        handler(string(b, e), [this, forClient](const char* b, const char* e){write(forClient, b, e);});
+    });
+    if(connected && forClient == client)
+        startRead();
+}
+
+void OperatorConsole::disconnect()
+{
+    // Wait for cancelled operations so their completions don't land on the next client
+    DWORD dummy;
+    CancelIo(pipe);
+    if(reading)
+        GetOverlappedResult(pipe, &overlappedRead, &dummy, true);
+    if(writing)
+        GetOverlappedResult(pipe, &overlappedWrite, &dummy, true);
+    reading = false;
+    writing = false;
+    writeQueue.clear();
+    ResetEvent(overlappedRead.hEvent);
+    ResetEvent(overlappedWrite.hEvent);
+    DisconnectNamedPipe(pipe);
+    startConnect();
+}
+
+void OperatorConsole::write(unsigned forClient, const char* b, const char* e)
+{
+    if(!connected || forClient != client)
+        return;
+    writeQueue.push_back(string(b, e) + "\n");
+    startWrite();
+}
+
+void OperatorConsole::startWrite()
+{
+    if(writing || writeQueue.empty())
+        return;
+    ResetEvent(overlappedWrite.hEvent);
+    if(!WriteFile(pipe, writeQueue.front().data(), writeQueue.front().size(), 0, &overlappedWrite) && GetLastError() != ERROR_IO_PENDING)
+        disconnect();
+    else
+        writing = true;
+}
+
+void OperatorConsole::onWrite()
+{
+    ResetEvent(overlappedWrite.hEvent);
+    if(!writing)
+        return;
+    DWORD numWritten = 0;
+    if(!GetOverlappedResult(pipe, &overlappedWrite, &numWritten, false) || numWritten != writeQueue.front().size())
+    {
+        disconnect();
+        return;
+    }
+    writing = false;
+    writeQueue.pop_front();
+    startWrite();
+}
@@ -0,0 +1,106 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#pragma once
+
+#include "Transport.h"
+#include <deque>
+#include <list>
+
+// Handles one operator command; answers from the firmware go to reply, which the handler
+// may keep and call later
+typedef std::function<void(const std::string& code, LineHandler reply)> CommandHandler;
+
+// Reads operator commands typed on stdin and sent through a named pipe while a job is running,
+// and hands them to a CommandHandler from the event loop. Answers to stdin are printed;
+// answers to the pipe are written back to the client that sent the command.
+//
+// Console input can't be read with overlapped I/O, so a thread blocks on stdin and hands
+// complete lines over through a signaled queue. The pipe is overlapped and serves one client
+// at a time.
+class OperatorConsole
+{
+private:
+    CommandHandler handler;                     // Called for each command
+    std::vector<Event> events;                  // Events needed by this class
+
+    HANDLE stdinThread;                         // Blocks on stdin; 0 if not reading stdin
+    volatile LONG stopping;                     // Thread should exit
+    HANDLE stdinReady;                          // Signaled when stdinLines has something in it
+    CRITICAL_SECTION stdinLock;                 // Protects stdinLines
+    std::deque<std::string> stdinLines;         // Complete lines from the thread
+
+    HANDLE pipe;                                // Pipe server; INVALID_HANDLE_VALUE if none
+    OVERLAPPED overlappedConnect;               // Async ConnectNamedPipe()
+    OVERLAPPED overlappedRead;                  // Async ReadFile()
+    OVERLAPPED overlappedWrite;                 // Async WriteFile()
+    bool connected;                             // A client is connected
+    bool reading;                               // ReadFile() is under way
+    unsigned client;                            // Counts connections, so replies don't reach a later client
+    std::list<std::string> writeQueue;          // Replies to send
+    bool writing;                               // Front of writeQueue is being sent
+    static const size_t readBufferSize = 1024;  // Maximum size of a command
+    char readBuffer[readBufferSize];            // Receives incoming data
+    size_t bytesInReadBuffer;                   // Amount of data in readBuffer
+
+public:
+    OperatorConsole(
+        CommandHandler handler,
+        bool readStdin,                         // Read commands typed on the console
+        const std::string& pipeName);           // Serve \\.\pipe\<pipeName>; empty for none
+    ~OperatorConsole();
+
+public:
+    // Get events for event loop
+    const std::vector<Event>& getEvents() {return events;}
+
+private:
+    // Stop the thread and close handles
+    void release();
+
+    static DWORD WINAPI stdinThreadProc(LPVOID param);
+
+    // Signaled when the stdin thread has queued lines
+    void onStdin();
+
+    // Wait for the next client
+    void startConnect();
+
+    // Signaled when a client connected
+    void onConnect();
+
+    // A client is connected; start reading its commands
+    void onClient();
+
+    // Read more from the client
+    void startRead();
+
+    // Signaled when ReadFile() is done
+    void onRead();
+
+    // The client went away; wait for another
+    void disconnect();
+
+    // Queue a reply to the current client
+    void write(unsigned forClient, const char* b, const char* e);
+
+    // Send next string in writeQueue
+    void startWrite();
+
+    // Signaled when WriteFile() is done
+    void onWrite();
+};
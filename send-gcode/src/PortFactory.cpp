@@ -0,0 +1,58 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#include "PortFactory.h"
+#include "IocpSerial.h"
+#include "Serial.h"
+#include "TcpTransport.h"
+#include <stdexcept>
+
+using namespace std;
+
+bool isNetworkPort(const std::string& port)
+{
+    return !port.compare(0, 4, "tcp:");
+}
+
+TransportFactory portFactory(const std::string& port, unsigned bps, IocpReactor* completionPort, FlowControl flow)
+{
+    if(isNetworkPort(port))
+    {
+        size_t colon = port.rfind(':');
+        if(colon < 5 || colon + 1 == port.size())
+            throw runtime_error("expected tcp:<host>:<port>, not " + port);
+        string host = port.substr(4, colon - 4);
+        string service = port.substr(colon + 1);
+        return [host, service](LineHandler receivedLine, StatusWriter statusWriter) -> unique_ptr<Transport> {
+            unique_ptr<TcpTransport> tcp(new TcpTransport(receivedLine, statusWriter));
+            tcp->open(host, service);
+            return move(tcp);
+        };
+    }
+
+    return [port, bps, completionPort, flow](LineHandler receivedLine, StatusWriter statusWriter) -> unique_ptr<Transport> {
+        if(completionPort)
+        {
+            unique_ptr<IocpSerial> serial(new IocpSerial(*completionPort, receivedLine, statusWriter));
+            serial->open(port, bps, flow);
+            return move(serial);
+        }
+        unique_ptr<Serial> serial(new Serial(receivedLine, statusWriter));
+        serial->open(port, bps, flow);
+        return move(serial);
+    };
+}
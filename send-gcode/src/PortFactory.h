@@ -0,0 +1,33 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#pragma once
+
+#include "IocpReactor.h"
+#include "Serial.h"
+
+// Creates the transport named by port, opened at bps with flow control flow:
+//   tcp:<host>:<port>  a TcpTransport, for a network serial bridge; bps and flow are the bridge's business
+//   anything else      a serial port: an IocpSerial on completionPort, or a Serial if that is null
+TransportFactory portFactory(const std::string& port, unsigned bps, IocpReactor* completionPort, FlowControl flow = flowNone);
+
+// Is port a network serial bridge?
+bool isNetworkPort(const std::string& port);
+
+// Timeout (ms) for a network port when none is given. Bytes the bridge took just before a
+// dropped connection may never reach the firmware, and only a timeout notices.
+const unsigned networkTimeoutMs = 5000;
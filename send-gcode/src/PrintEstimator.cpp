@@ -0,0 +1,344 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#include "PrintEstimator.h"
+#include "CostModel.h"
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+#include <vector>
+
+using namespace std;
+
+namespace
+{
+    // A move waiting in the planner. Speeds are squared; that's what the look-ahead works with.
+    struct PlannedMove
+    {
+        double distance;
+        double nominal;                         // Feedrate after axis limits
+        double nominalSqr;
+        double maxEntrySqr;                     // Junction limit with the move before
+        double entryLimitSqr;                   // Fastest entry the moves after it allow
+        size_t command;                         // Index in the table
+    };
+
+    class MovePlanner
+    {
+    private:
+        const PrinterModel& printer;
+        vector<PlannedMove> ring;               // Size is a power of 2
+        size_t mask;                            // ring.size() - 1
+        size_t depth;
+        size_t first;                           // Oldest move
+        size_t count;
+        double entrySqr;                        // Entry speed of the oldest move; fixed by the move before it
+        double entry;                           // sqrt(entrySqr)
+        double prevUnit[4];                     // Direction of the last move added
+        double prevNominalSqr;
+        bool havePrev;                          // Last move added is still in the planner or just left it
+        double& time;                           // Moves add their time here as they leave the planner
+        float* finishTimes;                     // Moves record when they finish; may be null
+
+    public:
+        MovePlanner(const PrinterModel& printer, unsigned depth, double& time, float* finishTimes):
+            printer(printer),
+            depth(max(depth, 1u)),
+            first(0),
+            count(0),
+            entrySqr(0),
+            entry(0),
+            prevNominalSqr(0),
+            havePrev(false),
+            time(time),
+            finishTimes(finishTimes)
+        {
+            size_t size = 1;
+            while(size < this->depth)
+                size *= 2;
+            ring.resize(size);
+            mask = size - 1;
+        }
+
+        // Add a move of distance mm along unit (X, Y, Z, E) at speed mm/s
+        void add(size_t command, double distance, const double unit[4], double speed)
+        {
+            // Slow down until no axis goes faster than its limit
+            for(int axis = 0; axis < 4; ++axis)
+                if(speed * fabs(unit[axis]) > printer.axisMaxFeedrate[axis])
+                    speed = printer.axisMaxFeedrate[axis] / fabs(unit[axis]);
+
+            PlannedMove move;
+            move.command = command;
+            move.distance = distance;
+            move.nominal = speed;
+            move.nominalSqr = speed * speed;
+            move.maxEntrySqr = 0;
+            if(havePrev)
+            {
+                // Junction deviation: the fastest speed at which a circle through the corner,
+                // deviating at most junctionDeviation from it, can be followed at full acceleration
+                double cosTheta = 0;
+                for(int axis = 0; axis < 4; ++axis)
+                    cosTheta -= prevUnit[axis] * unit[axis];
+                double limitSqr = min(move.nominalSqr, prevNominalSqr);
+                if(cosTheta > 0.999999)
+                    limitSqr = 0;
+                else if(cosTheta > -0.999999)
+                {
+                    double sinHalf = sqrt(0.5 * (1 - cosTheta));
+                    limitSqr = min(limitSqr, printer.acceleration * printer.junctionDeviation * sinHalf / (1 - sinHalf));
+                }
+                move.maxEntrySqr = limitSqr;
+            }
+            copy(unit, unit + 4, prevUnit);
+            prevNominalSqr = move.nominalSqr;
+            havePrev = true;
+
+            if(count == depth)
+                retire();
+
+            // Look-ahead, newest first. The newest move must be able to stop. A move's limit
+            // only depends on the moves after it, so stop at the first one which doesn't change;
+            // this keeps the pass short on a long, straight run. The oldest move's entry is
+            // already fixed so it doesn't need a limit.
+            double a2 = 2 * printer.acceleration;
+            move.entryLimitSqr = min(move.maxEntrySqr, a2 * move.distance);
+            ring[(first + count++) & mask] = move;
+            for(size_t i = count - 1; i > 1; --i)
+            {
+                const PlannedMove& next = ring[(first + i) & mask];
+                PlannedMove& m = ring[(first + i - 1) & mask];
+                double limit = min(m.maxEntrySqr, next.entryLimitSqr + a2 * m.distance);
+                if(limit == m.entryLimitSqr)
+                    break;
+                m.entryLimitSqr = limit;
+            }
+        }
+
+        // Finish every move and come to rest
+        void flush()
+        {
+            while(count)
+                retire();
+            havePrev = false;
+        }
+
+    private:
+        // The oldest move leaves the planner. Its exit speed is the highest which the moves
+        // behind it can still slow down from before the planner runs dry.
+        void retire()
+        {
+            const PlannedMove& move = ring[first];
+            double exitSqr = min(count > 1 ? ring[(first + 1) & mask].entryLimitSqr : 0.0, entrySqr + 2 * printer.acceleration * move.distance);
+            double exit = sqrt(exitSqr);
+            time += trapezoidTime(move.distance, entry, exit, move.nominal, printer.acceleration);
+            if(finishTimes)
+                finishTimes[move.command] = (float)time;
+            entrySqr = exitSqr;
+            entry = exit;
+            first = (first + 1) & mask;
+            --count;
+        }
+    };
+}
+
+PrintEstimate estimatePrintTime(
+    const CommandColumns& table,
+    const PrinterModel& printer,
+    unsigned plannerDepth,
+    std::vector<float>* finishTimes,
+    const CostModel* costs)
+{
+    PrintEstimate estimate;
+    memset(&estimate, 0, sizeof(estimate));
+    double& time = estimate.total;
+    float* finish = 0;
+    if(finishTimes)
+    {
+        finishTimes->assign(table.size(), 0.0f);
+        if(!finishTimes->empty())
+            finish = &(*finishTimes)[0];
+    }
+    MovePlanner planner(printer, plannerDepth, time, finish);
+
+    static const char axes[4] = {'X', 'Y', 'Z', 'E'};
+    double position[4] = {0, 0, 0, 0};
+    bool relative = false, relativeE = false;
+    double feedrate = printer.defaultFeedrate;
+    double hotend = printer.ambient, hotendTarget = 0;
+    double bed = printer.ambient, bedTarget = 0;
+    double temperatureTime = 0;
+
+    // Temperatures move towards their targets as time passes
+    auto updateTemperatures = [&]() {
+        double seconds = time - temperatureTime;
+        temperatureTime = time;
+        double goal = hotendTarget > 0 ? hotendTarget : printer.ambient;
+        double step = printer.hotendHeatRate * seconds;
+        hotend = hotend < goal ? min(goal, hotend + step) : max(goal, hotend - step);
+        goal = bedTarget > 0 ? bedTarget : printer.ambient;
+        step = printer.bedHeatRate * seconds;
+        bed = bed < goal ? min(goal, bed + step) : max(goal, bed - step);
+    };
+
+    // Seconds the printer has taken to answer command i before; 0 if unknown. These commands
+    // usually come with the planner empty, so the answer time is how long they took.
+    auto learned = [&](size_t i) -> double {
+        return costs ? costs->getMean(costKey(table, i)) : 0;
+    };
+
+    // Wait for the planner to empty
+    auto drain = [&]() {
+        double before = time;
+        planner.flush();
+        estimate.moving += time - before;
+    };
+
+    for(size_t i = 0; i < table.size(); ++i)
+    {
+        uint16_t opcode = table.opcodes[i];
+        uint32_t mask = table.paramMasks[i];
+        float v;
+        if(opcode == (opcodeG | 0) || opcode == (opcodeG | 1) || (opcode == opcodeNone && mask))
+        {
+            // Values are in letter order, so one walk over the mask finds them all;
+            // cheaper than a getValue() for each of E, F, X, Y and Z
+            float given[4];
+            uint32_t present = 0;
+            const float* value = &table.values[table.valueStarts[i]];
+            for(uint32_t rest = mask; rest; rest &= rest - 1, ++value)
+            {
+                uint32_t bit = rest & (0 - rest);
+                if(bit == paramBit('F'))
+                {
+                    if(*value > 0)
+                        feedrate = *value / 60;
+                }
+                else
+                    for(int axis = 0; axis < 4; ++axis)
+                        if(bit == paramBit(axes[axis]) && *value == *value)
+                        {
+                            given[axis] = *value;
+                            present |= 1 << axis;
+                        }
+            }
+
+            double delta[4];
+            for(int axis = 0; axis < 4; ++axis)
+            {
+                delta[axis] = 0;
+                if(!(present & (1 << axis)))
+                    continue;
+                v = given[axis];
+                double target = (relative || (axis == 3 && relativeE)) ? position[axis] + v : v;
+                delta[axis] = target - position[axis];
+                position[axis] = target;
+            }
+
+            // Like the firmware, E only sets the distance of an extrude-only move
+            double distance = sqrt(delta[0] * delta[0] + delta[1] * delta[1] + delta[2] * delta[2]);
+            if(distance == 0)
+                distance = fabs(delta[3]);
+            if(distance == 0)
+                continue;
+            double unit[4];
+            for(int axis = 0; axis < 4; ++axis)
+                unit[axis] = delta[axis] / distance;
+            double before = time;
+            planner.add(i, distance, unit, min(feedrate, printer.maxFeedrate));
+            ++estimate.moves;
+            estimate.distance += distance;
+            estimate.moving += time - before;
+        }
+        else if(opcode == (opcodeG | 4))
+        {
+            drain();
+            double seconds = 0;
+            if(table.getValue(i, 'P', v) && v == v)
+                seconds = v / 1000;
+            else if(table.getValue(i, 'S', v) && v == v)
+                seconds = v;
+            time += seconds;
+            estimate.dwelling += seconds;
+        }
+        else if(opcode == (opcodeG | 28))
+        {
+            drain();
+            double seconds = learned(i);
+            if(!seconds)
+                seconds = printer.homingTime;
+            time += seconds;
+            estimate.homing += seconds;
+            bool any = (mask & (paramBit('X') | paramBit('Y') | paramBit('Z'))) != 0;
+            for(int axis = 0; axis < 3; ++axis)
+                if(!any || (mask & paramBit(axes[axis])))
+                    position[axis] = 0;
+        }
+        else if(opcode == (opcodeG | 90))
+            relative = false;
+        else if(opcode == (opcodeG | 91))
+            relative = true;
+        else if(opcode == (opcodeG | 92))
+        {
+            for(int axis = 0; axis < 4; ++axis)
+                if(table.getValue(i, axes[axis], v) && v == v)
+                    position[axis] = v;
+        }
+        else if(opcode == (opcodeM | 82))
+            relativeE = false;
+        else if(opcode == (opcodeM | 83))
+            relativeE = true;
+        else if(opcode == (opcodeM | 104) || opcode == (opcodeM | 109) || opcode == (opcodeM | 140) || opcode == (opcodeM | 190))
+        {
+            bool isBed = opcode == (opcodeM | 140) || opcode == (opcodeM | 190);
+            bool wait = opcode == (opcodeM | 109) || opcode == (opcodeM | 190);
+            if(wait)
+                drain();
+            updateTemperatures();
+            if(table.getValue(i, 'S', v) && v == v)
+                (isBed ? bedTarget : hotendTarget) = v;
+            if(wait)
+            {
+                double target = isBed ? bedTarget : hotendTarget;
+                double current = isBed ? bed : hotend;
+                double rate = isBed ? printer.bedHeatRate : printer.hotendHeatRate;
+                if(target > current)
+                {
+                    double seconds = learned(i);
+                    if(!seconds)
+                        seconds = (target - current) / rate;
+                    time += seconds;
+                    estimate.heating += seconds;
+                    updateTemperatures();
+                    (isBed ? bed : hotend) = target;
+                }
+            }
+        }
+        else if(opcode == (opcodeM | 400))
+            drain();
+
+        // A move overwrites this when it leaves the planner
+        if(finish)
+            finish[i] = (float)time;
+    }
+    drain();
+    if(finish)
+        for(size_t i = 1; i < table.size(); ++i)
+            finish[i] = max(finish[i], finish[i - 1]);
+    return estimate;
+}
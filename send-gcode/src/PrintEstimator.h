@@ -0,0 +1,48 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#pragma once
+
+#include "CommandTable.h"
+#include "Kinematics.h"
+
+class CostModel;
+
+struct PrintEstimate
+{
+    double total;                               // Seconds from the first command to the last
+    double moving;                              // Seconds spent in moves
+    double heating;                             // Seconds waiting in M109 and M190
+    double dwelling;                            // Seconds in G4
+    double homing;                              // Seconds in G28
+    unsigned moves;
+    double distance;                            // mm travelled; E-only moves count their E distance
+};
+
+// Estimate how long table takes to print. Moves go through a planner like the firmware's:
+// plannerDepth moves of look-ahead, trapezoidal acceleration, per-axis feedrate limits and
+// junction deviation cornering. Commands which wait (G4, G28, M109, M190, M400) empty the planner.
+// If finishTimes isn't null it gets the estimated seconds from the start until each command is
+// done; it never decreases, so a command after a move isn't done before the move is.
+// If costs isn't null, homing and heating take as long as this printer has taken over them
+// before, where it has done so often enough.
+PrintEstimate estimatePrintTime(
+    const CommandColumns& table,
+    const PrinterModel& printer,
+    unsigned plannerDepth,
+    std::vector<float>* finishTimes = 0,
+    const CostModel* costs = 0);
@@ -0,0 +1,222 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#include "ProgressJournal.h"
+#include <algorithm>
+#include <stddef.h>
+#include <stdexcept>
+
+using namespace std;
+
+const char journalMagic[8] = {'S', 'G', 'J', 'O', 'U', 'R', 'N', 0};
+
+// Records are small and the thread keeps only the newest, so a small ring will do
+static const size_t journalRingSize = 64 * 1024;
+
+// Check value of a record: a sum of its bytes, skipping check, weighted by position so
+// swapped or shifted bytes don't cancel out
+static uint32_t journalCheck(const JournalRecord& record)
+{
+    const uint8_t* p = (const uint8_t*)&record;
+    uint32_t a = 1, b = 0;
+    for(size_t i = 0; i < sizeof(record); ++i)
+    {
+        uint8_t byte = (i >= offsetof(JournalRecord, check) && i < offsetof(JournalRecord, check) + 4) ? 0 : p[i];
+        a = (a + byte) % 65521;
+        b = (b + a) % 65521;
+    }
+    return b << 16 | a;
+}
+
+uint64_t journalHash(const char* b, const char* e)
+{
+    // FNV-1a, a word at a time so a large job doesn't hold up the start
+    uint64_t hash = 14695981039346656037ULL;
+    const char* p = b;
+    for(; e - p >= 8; p += 8)
+    {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        hash = (hash ^ word) * 1099511628211ULL;
+    }
+    for(; p != e; ++p)
+        hash = (hash ^ (uint8_t)*p) * 1099511628211ULL;
+    return hash;
+}
+
+bool readJournal(const std::string& filename, uint64_t jobSize, uint64_t jobHash, JournalPosition& position)
+{
+    shared_ptr<FILE> f(fopen(filename.c_str(), "rb"), [](FILE* f){if(f) fclose(f);});
+    if(!f)
+        return false;
+
+    JournalFileHeader header;
+    if(fread(&header, sizeof(header), 1, &*f) != 1 || memcmp(header.magic, journalMagic, sizeof(journalMagic)))
+        throw runtime_error(filename + " is not a journal file");
+    if(header.version != journalVersion)
+        throw runtime_error(filename + " has an unsupported journal version");
+    if(header.jobSize != jobSize || header.jobHash != jobHash)
+        throw runtime_error(filename + " is the journal of a different job");
+
+    position.done = false;
+    position.any = false;
+    JournalRecord record;
+    while(fread(&record, sizeof(record), 1, &*f) == 1)
+    {
+        if(record.check != journalCheck(record))
+            break;
+        if(record.type == journalDone)
+            position.done = true;
+        else if(record.type == journalAck)
+        {
+            position.any = true;
+            position.index = record.index;
+            position.sourceLine = record.sourceLine;
+            position.state.relative = record.relative != 0;
+            position.state.relativeE = record.relativeE != 0;
+            position.state.inches = record.inches != 0;
+            copy(record.position, record.position + 4, position.state.position);
+            position.state.feedrate = record.feedrate;
+            position.state.hotendTarget = record.hotendTarget;
+            position.state.bedTarget = record.bedTarget;
+            position.state.fan = record.fan;
+        }
+    }
+    return true;
+}
+
+// Create the journal under a temporary name; it's renamed over the old one once it's ready
+static shared_ptr<void> createJournalFile(const string& filename, const CommandColumns& table, uint64_t jobSize, uint64_t jobHash)
+{
+    string newName = filename + ".new";
+    HANDLE h = CreateFileA(newName.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_DELETE, 0, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+    if(h == INVALID_HANDLE_VALUE)
+        throw runtime_error("can not create journal file " + filename);
+    shared_ptr<void> file(h, CloseHandle);
+
+    JournalFileHeader header;
+    memcpy(header.magic, journalMagic, sizeof(header.magic));
+    header.version = journalVersion;
+    header.reserved = 0;
+    header.jobSize = jobSize;
+    header.jobHash = jobHash;
+    header.commands = table.size();
+    DWORD numWritten = 0;
+    if(!WriteFile(h, &header, sizeof(header), &numWritten, 0) || numWritten != sizeof(header) || !FlushFileBuffers(h))
+        throw runtime_error("can not write journal file " + filename);
+    return file;
+}
+
+ProgressJournal::ProgressJournal(
+    const std::string& filename,
+    const CommandColumns& table,
+    uint64_t jobSize,
+    uint64_t jobHash,
+    size_t firstIndex,
+    const ModalState& state,
+    unsigned intervalMs):
+        table(table),
+        nextIndex(firstIndex),
+        state(state),
+        file(createJournalFile(filename, table, jobSize, jobHash)),
+        havePending(false),
+        writer(
+            journalRingSize,
+            [this](const char* b, const char* e){onRecord(b, e);},
+            [this](){onFlush();},
+            intervalMs)
+{
+    // A resumed job has already got past the command before firstIndex. That has to be on disk
+    // before the old journal goes, or a crash while the preamble re-heats would lose it.
+    if(firstIndex)
+    {
+        JournalRecord record = makeRecord(journalAck, firstIndex - 1);
+        DWORD numWritten = 0;
+        if(!WriteFile(file.get(), &record, sizeof(record), &numWritten, 0) || numWritten != sizeof(record))
+            throw runtime_error("can not write journal file " + filename);
+    }
+    if(!FlushFileBuffers(file.get()) ||
+        !MoveFileExA((filename + ".new").c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+    {
+        throw runtime_error("can not replace journal file " + filename);
+    }
+}
+
+void ProgressJournal::acknowledge(size_t index)
+{
+    if(index >= table.size() || index < nextIndex)
+        return;
+    while(nextIndex <= index)
+        state.apply(table, nextIndex++);
+    push(journalAck, index);
+}
+
+void ProgressJournal::done()
+{
+    push(journalDone, nextIndex);
+}
+
+void ProgressJournal::push(JournalRecordType type, size_t index)
+{
+    JournalRecord record = makeRecord(type, index);
+    writer.push(&record, sizeof(record));
+}
+
+JournalRecord ProgressJournal::makeRecord(JournalRecordType type, size_t index) const
+{
+    JournalRecord record;
+    memset(&record, 0, sizeof(record));
+    record.type = type;
+    record.index = index;
+    if(index < table.size())
+        record.sourceLine = table.sourceLines[index];
+    record.relative = state.relative;
+    record.relativeE = state.relativeE;
+    record.inches = state.inches;
+    copy(state.position, state.position + 4, record.position);
+    record.feedrate = state.feedrate;
+    record.hotendTarget = state.hotendTarget;
+    record.bedTarget = state.bedTarget;
+    record.fan = state.fan;
+    record.check = journalCheck(record);
+    return record;
+}
+
+void ProgressJournal::onRecord(const char* b, const char* e)
+{
+    if(e - b != sizeof(JournalRecord))
+        return;
+    const JournalRecord& record = *(const JournalRecord*)b;
+
+    // Only the newest position matters; the end of the job is written straight away
+    pending = record;
+    havePending = true;
+    if(record.type == journalDone)
+        onFlush();
+}
+
+void ProgressJournal::onFlush()
+{
+    if(!havePending)
+        return;
+    havePending = false;
+    DWORD numWritten = 0;
+    if(!WriteFile(file.get(), &pending, sizeof(pending), &numWritten, 0) || numWritten != sizeof(pending))
+        throw runtime_error("journal file write error");
+    if(!FlushFileBuffers(file.get()))
+        throw runtime_error("journal file flush error");
+}
@@ -0,0 +1,127 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#pragma once
+
+#include "BackgroundWriter.h"
+#include "JobIndex.h"
+
+// Journal file layout:
+//      JournalFileHeader
+//      JournalRecord*
+// All fields are little endian. The file is append-only. Every record stands alone, so after a
+// crash the last record with a good check value says where the job got to. A new journal is
+// written under another name and only replaces the old one once it holds the starting position.
+// A job resumed after command index starts with an ack of index, copied from the old journal.
+
+enum JournalRecordType
+{
+    journalAck          = 1,    // The firmware accepted command index; state is the state after it
+    journalDone         = 2,    // The job finished
+};
+
+#pragma pack(push, 1)
+struct JournalFileHeader
+{
+    char        magic[8];       // journalMagic
+    uint32_t    version;        // journalVersion
+    uint32_t    reserved;
+    uint64_t    jobSize;        // Size of the job file, to catch a journal for a different job
+    uint64_t    jobHash;        // journalHash() of the job file, likewise
+    uint64_t    commands;       // Commands in the job
+};
+
+struct JournalRecord
+{
+    uint32_t    type;           // JournalRecordType
+    uint32_t    check;          // journalCheck() of the record; a torn write won't match
+    uint64_t    index;          // Command, by position in the job
+    uint32_t    sourceLine;     // Its line in the job file
+    uint8_t     relative;       // ModalState, see JobIndex.h
+    uint8_t     relativeE;
+    uint8_t     inches;
+    uint8_t     reserved;
+    double      position[4];
+    float       feedrate;
+    float       hotendTarget;
+    float       bedTarget;
+    float       fan;
+};
+#pragma pack(pop)
+
+extern const char journalMagic[8];
+const uint32_t journalVersion = 3;
+
+// Where a journalled job got to
+struct JournalPosition
+{
+    bool done;                  // Job finished; nothing to resume
+    bool any;                   // Anything was accepted
+    uint64_t index;             // Last command accepted
+    unsigned sourceLine;
+    ModalState state;           // State after it
+};
+
+// Identifies the contents of a job file
+uint64_t journalHash(const char* b, const char* e);
+
+// Read the last good record of a journal. Returns false if the file doesn't exist.
+// Throws exception if it isn't a journal for a job of this size and hash.
+bool readJournal(const std::string& filename, uint64_t jobSize, uint64_t jobHash, JournalPosition& position);
+
+// Records the progress of a job so it can be resumed after the host crashes. The sender's
+// thread only tracks state and copies records into a memory ring. A background thread keeps
+// the newest one and writes it, then flushes it to disk, at most once per interval. That costs
+// two system calls per interval however fast lines go.
+class ProgressJournal
+{
+private:
+    CommandColumns table;
+    size_t nextIndex;                           // state is the state before this command
+    ModalState state;
+    std::shared_ptr<void> file;                 // Journal file
+    JournalRecord pending;                      // Newest record not yet written; only used by the background thread
+    bool havePending;
+    BackgroundWriter writer;                    // Must be last; its thread uses the members above
+
+public:
+    ProgressJournal(
+        const std::string& filename,            // Replaced if it exists
+        const CommandColumns& table,            // The job; caller must keep what it reads alive
+        uint64_t jobSize,                       // Size of the job file
+        uint64_t jobHash,                       // journalHash() of it
+        size_t firstIndex,                      // First command which will be sent
+        const ModalState& state,                // State before it
+        unsigned intervalMs);                   // Longest time a record waits to reach the disk
+
+public:
+    // The firmware accepted command index
+    void acknowledge(size_t index);
+
+    // The job finished
+    void done();
+
+    // Has writing failed? If so, getError() describes it.
+    bool getFailed() const {return writer.getFailed();}
+    const std::string& getError() const {return writer.getError();}
+
+private:
+    void push(JournalRecordType type, size_t index);
+    JournalRecord makeRecord(JournalRecordType type, size_t index) const;
+    void onRecord(const char* b, const char* e);
+    void onFlush();
+};
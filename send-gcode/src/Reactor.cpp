@@ -0,0 +1,147 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#include "Reactor.h"
+#include "Clock.h"
+#include "Format.h"
+#include <algorithm>
+#include <stdexcept>
+
+using namespace std;
+
+// Append events to list and their handles to handles
+static void addEvents(vector<Event>& list, vector<HANDLE>& handles, const vector<Event>& events)
+{
+    for(size_t i = 0; i < events.size(); ++i)
+    {
+        list.push_back(events[i]);
+        handles.push_back(get<0>(events[i]));
+    }
+}
+
+// Remove entries of list whose handles appear in events
+static void removeEvents(vector<Event>& list, vector<HANDLE>& handles, const vector<Event>& events)
+{
+    for(size_t i = 0; i < events.size(); ++i)
+    {
+        vector<HANDLE>::iterator pos = find(handles.begin(), handles.end(), get<0>(events[i]));
+        if(pos != handles.end())
+        {
+            list.erase(list.begin() + (pos - handles.begin()));
+            handles.erase(pos);
+        }
+    }
+}
+
+WaitReactor::WaitReactor():
+    next(0)
+{
+}
+
+void WaitReactor::add(const std::vector<Event>& events)
+{
+    if(handles.size() + events.size() > MAXIMUM_WAIT_OBJECTS)
+        throw runtime_error("too many events to wait for; at most " + toString(MAXIMUM_WAIT_OBJECTS));
+    addEvents(this->events, handles, events);
+}
+
+void WaitReactor::remove(const std::vector<Event>& events)
+{
+    removeEvents(this->events, handles, events);
+    next = 0;
+}
+
+unsigned WaitReactor::step(DWORD timeoutMs)
+{
+    size_t n = handles.size();
+    if(!n)
+        return 0;
+    next %= n;
+    rotated.assign(handles.begin() + next, handles.end());
+    rotated.insert(rotated.end(), handles.begin(), handles.begin() + next);
+
+    DWORD result = WaitForMultipleObjectsEx(n, &rotated[0], false, timeoutMs, true);
+    if(result == WAIT_FAILED)
+        throw runtime_error("wait failed");
+    else if(result >= n)
+        return 0;                       // Timeout, or an APC ran
+
+    // The handler may change events, so copy it out first
+    size_t i = (next + result) % n;
+    next = i + 1;
+    function<void()> handler = get<1>(events[i]);
+    handler();
+    return 1;
+}
+
+void PollReactor::add(const std::vector<Event>& events)
+{
+    addEvents(this->events, handles, events);
+}
+
+void PollReactor::remove(const std::vector<Event>& events)
+{
+    removeEvents(this->events, handles, events);
+}
+
+// The handler may change events, so copy it out first
+void PollReactor::dispatch(size_t i)
+{
+    function<void()> handler = get<1>(events[i]);
+    handler();
+}
+
+// Dispatch every signaled event without waiting
+unsigned PollReactor::poll()
+{
+    unsigned dispatched = 0;
+    for(size_t i = 0; i < handles.size(); ++i)
+    {
+        if(WaitForSingleObject(handles[i], 0) != WAIT_OBJECT_0)
+            continue;
+        dispatch(i);
+        ++dispatched;
+    }
+    return dispatched;
+}
+
+unsigned PollReactor::step(DWORD timeoutMs)
+{
+    unsigned dispatched = poll();
+    if(dispatched || !timeoutMs || handles.empty())
+        return dispatched;
+
+    if(handles.size() <= MAXIMUM_WAIT_OBJECTS)
+    {
+        // The wait consumes an auto-reset event's signal, so dispatch what it found
+        DWORD result = WaitForMultipleObjects(handles.size(), &handles[0], false, timeoutMs);
+        if(result == WAIT_FAILED)
+            throw runtime_error("wait failed");
+        else if(result >= handles.size())
+            return 0;
+        dispatch(result);
+        return 1;
+    }
+
+    uint64_t start = monotonicMicros();
+    while(!dispatched && (timeoutMs == INFINITE || monotonicMicros() - start < timeoutMs * 1000ull))
+    {
+        Sleep(sleepMs);
+        dispatched = poll();
+    }
+    return dispatched;
+}
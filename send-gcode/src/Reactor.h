@@ -0,0 +1,86 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#pragma once
+
+#include "Transport.h"
+
+// Dispatches Events. Any number of senders, transports and clocks can share one reactor,
+// so a host application can drive many printers from one thread. A host with its own loop
+// waits on getHandles() alongside its own and calls step(0) when one is signaled.
+class Reactor
+{
+public:
+    virtual ~Reactor() {}
+
+    // Dispatch these events when they are signaled; handlers may add and remove events
+    virtual void add(const std::vector<Event>& events) = 0;
+
+    // Stop dispatching events with these handles
+    virtual void remove(const std::vector<Event>& events) = 0;
+
+    // Dispatch signaled events, waiting up to timeoutMs for one (INFINITE waits for ever).
+    // Returns the number dispatched; 0 if none were signaled in time.
+    virtual unsigned step(DWORD timeoutMs) = 0;
+
+    // Handles to wait on before calling step(0)
+    virtual const std::vector<HANDLE>& getHandles() = 0;
+};
+
+// Waits in WaitForMultipleObjectsEx, so at most MAXIMUM_WAIT_OBJECTS handles. Each step
+// dispatches one event and the search starts after it next time, so an event that is always
+// signaled (e.g. a busy VirtualClock) can't starve the others.
+class WaitReactor: public Reactor
+{
+private:
+    std::vector<Event> events;
+    std::vector<HANDLE> handles;                // Same order as events
+    std::vector<HANDLE> rotated;                // handles, starting at next
+    size_t next;                                // Where the next search starts
+
+public:
+    WaitReactor();
+
+public:
+    virtual void add(const std::vector<Event>& events);
+    virtual void remove(const std::vector<Event>& events);
+    virtual unsigned step(DWORD timeoutMs);
+    virtual const std::vector<HANDLE>& getHandles() {return handles;}
+};
+
+// Checks each handle in turn without waiting, and dispatches every one that is signaled.
+// Takes any number of handles. Meant for sessions driven entirely by VirtualClocks and
+// simulated printers, e.g. benchmarks and tests, which step(0). When nothing is signaled,
+// step() waits for up to timeoutMs: in one WaitForMultipleObjects() if the handles fit in
+// one, otherwise by checking again every sleepMs.
+class PollReactor: public Reactor
+{
+private:
+    enum {sleepMs = 1};
+
+    std::vector<Event> events;
+    std::vector<HANDLE> handles;                // Same order as events
+
+    unsigned poll();
+    void dispatch(size_t i);
+
+public:
+    virtual void add(const std::vector<Event>& events);
+    virtual void remove(const std::vector<Event>& events);
+    virtual unsigned step(DWORD timeoutMs);
+    virtual const std::vector<HANDLE>& getHandles() {return handles;}
+};
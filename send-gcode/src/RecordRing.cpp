@@ -0,0 +1,90 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#include "RecordRing.h"
+#include <algorithm>
+
+using namespace std;
+
+RecordRing::RecordRing(size_t capacity):
+    writePos(0),
+    readPos(0),
+    dropped(0)
+{
+    size_t size = 64;
+    while(size < capacity)
+        size *= 2;
+    buffer.resize(size);
+    mask = (uint32_t)size - 1;
+}
+
+bool RecordRing::push(const void* a, size_t aSize, const void* b, size_t bSize)
+{
+    uint32_t recordSize = (uint32_t)(aSize + bSize);
+    uint32_t w = (uint32_t)writePos;
+    uint32_t r = (uint32_t)readPos;
+    if(buffer.size() - (w - r) < sizeof(recordSize) + recordSize)
+    {
+        InterlockedIncrement(&dropped);
+        return false;
+    }
+
+    copyIn(w, &recordSize, sizeof(recordSize));
+    copyIn(w + sizeof(recordSize), a, aSize);
+    if(bSize)
+        copyIn(w + sizeof(recordSize) + (uint32_t)aSize, b, bSize);
+
+    // Publish the record only after its contents are in place
+    InterlockedExchange(&writePos, (LONG)(w + sizeof(recordSize) + recordSize));
+    return true;
+}
+
+bool RecordRing::pop(std::vector<char>& record)
+{
+    uint32_t r = (uint32_t)readPos;
+    uint32_t w = (uint32_t)writePos;
+    if(r == w)
+        return false;
+
+    uint32_t recordSize;
+    copyOut(r, &recordSize, sizeof(recordSize));
+    record.resize(recordSize);
+    if(recordSize)
+        copyOut(r + sizeof(recordSize), &record[0], recordSize);
+
+    // Release the space only after the contents are copied out
+    InterlockedExchange(&readPos, (LONG)(r + sizeof(recordSize) + recordSize));
+    return true;
+}
+
+void RecordRing::copyIn(uint32_t p, const void* data, size_t size)
+{
+    size_t offset = p & mask;
+    size_t first = min(size, buffer.size() - offset);
+    memcpy(&buffer[offset], data, first);
+    if(first < size)
+        memcpy(&buffer[0], (const char*)data + first, size - first);
+}
+
+void RecordRing::copyOut(uint32_t p, void* data, size_t size) const
+{
+    size_t offset = p & mask;
+    size_t first = min(size, buffer.size() - offset);
+    memcpy(data, &buffer[offset], first);
+    if(first < size)
+        memcpy((char*)data + first, &buffer[0], size - first);
+}
@@ -0,0 +1,60 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <Windows.h>
+
+// Single-producer, single-consumer ring of variable-length binary records.
+// push() never blocks and never allocates; if the ring is full the record is dropped and counted.
+class RecordRing
+{
+private:
+    std::vector<char> buffer;                   // Storage; size is a power of 2
+    uint32_t mask;                              // buffer.size() - 1
+    volatile LONG writePos;                     // Free-running; only the producer changes this
+    volatile LONG readPos;                      // Free-running; only the consumer changes this
+    volatile LONG dropped;                      // Records which didn't fit
+
+public:
+    RecordRing(size_t capacity);                // Rounded up to a power of 2
+
+public:
+    // Producer: append a record made of up to two pieces (e.g. header and payload). Returns false if dropped.
+    bool push(const void* a, size_t aSize, const void* b = 0, size_t bSize = 0);
+
+    // Consumer: remove the oldest record. Returns false if the ring is empty.
+    bool pop(std::vector<char>& record);
+
+    // Bytes currently in use
+    size_t used() const {return (uint32_t)writePos - (uint32_t)readPos;}
+
+    // Capacity in bytes
+    size_t capacity() const {return buffer.size();}
+
+    // Total number of dropped records
+    unsigned getDropped() const {return (unsigned)dropped;}
+
+private:
+    // Copy into the ring at free-running position p
+    void copyIn(uint32_t p, const void* data, size_t size);
+
+    // Copy out of the ring at free-running position p
+    void copyOut(uint32_t p, void* data, size_t size) const;
+};
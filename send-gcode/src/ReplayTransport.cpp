@@ -0,0 +1,118 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#include "ReplayTransport.h"
+#include "Format.h"
+#include <stdexcept>
+
+using namespace std;
+
+// Stop reporting differences after this many
+static const unsigned maxReportedMismatches = 10;
+
+ReplayTransport::ReplayTransport(
+    Clock& clock,
+    const std::vector<CaptureRecord>& records,
+    double speed,
+    LineHandler receivedLine,
+    StatusWriter statusWriter):
+        clock(clock),
+        receivedLine(receivedLine),
+        statusWriter(statusWriter),
+        speed(speed),
+        nextReply(0),
+        lastReplyTime(clock.now()),
+        timerId(0),
+        mismatches(0),
+        finished(false)
+{
+    if(speed <= 0)
+        throw runtime_error("replay speed must be positive");
+
+    bool haveTx = false, haveRx = false;
+    uint64_t lastTx = 0, lastRx = 0;
+    if(!records.empty())
+        lastRx = records.front().time;
+    for(size_t i = 0; i < records.size(); ++i)
+    {
+        const CaptureRecord& r = records[i];
+        if(r.type == captureTx)
+        {
+            expectedTx.push_back(r.data);
+            lastTx = r.time;
+            haveTx = true;
+        }
+        else if(r.type == captureRx)
+        {
+            Reply reply;
+            reply.line = r.data;
+            reply.txBefore = expectedTx.size();
+            reply.afterTx = haveTx && (!haveRx || lastTx >= lastRx);
+            reply.delay = r.time - (reply.afterTx ? lastTx : lastRx);
+            replies.push_back(reply);
+            lastRx = r.time;
+            haveRx = true;
+        }
+    }
+
+    finished = replies.empty();
+}
+
+ReplayTransport::~ReplayTransport()
+{
+    clock.cancelTimer(timerId);
+}
+
+void ReplayTransport::send(std::string&& data)
+{
+    size_t n = txTimes.size();
+    txTimes.push_back(clock.now());
+    if(n < expectedTx.size() && data != expectedTx[n] && ++mismatches <= maxReportedMismatches)
+    {
+        string msg = "replay: frame " + toString(n) + " differs from capture\n" +
+            "  expected: " + expectedTx[n] +
+            "  sent:     " + data;
+        statusWriter(msg.c_str());
+    }
+    schedule();
+}
+
+void ReplayTransport::schedule()
+{
+    if(timerId || nextReply == replies.size())
+        return;
+    const Reply& reply = replies[nextReply];
+    if(txTimes.size() < reply.txBefore)
+        return;
+
+    uint64_t from = reply.afterTx ? txTimes[reply.txBefore - 1] : lastReplyTime;
+    timerId = clock.setTimer(from + (uint64_t)(reply.delay / speed), [this](){deliver();});
+}
+
+void ReplayTransport::deliver()
+{
+    timerId = 0;
+    lastReplyTime = clock.now();
+    const Reply& reply = replies[nextReply++];
+    if(nextReply == replies.size())
+    {
+        finished = true;
+        statusWriter("replay: end of capture\n");
+    }
+    receivedLine(reply.line.data(), reply.line.data() + reply.line.size());
+    schedule();
+}
@@ -0,0 +1,83 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#pragma once
+
+#include "CaptureAnalyzer.h"
+#include "Clock.h"
+
+// Plays the firmware side of a capture back to the sender. Each received line is held until
+// the sender has sent as many frames as preceded it in the capture, then delivered after the
+// same delay it had in the capture (divided by speed). Frames which differ from the capture
+// are reported through the StatusWriter.
+class ReplayTransport: public Transport
+{
+private:
+    struct Reply
+    {
+        std::string line;                       // Line to deliver
+        size_t txBefore;                        // Frames sent before it in the capture
+        bool afterTx;                           // Delay is measured from frame txBefore, not from the previous reply
+        uint64_t delay;                         // Capture time since that point
+    };
+
+    Clock& clock;                               // Schedules replies
+    LineHandler receivedLine;                   // This function is called for every replayed line
+    StatusWriter statusWriter;                  // This function is called to report differences
+    std::vector<Event> events;                  // Always empty; replies are driven by clock timers
+    std::vector<std::string> expectedTx;        // Frames in the capture
+    std::vector<Reply> replies;                 // Lines in the capture
+    double speed;                               // Delay divisor
+    std::vector<uint64_t> txTimes;              // Clock time of each frame sent
+    size_t nextReply;                           // Index into replies
+    uint64_t lastReplyTime;                     // Clock time of the last reply
+    unsigned timerId;                           // Pending reply timer, or 0
+    unsigned mismatches;                        // Frames which differed from the capture
+    bool finished;                              // Every reply has been delivered
+
+public:
+    ReplayTransport(
+        Clock& clock,                           // Caller must keep this alive
+        const std::vector<CaptureRecord>& records,
+        double speed,                           // 1 is original timing; 2 is twice as fast
+        LineHandler receivedLine,
+        StatusWriter statusWriter);
+    ~ReplayTransport();
+
+public:
+    // Record a frame from the sender
+    virtual void send(std::string&& data);
+
+    // Get events for event loop
+    virtual const std::vector<Event>& getEvents() {return events;}
+
+    // Has every reply in the capture been delivered?
+    bool getFinished() {return finished;}
+
+    // Number of frames sent
+    size_t getSent() {return txTimes.size();}
+
+    // Number of frames which differed from the capture
+    unsigned getMismatches() {return mismatches;}
+
+private:
+    // Start the timer for the next reply once the sender has caught up to it
+    void schedule();
+
+    // Deliver the next reply
+    void deliver();
+};
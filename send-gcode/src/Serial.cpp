@@ -16,17 +16,139 @@
 // Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
 
 #include "Serial.h"
+#include "Format.h"
 #include <stdexcept>
 
 using namespace std;
 
+HANDLE openCommPort(const std::string& port, unsigned bps, FlowControl flow)
+{
+    HANDLE handle = CreateFileA(port.c_str(), GENERIC_READ | GENERIC_WRITE, 0, 0, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, 0);
+    if(handle == INVALID_HANDLE_VALUE)
+        throw runtime_error("can not open port " + port);
+
+    DCB dcb;
+    memset(&dcb, 0, sizeof(DCB));
+    dcb.DCBlength = sizeof(DCB);
+
+    if(!GetCommState(handle, &dcb) || !PurgeComm(handle, PURGE_RXABORT | PURGE_RXCLEAR | PURGE_TXABORT | PURGE_TXCLEAR))
+    {
+        CloseHandle(handle);
+        throw runtime_error("can not open port " + port);
+    }
+
+    dcb.BaudRate = bps;
+    dcb.ByteSize = 8;
+    dcb.Parity   = NOPARITY;
+    dcb.StopBits = ONESTOPBIT;
+    dcb.fOutxCtsFlow = flow == flowRtsCts;
+    dcb.fOutxDsrFlow = false;
+    dcb.fDtrControl = DTR_CONTROL_DISABLE;
+    dcb.fDsrSensitivity = false;
+    dcb.fErrorChar = '?';
+    dcb.fOutX = flow == flowXonXoff;
+    dcb.fInX = false;           // Firmware wouldn't expect XOFF in the middle of a line
+    dcb.XonChar = 0x11;
+    dcb.XoffChar = 0x13;
+    dcb.fNull = false;
+    dcb.fRtsControl = flow == flowRtsCts ? RTS_CONTROL_HANDSHAKE : RTS_CONTROL_DISABLE;
+    dcb.fAbortOnError = false;
+    dcb.EvtChar = '\n';          // EV_RXFLAG marks the end of a reply
+
+    // BaudRate is a plain number, not a CBR_ define, so 250000 or 1000000 goes straight to the
+    // driver. Some drivers take a rate they can't make and quietly run at the nearest one they
+    // can; read it back so a job doesn't start at a speed the firmware isn't listening at.
+    DCB actual;
+    memset(&actual, 0, sizeof(DCB));
+    actual.DCBlength = sizeof(DCB);
+    if(!SetCommState(handle, &dcb) || !GetCommState(handle, &actual) || actual.BaudRate != bps)
+    {
+        CloseHandle(handle);
+        throw runtime_error("port " + port + " can not run at " + toString(bps) + " bps");
+    }
+
+    // Larger driver buffers ride out a slow event loop without overruns at high speeds. Drivers
+    // are free to ignore this.
+    SetupComm(handle, commQueueSize, commQueueSize);
+    return handle;
+}
+
+std::string describeCommPort(const std::string& port, HANDLE handle)
+{
+    DCB dcb;
+    memset(&dcb, 0, sizeof(DCB));
+    dcb.DCBlength = sizeof(DCB);
+    if(!GetCommState(handle, &dcb))
+        return port + ": settings unknown\n";
+
+    string result = port + ": " + toString(dcb.BaudRate) + " bps, " + toString(dcb.ByteSize) + "N1";
+    if(dcb.fOutxCtsFlow)
+        result += ", RTS/CTS";
+    if(dcb.fOutX)
+        result += ", XON/XOFF";
+    COMMPROP properties;
+    memset(&properties, 0, sizeof(COMMPROP));
+    if(GetCommProperties(handle, &properties) && properties.dwCurrentRxQueue)
+        result += ", driver buffers " + toString(properties.dwCurrentRxQueue) + "/" + toString(properties.dwCurrentTxQueue) + " bytes";
+    return result + "\n";
+}
+
+void reportCommErrors(HANDLE handle, const StatusWriter& statusWriter, COMSTAT* stat)
+{
+    DWORD errors;
+    if(!ClearCommError(handle, &errors, stat))
+        throw runtime_error("ClearCommError failed");
+    if(errors & CE_BREAK)
+        statusWriter("Received break\n");
+    if(errors & CE_FRAME)
+        statusWriter("Frame error\n");
+    if(errors & CE_OVERRUN)
+        statusWriter("Overrun\n");
+    if(errors & CE_RXOVER)
+        statusWriter("Input buffer overflow\n");
+    if(errors & CE_RXPARITY)
+        statusWriter("Parity error\n");
+}
+
+void dispatchLines(char* buffer, size_t& bytesInBuffer, size_t bufferSize, const LineHandler& receivedLine, const StatusWriter& statusWriter)
+{
+    while(1)
+    {
+        size_t p = 0;
+        while(p < bytesInBuffer && buffer[p] != '\r' && buffer[p] != '\n')
+            ++p;
+        if(p < bytesInBuffer)
+        {
+            if(p)
+                receivedLine(buffer, buffer + p);
+            while(p < bytesInBuffer && (buffer[p] == '\r' || buffer[p] == '\n'))
+                ++p;
+
+            memmove(buffer, buffer+p, bytesInBuffer-p);
+            bytesInBuffer -= p;
+        }
+        else if(bytesInBuffer == bufferSize)
+        {
+            statusWriter("buffer overfilled with garbage; dumping\n");
+            bytesInBuffer = 0;
+            return;
+        }
+        else
+            return;
+    }
+}
+
 Serial::Serial(LineHandler receivedLine, StatusWriter statusWriter):
     receivedLine(receivedLine),
     statusWriter(statusWriter),
     handle(INVALID_HANDLE_VALUE),
     fullyOpened(false),
     writing(false),
-    bytesInReadBuffer(0)
+    bytesInReadBuffer(0),
+    stallTimer(0),
+    everyByte(false),
+    queuedAtLastCheck(0),
+    readsSinceCheck(0)
 {
     memset(&overlappedCommState, 0, sizeof(OVERLAPPED));
     memset(&overlappedRead, 0, sizeof(OVERLAPPED));
@@ -37,8 +159,9 @@ Serial::Serial(LineHandler receivedLine, StatusWriter statusWriter):
         overlappedCommState.hEvent = CreateEvent(0, true, false, 0);
         overlappedRead.hEvent = CreateEvent(0, true, false, 0);
         overlappedWrite.hEvent = CreateEvent(0, true, false, 0);
+        stallTimer = CreateWaitableTimer(0, false, 0);
 
-        if(!overlappedCommState.hEvent || !overlappedRead.hEvent || !overlappedWrite.hEvent)
+        if(!overlappedCommState.hEvent || !overlappedRead.hEvent || !overlappedWrite.hEvent || !stallTimer)
             throw runtime_error("CreateEvent failed");
 
         // Overlapped WaitCommEvent() and WriteFile() run in the background.
@@ -47,6 +170,7 @@ Serial::Serial(LineHandler receivedLine, StatusWriter statusWriter):
         // buffer is empty, it wouldn't complete until the buffer we supply is completely filled (nasty).
         events.push_back(Event(overlappedCommState.hEvent, [this](){onCommState();}));
         events.push_back(Event(overlappedWrite.hEvent, [this](){onWrite();}));
+        events.push_back(Event(stallTimer, [this](){onStallCheck();}));
     }
     catch(...)
     {
@@ -56,6 +180,8 @@ Serial::Serial(LineHandler receivedLine, StatusWriter statusWriter):
             CloseHandle(overlappedRead.hEvent);
         if(overlappedWrite.hEvent)
             CloseHandle(overlappedWrite.hEvent);
+        if(stallTimer)
+            CloseHandle(stallTimer);
         throw;
     }
 } // Serial::Serial
@@ -66,44 +192,17 @@ Serial::~Serial()
     CloseHandle(overlappedCommState.hEvent);
     CloseHandle(overlappedRead.hEvent);
     CloseHandle(overlappedWrite.hEvent);
+    CloseHandle(stallTimer);
 }
 
-void Serial::open(const std::string& port, unsigned bps)
+void Serial::open(const std::string& port, unsigned bps, FlowControl flow)
 {
     if(handle != INVALID_HANDLE_VALUE)
         throw runtime_error("connection is already open");
 
     cleanup();
 
-    handle = CreateFileA(port.c_str(), GENERIC_READ | GENERIC_WRITE, 0, 0, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, 0);
-    if(handle == INVALID_HANDLE_VALUE)
-        throw runtime_error("can not open port " + port);
-
-    DCB dcb;
-    memset(&dcb, 0, sizeof(DCB));
-    dcb.DCBlength = sizeof(DCB);
-
-    if(!GetCommState(handle, &dcb) || !PurgeComm(handle, PURGE_RXABORT | PURGE_RXCLEAR | PURGE_TXABORT | PURGE_TXCLEAR))
-    {
-        CloseHandle(handle);
-        handle = INVALID_HANDLE_VALUE;
-        throw runtime_error("can not open port " + port);
-    }
-
-    dcb.BaudRate = bps;
-    dcb.ByteSize = 8;
-    dcb.Parity   = NOPARITY;
-    dcb.StopBits = ONESTOPBIT;
-    dcb.fOutxCtsFlow = false;
-    dcb.fOutxDsrFlow = false;
-    dcb.fDtrControl = DTR_CONTROL_DISABLE;
-    dcb.fDsrSensitivity = false;
-    dcb.fErrorChar = '?';
-    dcb.fOutX = false;
-    dcb.fInX = false;
-    dcb.fNull = false;
-    dcb.fRtsControl = RTS_CONTROL_DISABLE;
-    dcb.fAbortOnError = false;
+    handle = openCommPort(port, bps, flow);
 
     COMMTIMEOUTS timeouts;
     timeouts.ReadIntervalTimeout = MAXDWORD;
@@ -112,9 +211,14 @@ void Serial::open(const std::string& port, unsigned bps)
     timeouts.WriteTotalTimeoutConstant = 0;
     timeouts.WriteTotalTimeoutMultiplier = 0;
 
-    if( !SetCommState(handle, &dcb) ||
-        !SetCommMask(handle, EV_ERR | EV_RXCHAR) ||
-        !SetCommTimeouts(handle, &timeouts))
+    // Wake once per reply line rather than once per byte; at high speeds EV_RXCHAR costs a
+    // WaitCommEvent() and a ReadFile() for every few bytes, and a line is no use until it's whole.
+    // The stall timer covers firmware which never sends '\n'.
+    LARGE_INTEGER due;
+    due.QuadPart = -(LONGLONG)stallCheckMs * 10000;
+    if( !SetCommMask(handle, EV_ERR | EV_RXFLAG) ||
+        !SetCommTimeouts(handle, &timeouts) ||
+        !SetWaitableTimer(stallTimer, &due, stallCheckMs, 0, 0, false))
     {
         CloseHandle(handle);
         handle = INVALID_HANDLE_VALUE;
@@ -142,6 +246,7 @@ void Serial::open(const std::string& port, unsigned bps)
     }
 
     fullyOpened = true;
+    statusWriter(describeCommPort(port, handle).c_str());
 } // Serial::open
 
 void Serial::close()
@@ -162,16 +267,32 @@ void Serial::send(std::string&& data)
     startWrite();
 }
 
+void Serial::sendUrgent(std::string&& data)
+{
+    if(!fullyOpened)
+        return;
+    list<string>::iterator pos = writeQueue.begin();
+    if(writing)
+        ++pos;
+    writeQueue.insert(pos, move(data));
+    startWrite();
+}
+
 void Serial::cleanup()
 {
     ResetEvent(overlappedCommState.hEvent);
     ResetEvent(overlappedRead.hEvent);
     ResetEvent(overlappedWrite.hEvent);
 
+    CancelWaitableTimer(stallTimer);
+
     fullyOpened = false;
     writing = false;
     writeQueue.clear();
     bytesInReadBuffer = 0;
+    everyByte = false;
+    queuedAtLastCheck = 0;
+    readsSinceCheck = 0;
 }
 
 void Serial::onCommState()
@@ -213,62 +334,11 @@ void Serial::processCommState()
     {
         if(commEventMask & EV_ERR)
         {
-            DWORD errors;
-            if(!ClearCommError(handle, &errors, 0))
-                throw runtime_error("ClearCommError failed");
-            if(errors & CE_BREAK)
-                statusWriter("Received break\n");
-            if(errors & CE_FRAME)
-                statusWriter("Frame error\n");
-            if(errors & CE_OVERRUN)
-                statusWriter("Overrun\n");
-            if(errors & CE_RXOVER)
-                statusWriter("Input buffer overflow\n");
-            if(errors & CE_RXPARITY)
-                statusWriter("Parity error\n");
+            reportCommErrors(handle, statusWriter);
         }
 
-        if(commEventMask & EV_RXCHAR)
-        {
-            // The hardware receive buffer has something in it. ReadFile sometimes returns an immediate success and sometimes
-            // immediately schedules the completion routine. Either way, we can get the result now.
-            DWORD numRead = 0;
-            if(!ReadFile(handle, readBuffer + bytesInReadBuffer, readBufferSize - bytesInReadBuffer, &numRead, &overlappedRead))
-            {
-                DWORD err = GetLastError();
-                if(err != ERROR_IO_PENDING || !GetOverlappedResult(handle, &overlappedRead, &numRead, true))
-                    throw runtime_error("Serial read failed");
-            }
-
-            if(numRead)
-            {
-                bytesInReadBuffer += numRead;
-                while(1)
-                {
-                    size_t p = 0;
-                    while(p < bytesInReadBuffer && readBuffer[p] != '\r' && readBuffer[p] != '\n')
-                        ++p;
-                    if(p < bytesInReadBuffer)
-                    {
-                        if(p)
-                            receivedLine(readBuffer, readBuffer + p);
-                        while(p < bytesInReadBuffer && (readBuffer[p] == '\r' || readBuffer[p] == '\n'))
-                            ++p;
-                    
-                        memmove(readBuffer, readBuffer+p, bytesInReadBuffer-p);
-                        bytesInReadBuffer -= p;
-                    }
-                    else if(bytesInReadBuffer == readBufferSize)
-                    {
-                        statusWriter("buffer overfilled with garbage; dumping\n");
-                        bytesInReadBuffer = 0;
-                        break;
-                    }
-                    else
-                        break;
-                }
-            }
-        }
+        if(commEventMask & (EV_RXFLAG | EV_RXCHAR))
+            readAvailable();
 
         if(WaitCommEvent(handle, &commEventMask, &overlappedCommState))
             ;                   // We have a new result; continue through loop
@@ -279,6 +349,56 @@ void Serial::processCommState()
     } // while(1)
 } // Serial::processCommState
 
+void Serial::readAvailable()
+{
+    // Data, usually a line end, is in the hardware receive buffer. ReadFile sometimes returns an immediate success and sometimes
+    // immediately schedules the completion routine. Either way, we can get the result now. Keep reading until the
+    // buffer is empty, since another event won't come for lines which are already in it.
+    DWORD numRead;
+    do
+    {
+        numRead = 0;
+        if(!ReadFile(handle, readBuffer + bytesInReadBuffer, readBufferSize - bytesInReadBuffer, &numRead, &overlappedRead))
+        {
+            DWORD err = GetLastError();
+            if(err != ERROR_IO_PENDING || !GetOverlappedResult(handle, &overlappedRead, &numRead, true))
+                throw runtime_error("Serial read failed");
+        }
+
+        if(numRead)
+        {
+            ++readsSinceCheck;
+            bytesInReadBuffer += numRead;
+            dispatchLines(readBuffer, bytesInReadBuffer, readBufferSize, receivedLine, statusWriter);
+        }
+    } while(numRead);
+}
+
+void Serial::onStallCheck()
+{
+    if(handle == INVALID_HANDLE_VALUE || everyByte)
+        return;
+
+    // Bytes which sat in the queue for a whole period with nothing read never saw a '\n'
+    COMSTAT stat;
+    memset(&stat, 0, sizeof(COMSTAT));
+    reportCommErrors(handle, statusWriter, &stat);
+    bool stalled = stat.cbInQue && queuedAtLastCheck && !readsSinceCheck;
+    queuedAtLastCheck = stat.cbInQue;
+    readsSinceCheck = 0;
+    if(!stalled)
+        return;
+
+    // Changing the mask completes the pending WaitCommEvent() with no events; processCommState()
+    // then waits again with the new mask
+    statusWriter("received data without a \\n line end; waking for every byte from now on\n");
+    everyByte = true;
+    CancelWaitableTimer(stallTimer);
+    if(!SetCommMask(handle, EV_ERR | EV_RXFLAG | EV_RXCHAR))
+        throw runtime_error("SetCommMask failed");
+    readAvailable();
+}
+
 void Serial::startWrite()
 {
     if(writing || writeQueue.empty())
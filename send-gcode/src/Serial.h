@@ -15,23 +15,43 @@
 // along with this program; if not, write to the Free Software
 // Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
 
-#include <functional>
+#pragma once
+
+#include "Transport.h"
 #include <list>
-#include <string>
-#include <tuple>
-#include <vector>
-#include <Windows.h>
 
-// Identifies function to call whenever an event is signaled; function may throw exceptions
-typedef std::tuple<HANDLE, std::function<void()>> Event;
+// Driver buffer size asked for in each direction
+const unsigned commQueueSize = 4096;
+
+// How the firmware holds off the host when its receive buffer is nearly full
+enum FlowControl
+{
+    flowNone,                                   // It doesn't; the sender waits for each "ok"
+    flowRtsCts,                                 // It drops CTS
+    flowXonXoff,                                // It sends XOFF, then XON when there's room
+};
+
+// Open a serial port for overlapped I/O at bps, 8N1. bps may be any rate the driver takes,
+// e.g. 250000; throws exception on failure or if the driver won't run at bps.
+HANDLE openCommPort(const std::string& port, unsigned bps, FlowControl flow);
 
-// Line handling function
-typedef std::function<void(const char* begin, const char* end)> LineHandler;
+// One line telling what the driver settled on: speed, framing and buffer sizes
+std::string describeCommPort(const std::string& port, HANDLE handle);
 
-// Receive status messages (warnings)
-typedef std::function<void(const char* msg)> StatusWriter;
+// Clear the port's line errors (after EV_ERR) and tell statusWriter about each kind which
+// happened: break, frame, overrun, input buffer overflow, parity. Fills stat if it isn't null.
+// Throws exception on failure.
+void reportCommErrors(HANDLE handle, const StatusWriter& statusWriter, COMSTAT* stat = 0);
 
-class Serial
+// Pass each complete line at the front of buffer to receivedLine and keep the rest. A buffer
+// filled without a line end is thrown away.
+void dispatchLines(char* buffer, size_t& bytesInBuffer, size_t bufferSize, const LineHandler& receivedLine, const StatusWriter& statusWriter);
+
+// Serial port driven by events. It wakes when a '\n' arrives (EV_RXFLAG), not for every byte.
+// Firmware which ends lines with a lone '\r', or sends garbage without line ends, would never
+// wake it; a periodic check notices bytes sitting in the driver's queue and switches to waking
+// for every byte (EV_RXCHAR) for the rest of the session.
+class Serial: public Transport
 {
 private:
     LineHandler receivedLine;                   // This function is called for every received line
@@ -49,6 +69,11 @@ private:
     static const size_t readBufferSize = 1024;  // Maximum size of a received line
     char readBuffer[readBufferSize];            // Receives incoming data
     size_t bytesInReadBuffer;                   // Amount of data in readBuffer
+    enum {stallCheckMs = 250};                  // Longer than any line takes to arrive
+    HANDLE stallTimer;                          // Periodic; looks for bytes EV_RXFLAG never announced
+    bool everyByte;                             // Waking on EV_RXCHAR too
+    DWORD queuedAtLastCheck;                    // Bytes in the driver's receive queue at the last check
+    unsigned readsSinceCheck;                   // Reads which got data since then
 
 public:
     Serial(LineHandler receivedLine, StatusWriter statusWriter);
@@ -58,16 +83,23 @@ public:
     // Open port; throws exception on failure
     void open(
         const std::string& port,                // e.g. COM2
-        unsigned bps);                          // Speed (bps), *NOT* BAUD_n define!
+        unsigned bps,                           // Speed (bps), *NOT* BAUD_n define!
+        FlowControl flow = flowNone);
 
     // Close port
     void close();
 
     // Send data. Async; returns immediately
-    void send(std::string&& data);
+    virtual void send(std::string&& data);
+
+    // Send data as soon as the write in progress finishes
+    virtual void sendUrgent(std::string&& data);
+
+    // Data waiting for or in a WriteFile()
+    virtual bool getWritePending() {return !writeQueue.empty();}
 
     // Get events for event loop
-    const std::vector<Event>& getEvents() {return events;}
+    virtual const std::vector<Event>& getEvents() {return events;}
 
 private:
     // Clean up internal state
@@ -82,6 +114,12 @@ private:
     // Process WaitCommEvent() result
     void processCommState();
 
+    // Read everything the driver has and dispatch the lines in it
+    void readAvailable();
+
+    // Signaled every stallCheckMs until everyByte is set
+    void onStallCheck();
+
     // Send next string in writeQueue
     void startWrite();
 };
@@ -0,0 +1,99 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#include "SessionCapture.h"
+#include <algorithm>
+#include <stdexcept>
+
+using namespace std;
+
+const char captureMagic[8] = {'S', 'G', 'C', 'A', 'P', 'T', 'R', 0};
+
+// Ring size; at 250000 bps this holds several seconds of traffic
+static const size_t captureRingSize = 256 * 1024;
+
+// Maximum time between file writes
+static const unsigned captureIntervalMs = 200;
+
+static shared_ptr<void> openCaptureFile(const string& filename)
+{
+    HANDLE h = CreateFileA(filename.c_str(), GENERIC_WRITE, FILE_SHARE_READ, 0, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+    if(h == INVALID_HANDLE_VALUE)
+        throw runtime_error("can not create capture file " + filename);
+    shared_ptr<void> file(h, CloseHandle);
+
+    CaptureFileHeader header;
+    memcpy(header.magic, captureMagic, sizeof(header.magic));
+    header.version = captureVersion;
+    header.reserved = 0;
+    DWORD numWritten = 0;
+    if(!WriteFile(h, &header, sizeof(header), &numWritten, 0) || numWritten != sizeof(header))
+        throw runtime_error("can not write capture file " + filename);
+    return file;
+}
+
+SessionCapture::SessionCapture(Clock& clock, const std::string& filename):
+    clock(clock),
+    file(openCaptureFile(filename)),
+    droppedWritten(0),
+    lastTime(0),
+    writer(
+        captureRingSize,
+        [this](const char* b, const char* e){onRecord(b, e);},
+        [this](){onFlush();},
+        captureIntervalMs)
+{
+}
+
+void SessionCapture::record(CaptureRecordType type, const char* b, const char* e)
+{
+    CaptureRecordHeader header;
+    header.time = clock.now();
+    header.length = (uint16_t)min<size_t>(e - b, 0xffff);
+    header.type = (uint8_t)type;
+    writer.push(&header, sizeof(header), b, header.length);
+}
+
+void SessionCapture::onRecord(const char* b, const char* e)
+{
+    const CaptureRecordHeader* header = (const CaptureRecordHeader*)b;
+    lastTime = header->time;
+    fileBuffer.insert(fileBuffer.end(), b, e);
+}
+
+void SessionCapture::onFlush()
+{
+    unsigned dropped = writer.getDropped();
+    if(dropped != droppedWritten)
+    {
+        CaptureRecordHeader header;
+        header.time = lastTime;
+        header.length = sizeof(uint32_t);
+        header.type = captureDropped;
+        uint32_t count = dropped - droppedWritten;
+        fileBuffer.insert(fileBuffer.end(), (const char*)&header, (const char*)&header + sizeof(header));
+        fileBuffer.insert(fileBuffer.end(), (const char*)&count, (const char*)&count + sizeof(count));
+        droppedWritten = dropped;
+    }
+
+    if(fileBuffer.empty())
+        return;
+    DWORD numWritten = 0;
+    if(!WriteFile(file.get(), &fileBuffer[0], fileBuffer.size(), &numWritten, 0) || numWritten != fileBuffer.size())
+        throw runtime_error("capture file write error");
+    fileBuffer.clear();
+}
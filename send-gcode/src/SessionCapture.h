@@ -0,0 +1,97 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#pragma once
+
+#include "BackgroundWriter.h"
+#include "Clock.h"
+
+// Capture file layout:
+//      CaptureFileHeader
+//      (CaptureRecordHeader, payload)*
+// All fields are little endian. The file is append-only; a capture cut short by a crash
+// is still readable up to the last complete record.
+
+enum CaptureRecordType
+{
+    captureTx           = 1,    // Payload is a frame sent to the firmware, including N, checksum and newline
+    captureRx           = 2,    // Payload is a line received from the firmware, without line terminators
+    captureDropped      = 3,    // Payload is a uint32_t: number of records lost because the ring was full
+};
+
+#pragma pack(push, 1)
+struct CaptureFileHeader
+{
+    char        magic[8];       // captureMagic
+    uint32_t    version;        // captureVersion
+    uint32_t    reserved;
+};
+
+struct CaptureRecordHeader
+{
+    uint64_t    time;           // Monotonic time, microseconds
+    uint16_t    length;         // Payload length
+    uint8_t     type;           // CaptureRecordType
+};
+#pragma pack(pop)
+
+extern const char captureMagic[8];
+const uint32_t captureVersion = 1;
+
+// Records TX frames and RX lines to a file. Recording only copies into a memory ring;
+// a background thread does the file I/O.
+class SessionCapture
+{
+private:
+    Clock& clock;                               // Timestamps records
+    std::shared_ptr<void> file;                 // Capture file
+    std::vector<char> fileBuffer;               // Batches writes; only used by the background thread
+    unsigned droppedWritten;                    // Dropped count already recorded in the file
+    uint64_t lastTime;                          // Time of the last record written; only used by the background thread
+    BackgroundWriter writer;                    // Must be last; its thread uses the members above
+
+public:
+    SessionCapture(
+        Clock& clock,                           // Timestamps records; caller must keep this alive
+        const std::string& filename);
+
+public:
+    // Record a frame sent to the firmware
+    void tx(const char* b, const char* e) {record(captureTx, b, e);}
+
+    // Record a line received from the firmware
+    void rx(const char* b, const char* e) {record(captureRx, b, e);}
+
+    // Write out what's left; nothing more is recorded
+    void close() {writer.stop();}
+
+    // Records lost because the ring was full or writing failed
+    unsigned getDropped() const {return writer.getDropped();}
+
+    // Has writing failed? If so, getError() describes it.
+    bool getFailed() const {return writer.getFailed();}
+    const std::string& getError() const {return writer.getError();}
+
+private:
+    void record(CaptureRecordType type, const char* b, const char* e);
+
+    // Background thread: append record to fileBuffer
+    void onRecord(const char* b, const char* e);
+
+    // Background thread: write fileBuffer out
+    void onFlush();
+};
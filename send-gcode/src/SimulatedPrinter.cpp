@@ -0,0 +1,387 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#include "SimulatedPrinter.h"
+#include "Format.h"
+#include <algorithm>
+#include <math.h>
+
+using namespace std;
+
+SimulatorConfig::SimulatorConfig():
+    bps(19200),
+    parseTimeUs(500),
+    plannerDepth(16)
+{
+}
+
+// Find word with the given letter in [b, e); the command word itself is skipped by the caller
+static bool findWord(const char* b, const char* e, char letter, double& value)
+{
+    for(const char* p = b; p != e; ++p)
+    {
+        if(toupper((unsigned char)*p) == letter && (p == b || isspace((unsigned char)p[-1])))
+        {
+            char* end;
+            value = strtod(p + 1, &end);
+            return end != p + 1;
+        }
+    }
+    return false;
+}
+
+SimulatedPrinter::SimulatedPrinter(
+    Clock& clock,
+    const SimulatorConfig& config,
+    LineHandler receivedLine,
+    StatusWriter statusWriter):
+        clock(clock),
+        receivedLine(receivedLine),
+        statusWriter(statusWriter),
+        config(config),
+        toFirmwareFree(0),
+        toHostFree(0),
+        busy(false),
+        expectedLine(1),
+        lastMoveEnd(clock.now()),
+        relative(false),
+        relativeE(false),
+        feedrate(config.printer.defaultFeedrate),
+        hotend(config.printer.ambient),
+        hotendTarget(0),
+        bed(config.printer.ambient),
+        bedTarget(0),
+        temperatureTime(clock.now())
+{
+    fill(position, position + 4, 0.0);
+    memset(&stats, 0, sizeof(stats));
+    stats.finishTime = clock.now();
+}
+
+SimulatedPrinter::~SimulatedPrinter()
+{
+    for_each(timers.begin(), timers.end(), [this](unsigned id){clock.cancelTimer(id);});
+}
+
+void SimulatedPrinter::send(std::string&& data)
+{
+    uint64_t start = max(clock.now(), toFirmwareFree);
+    toFirmwareFree = start + wireTime(data.size());
+
+    // The firmware sees a byte stream; a frame which lost its newline runs into the next one
+    string bytes(move(data));
+    after(toFirmwareFree, [this, bytes](){
+        stats.bytesReceived += bytes.size();
+        const char* b = bytes.data();
+        const char* e = b + bytes.size();
+        while(b != e)
+        {
+            const char* nl = find(b, e, '\n');
+            if(received.empty() || received.back().empty() || received.back()[received.back().size() - 1] == '\n')
+                received.push_back(string());
+            received.back().append(b, nl == e ? e : nl + 1);
+            b = nl == e ? e : nl + 1;
+        }
+        processNext();
+    });
+}
+
+void SimulatedPrinter::sendUrgent(std::string&& data)
+{
+    if(data.find("M112") == string::npos)
+    {
+        send(move(data));
+        return;
+    }
+    uint64_t start = max(clock.now(), toFirmwareFree);
+    toFirmwareFree = start + wireTime(data.size());
+    stats.bytesReceived += data.size();
+    after(toFirmwareFree, [this](){halt();});
+}
+
+uint64_t SimulatedPrinter::wireTime(size_t size)
+{
+    return (uint64_t)size * 10 * 1000000 / config.bps;
+}
+
+void SimulatedPrinter::after(uint64_t due, TimerHandler handler)
+{
+    // The handler needs its own id to untrack itself, but the id isn't known until setTimer returns
+    shared_ptr<unsigned> id(new unsigned(0));
+    *id = clock.setTimer(due, [this, id, handler](){
+        timers.erase(*id);
+        handler();
+    });
+    timers.insert(*id);
+}
+
+void SimulatedPrinter::reply(const std::string& line)
+{
+    uint64_t start = max(clock.now(), toHostFree);
+    toHostFree = start + wireTime(line.size() + 1);
+    after(toHostFree, [this, line](){receivedLine(line.data(), line.data() + line.size());});
+}
+
+void SimulatedPrinter::processNext()
+{
+    if(busy || received.empty())
+        return;
+    const string& front = received.front();
+    if(front.empty() || front[front.size() - 1] != '\n')
+        return;                 // Rest of the line hasn't arrived yet
+
+    busy = true;
+    string frame = move(received.front());
+    received.pop_front();
+    after(clock.now() + config.parseTimeUs, [this, frame](){execute(frame);});
+}
+
+void SimulatedPrinter::execute(const std::string& frame)
+{
+    const char* b = frame.data();
+    const char* e = b + frame.size();
+    while(e != b && (e[-1] == '\n' || e[-1] == '\r'))
+        --e;
+    while(b != e && isspace((unsigned char)*b))
+        ++b;
+
+    // Checksum covers everything before '*'
+    const char* star = find(b, e, '*');
+    bool valid = true;
+    if(star != e)
+    {
+        uint8_t cs = 0;
+        for_each(b, star, [&cs](char ch){cs = cs ^ ch;});
+        char* end;
+        unsigned long expected = strtoul(star + 1, &end, 10);
+        valid = end != star + 1 && end == e && expected == cs;
+    }
+
+    const char* command = b;
+    unsigned long line = 0;
+    bool haveLine = b != star && *b == 'N';
+    if(haveLine)
+    {
+        char* end;
+        line = strtoul(b + 1, &end, 10);
+        command = end;
+        while(command != star && isspace((unsigned char)*command))
+            ++command;
+    }
+
+    bool isM110 = star - command >= 4 && !strncmp(command, "M110", 4);
+    if(valid && haveLine && !isM110 && line != expectedLine)
+        valid = false;
+    if(!valid || (haveLine && star == e))
+    {
+        ++stats.resendsRequested;
+        reply("Resend: " + toString(expectedLine));
+        finish();
+        return;
+    }
+
+    if(haveLine)
+        expectedLine = line + 1;
+    ++stats.linesReceived;
+    executeCommand(command, star);
+}
+
+void SimulatedPrinter::executeCommand(const char* b, const char* e)
+{
+    if(b == e || (*b != 'G' && *b != 'M'))
+    {
+        finish();
+        return;
+    }
+    char letter = *b;
+    char* end;
+    long code = strtol(b + 1, &end, 10);
+    b = end;
+
+    double v;
+    if(letter == 'G' && (code == 0 || code == 1))
+    {
+        static const char axes[4] = {'X', 'Y', 'Z', 'E'};
+        double target[4];
+        copy(position, position + 4, target);
+        for(int i = 0; i < 4; ++i)
+            if(findWord(b, e, axes[i], v))
+                target[i] = (relative || (i == 3 && relativeE)) ? position[i] + v : v;
+        if(findWord(b, e, 'F', v) && v > 0)
+            feedrate = v / 60;
+
+        double dx = target[0] - position[0], dy = target[1] - position[1], dz = target[2] - position[2];
+        double distance = sqrt(dx * dx + dy * dy + dz * dz);
+        if(distance == 0)
+            distance = fabs(target[3] - position[3]);
+        copy(target, target + 4, position);
+
+        double duration = restToRestTime(distance, min(feedrate, config.printer.maxFeedrate), config.printer.acceleration);
+        whenPlannerHasRoom([this, duration](){
+            queueMove(duration);
+            finish();
+        });
+    }
+    else if(letter == 'G' && code == 4)
+    {
+        double seconds = 0;
+        if(findWord(b, e, 'P', v))
+            seconds = v / 1000;
+        else if(findWord(b, e, 'S', v))
+            seconds = v;
+        whenPlannerEmpty([this, seconds](){
+            after(clock.now() + (uint64_t)(seconds * 1000000), [this](){
+                lastMoveEnd = clock.now();
+                finish();
+            });
+        });
+    }
+    else if(letter == 'G' && code == 28)
+    {
+        whenPlannerEmpty([this](){
+            after(clock.now() + (uint64_t)(config.printer.homingTime * 1000000), [this](){
+                position[0] = position[1] = position[2] = 0;
+                lastMoveEnd = clock.now();
+                finish();
+            });
+        });
+    }
+    else if(letter == 'G' && code == 90)
+    {
+        relative = false;
+        finish();
+    }
+    else if(letter == 'G' && code == 91)
+    {
+        relative = true;
+        finish();
+    }
+    else if(letter == 'G' && code == 92)
+    {
+        static const char axes[4] = {'X', 'Y', 'Z', 'E'};
+        for(int i = 0; i < 4; ++i)
+            if(findWord(b, e, axes[i], v))
+                position[i] = v;
+        finish();
+    }
+    else if(letter == 'M' && code == 82)
+    {
+        relativeE = false;
+        finish();
+    }
+    else if(letter == 'M' && code == 83)
+    {
+        relativeE = true;
+        finish();
+    }
+    else if(letter == 'M' && (code == 104 || code == 109 || code == 140 || code == 190))
+    {
+        updateTemperatures();
+        bool isBed = code == 140 || code == 190;
+        if(findWord(b, e, 'S', v))
+            (isBed ? bedTarget : hotendTarget) = v;
+        if(code == 104 || code == 140)
+        {
+            finish();
+            return;
+        }
+
+        // Moves already in the planner keep going while we wait
+        double target = isBed ? bedTarget : hotendTarget;
+        double current = isBed ? bed : hotend;
+        double rate = isBed ? config.printer.bedHeatRate : config.printer.hotendHeatRate;
+        double seconds = target > current ? (target - current) / rate : 0;
+        after(clock.now() + (uint64_t)(seconds * 1000000), [this](){
+            lastMoveEnd = max(lastMoveEnd, clock.now());
+            finish();
+        });
+    }
+    else if(letter == 'M' && code == 105)
+    {
+        updateTemperatures();
+        char buf[80];
+        sprintf(buf, "ok T:%.1f /%.0f B:%.1f /%.0f", hotend, hotendTarget, bed, bedTarget);
+        finish(buf);
+    }
+    else if(letter == 'M' && code == 400)
+        whenPlannerEmpty([this](){finish();});
+    else
+        finish();
+}
+
+void SimulatedPrinter::finish(const std::string& ack)
+{
+    stats.finishTime = max(stats.finishTime, clock.now());
+    reply(ack);
+    busy = false;
+    processNext();
+}
+
+void SimulatedPrinter::whenPlannerHasRoom(TimerHandler then)
+{
+    uint64_t now = clock.now();
+    while(!moveEnds.empty() && moveEnds.front() <= now)
+        moveEnds.pop_front();
+    if(moveEnds.size() < config.plannerDepth)
+        then();
+    else
+        after(moveEnds.front(), [this, then](){whenPlannerHasRoom(then);});
+}
+
+void SimulatedPrinter::whenPlannerEmpty(TimerHandler then)
+{
+    after(max(clock.now(), lastMoveEnd), then);
+}
+
+void SimulatedPrinter::queueMove(double duration)
+{
+    uint64_t now = clock.now();
+    if(now > lastMoveEnd)
+        stats.starvedTime += now - lastMoveEnd;
+    uint64_t start = max(now, lastMoveEnd);
+    lastMoveEnd = start + (uint64_t)(duration * 1000000);
+    moveEnds.push_back(lastMoveEnd);
+    stats.finishTime = max(stats.finishTime, lastMoveEnd);
+}
+
+void SimulatedPrinter::updateTemperatures()
+{
+    uint64_t now = clock.now();
+    double seconds = (now - temperatureTime) / 1000000.0;
+    temperatureTime = now;
+
+    double hotendGoal = hotendTarget > 0 ? hotendTarget : config.printer.ambient;
+    double step = config.printer.hotendHeatRate * seconds;
+    hotend = hotend < hotendGoal ? min(hotendGoal, hotend + step) : max(hotendGoal, hotend - step);
+
+    double bedGoal = bedTarget > 0 ? bedTarget : config.printer.ambient;
+    step = config.printer.bedHeatRate * seconds;
+    bed = bed < bedGoal ? min(bedGoal, bed + step) : max(bedGoal, bed - step);
+}
+
+void SimulatedPrinter::halt()
+{
+    for_each(timers.begin(), timers.end(), [this](unsigned id){clock.cancelTimer(id);});
+    timers.clear();
+    received.clear();
+    moveEnds.clear();
+    lastMoveEnd = clock.now();
+    stats.finishTime = clock.now();
+    stats.halted = true;
+    busy = true;                // Nothing more is parsed
+    reply("Error:Printer halted. kill() called!");
+}
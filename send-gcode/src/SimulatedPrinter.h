@@ -0,0 +1,139 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#pragma once
+
+#include "Clock.h"
+#include "Kinematics.h"
+#include <deque>
+#include <set>
+
+struct SimulatorConfig
+{
+    unsigned bps;                               // Wire speed, both directions; 10 bits per byte
+    unsigned parseTimeUs;                       // Firmware time to checksum and parse one line
+    unsigned plannerDepth;                      // Moves the firmware can buffer
+    PrinterModel printer;
+
+    SimulatorConfig();                          // Typical RepRap values
+};
+
+struct SimulatorStats
+{
+    unsigned linesReceived;                     // Frames the firmware accepted
+    unsigned resendsRequested;                  // Frames the firmware rejected
+    uint64_t bytesReceived;                     // Bytes the firmware received
+    uint64_t finishTime;                        // Last command or move completed
+    uint64_t starvedTime;                       // Planner ran dry between moves waiting for the host
+    bool halted;                                // M112 stopped everything
+};
+
+// Simulates the serial link and the firmware in process, on a Clock (normally a VirtualClock).
+// Models wire time at the configured bps, per-line parse time, the planner queue, move time
+// from feedrate and acceleration, homing and heating. Lines with a bad checksum or an
+// unexpected line number get "Resend" and "ok", like the RepRap firmware.
+class SimulatedPrinter: public Transport
+{
+private:
+    Clock& clock;                               // Drives the simulation
+    LineHandler receivedLine;                   // This function is called for every line the firmware sends
+    StatusWriter statusWriter;                  // This function is called to indicate warnings
+    SimulatorConfig config;
+    std::vector<Event> events;                  // Always empty; everything is driven by clock timers
+    std::set<unsigned> timers;                  // Pending clock timers
+
+    // Link
+    uint64_t toFirmwareFree;                    // Host-to-firmware wire is busy until this time
+    uint64_t toHostFree;                        // Firmware-to-host wire is busy until this time
+
+    // Firmware
+    std::deque<std::string> received;           // Frames waiting to be parsed
+    bool busy;                                  // Parsing or executing a frame
+    unsigned expectedLine;                      // Next line number the firmware will accept
+    std::deque<uint64_t> moveEnds;              // End time of each move in the planner
+    uint64_t lastMoveEnd;                       // End of the last move, or time the planner was last legitimately idle
+
+    // Machine
+    bool relative;                              // G91
+    bool relativeE;                             // M83
+    double position[4];                         // X, Y, Z, E
+    double feedrate;                            // mm/s
+    double hotend, hotendTarget;                // Degrees C
+    double bed, bedTarget;                      // Degrees C
+    uint64_t temperatureTime;                   // hotend and bed are as of this time
+
+    SimulatorStats stats;
+
+public:
+    SimulatedPrinter(
+        Clock& clock,                           // Caller must keep this alive
+        const SimulatorConfig& config,
+        LineHandler receivedLine,
+        StatusWriter statusWriter);
+    ~SimulatedPrinter();
+
+public:
+    // Put a frame on the wire
+    virtual void send(std::string&& data);
+
+    // Put a frame on the wire. The firmware acts on an M112 in it as soon as it arrives,
+    // like firmware with an emergency parser.
+    virtual void sendUrgent(std::string&& data);
+
+    // Get events for event loop
+    virtual const std::vector<Event>& getEvents() {return events;}
+
+    // Results so far
+    const SimulatorStats& getStats() {return stats;}
+
+private:
+    // Microseconds to send size bytes over the wire
+    uint64_t wireTime(size_t size);
+
+    // Call handler at time due, tracking the timer
+    void after(uint64_t due, TimerHandler handler);
+
+    // Send a line to the host
+    void reply(const std::string& line);
+
+    // Start parsing the next received frame if idle
+    void processNext();
+
+    // Check and execute a frame
+    void execute(const std::string& frame);
+
+    // Execute the command part of an accepted frame
+    void executeCommand(const char* b, const char* e);
+
+    // Finish the current frame with "ok" (or a custom acknowledgement) and move on
+    void finish(const std::string& ack = "ok");
+
+    // Call then once the planner has room for another move
+    void whenPlannerHasRoom(TimerHandler then);
+
+    // Call then once every move has finished
+    void whenPlannerEmpty(TimerHandler then);
+
+    // Queue a move which takes duration seconds
+    void queueMove(double duration);
+
+    // Bring hotend and bed up to date
+    void updateTemperatures();
+
+    // M112: drop everything and stop
+    void halt();
+};
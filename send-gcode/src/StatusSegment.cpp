@@ -0,0 +1,201 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#include "StatusSegment.h"
+#include "JobIndex.h"
+#include "JobProgress.h"
+#include "Telemetry.h"
+#include <algorithm>
+#include <stdexcept>
+
+using namespace std;
+
+static const char statusMagic[8] = "SGSTAT";
+
+static string segmentName(const string& name)
+{
+    return "Local\\send-gcode-" + name;
+}
+
+StatusSegment::StatusSegment(
+    const std::string& name,
+    Clock& clock,
+    GCodeSender& sender,
+    uint64_t jobSize,
+    const JobProgress* progress,
+    const TelemetryRing* telemetry,
+    const JobIndex* index,
+    unsigned intervalMs):
+        clock(clock),
+        sender(sender),
+        progress(progress),
+        telemetry(telemetry),
+        index(index),
+        intervalMs(intervalMs),
+        block(0),
+        timer(0)
+{
+    HANDLE h = CreateFileMappingA(INVALID_HANDLE_VALUE, 0, PAGE_READWRITE, 0, sizeof(StatusBlock), segmentName(name).c_str());
+    if(!h)
+        throw runtime_error("can not create status segment " + segmentName(name));
+    mapping.reset(h, CloseHandle);
+    if(GetLastError() == ERROR_ALREADY_EXISTS)
+        throw runtime_error("another send-gcode is publishing status as " + name);
+    block = (StatusBlock*)MapViewOfFile(h, FILE_MAP_WRITE, 0, 0, sizeof(StatusBlock));
+    if(!block)
+        throw runtime_error("can not map status segment " + segmentName(name));
+
+    // The segment starts zeroed, so the sequence is even and nothing is half written
+    block->version = statusVersion;
+    block->size = sizeof(StatusBlock);
+    block->jobSize = jobSize;
+    block->layers = index ? (uint32_t)index->getLayers() : 0;
+    block->okLatencyUnitUs = okLatencyUnitUs;
+    publish(statusRunning);
+    MemoryBarrier();
+    memcpy(block->magic, statusMagic, sizeof(statusMagic));   // Last: monitors check it first
+    timer = clock.setTimer(clock.now() + intervalMs * (uint64_t)1000, [this](){onTimer();});
+}
+
+StatusSegment::~StatusSegment()
+{
+    clock.cancelTimer(timer);
+    if(block)
+    {
+        // Still running means the session ended with an error
+        if(block->state == statusRunning)
+            publish(statusFailed);
+        UnmapViewOfFile(block);
+    }
+}
+
+void StatusSegment::onTimer()
+{
+    timer = clock.setTimer(clock.now() + intervalMs * (uint64_t)1000, [this](){onTimer();});
+    publish(statusRunning);
+}
+
+void StatusSegment::publish(StatusState state)
+{
+    // Gather everything first to keep the odd window short
+    const SenderStats& stats = sender.getStats();
+    uint64_t position = sender.getPosition();
+    uint32_t layer = index && position ? (uint32_t)index->getLayerOf((size_t)position - 1) : 0;
+    const TemperatureReport* t = telemetry && telemetry->size() ? &telemetry->get(0) : 0;
+
+    InterlockedIncrement(&block->sequence);
+    block->state = state;
+    block->updateTime = clock.now();
+    block->position = position;
+    block->layer = layer;
+    block->fraction = progress ? (float)progress->getFraction() : -1;
+    block->elapsed = progress ? (float)progress->getElapsed() : 0;
+    block->remaining = progress ? (float)progress->getRemaining() : -1;
+    block->framesSent = stats.framesSent;
+    block->bytesSent = stats.bytesSent;
+    block->oksReceived = stats.oksReceived;
+    block->resendRequests = stats.resendRequests;
+    block->timeouts = stats.timeouts;
+    copy(stats.okLatency, stats.okLatency + okLatencyBuckets, block->okLatency);
+    if(t)
+    {
+        block->temperatureReports = telemetry->getCount();
+        block->temperatureTime = t->time;
+        block->hotend = t->hotend;
+        block->hotendTarget = t->hotendTarget;
+        block->bed = t->bed;
+        block->bedTarget = t->bedTarget;
+        block->hasBed = t->hasBed;
+    }
+    InterlockedIncrement(&block->sequence);
+}
+
+// Copy a consistent snapshot out of the segment
+static void readStatus(const StatusBlock* block, StatusBlock& status)
+{
+    while(1)
+    {
+        LONG before = block->sequence;
+        _ReadWriteBarrier();
+        if(!(before & 1))
+        {
+            memcpy(&status, (const void*)block, sizeof(StatusBlock));
+            MemoryBarrier();
+            if(block->sequence == before)
+                return;
+        }
+        Sleep(0);
+    }
+}
+
+// Time by which half of the answers had arrived, in ms
+static double medianLatency(const StatusBlock& status)
+{
+    uint64_t total = 0;
+    for(unsigned i = 0; i < okLatencyBuckets; ++i)
+        total += status.okLatency[i];
+    uint64_t seen = 0;
+    for(unsigned i = 0; i < okLatencyBuckets; ++i)
+    {
+        seen += status.okLatency[i];
+        if(total && seen * 2 >= total)
+            return (2u << i) * status.okLatencyUnitUs / 1000.0;
+    }
+    return 0;
+}
+
+void monitorStatus(const std::string& name, unsigned intervalMs)
+{
+    HANDLE h = OpenFileMappingA(FILE_MAP_READ, false, segmentName(name).c_str());
+    if(!h)
+        throw runtime_error("no send-gcode is publishing status as " + name);
+    shared_ptr<void> mapping(h, CloseHandle);
+    const StatusBlock* block = (const StatusBlock*)MapViewOfFile(h, FILE_MAP_READ, 0, 0, 0);
+    if(!block)
+        throw runtime_error("can not map status segment " + segmentName(name));
+    shared_ptr<const void> view(block, UnmapViewOfFile);
+    if(memcmp(block->magic, statusMagic, sizeof(statusMagic)) || block->version != statusVersion || block->size != sizeof(StatusBlock))
+        throw runtime_error("status segment " + segmentName(name) + " is from a different version of send-gcode");
+
+    while(1)
+    {
+        StatusBlock status;
+        readStatus(block, status);
+        printf("%s: %u/%u commands", name.c_str(), (unsigned)status.position, (unsigned)status.jobSize);
+        if(status.layers)
+            printf(", layer %u/%u", status.layer, status.layers);
+        if(status.fraction >= 0)
+            printf(", %.1f%%, remaining %s", status.fraction * 100, formatDuration(status.remaining).c_str());
+        printf(", %u frames, %u resends, %u timeouts, half of oks within %.1f ms", (unsigned)status.framesSent,
+            status.resendRequests, status.timeouts, medianLatency(status));
+        if(status.temperatureReports)
+        {
+            printf(", hotend %.1f/%.0f", status.hotend, status.hotendTarget);
+            if(status.hasBed)
+                printf(", bed %.1f/%.0f", status.bed, status.bedTarget);
+        }
+        printf("\n");
+
+        if(status.state != statusRunning)
+        {
+            static const char* states[] = {"running", "done", "stopped", "failed"};
+            printf("%s: %s\n", name.c_str(), states[min(status.state, (uint32_t)statusFailed)]);
+            return;
+        }
+        Sleep(intervalMs);
+    }
+}
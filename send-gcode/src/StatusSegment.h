@@ -0,0 +1,113 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#pragma once
+
+#include "Clock.h"
+#include "GCodeSender.h"
+
+class JobIndex;
+class JobProgress;
+class TelemetryRing;
+
+enum StatusState
+{
+    statusRunning,
+    statusDone,                                 // The last line was acknowledged
+    statusStopped,                              // Emergency stop
+    statusFailed,                               // The sender gave up, e.g. on a firmware reset
+};
+
+const uint32_t statusVersion = 1;
+
+// Layout of the shared memory segment. Monitors on the same machine map it read-only and copy
+// it out under the sequence number (a seqlock), so reading takes no system calls and never
+// holds up the sender. New fields go at the end, with a new version.
+struct StatusBlock
+{
+    char magic[8];                              // "SGSTAT"
+    uint32_t version;                           // statusVersion
+    uint32_t size;                              // sizeof(StatusBlock)
+    volatile LONG sequence;                     // Odd while the sender is writing
+    uint32_t state;                             // StatusState
+    uint64_t updateTime;                        // Sender's clock at the last update (us)
+
+    // Job
+    uint64_t jobSize;                           // Commands; 0 if unknown
+    uint64_t position;                          // Commands up to and including the last the firmware accepted
+    uint32_t layer;                             // 1-based layer of that command; 0 before the first or if unknown
+    uint32_t layers;                            // 0 if unknown
+    float fraction;                             // Of the estimated time; 0 to 1, or -1 if unknown
+    float elapsed;                              // Seconds since the first acknowledgement
+    float remaining;                            // Estimated seconds left; -1 if unknown
+
+    // Link
+    uint64_t framesSent;                        // Including resent frames
+    uint64_t bytesSent;
+    uint64_t oksReceived;
+    uint32_t resendRequests;
+    uint32_t timeouts;
+    uint32_t okLatency[okLatencyBuckets];       // As in SenderStats
+    uint32_t okLatencyUnitUs;                   // Unit of okLatency buckets
+
+    // Latest temperatures; valid once temperatureReports isn't 0
+    uint64_t temperatureReports;
+    uint64_t temperatureTime;                   // Sender's clock when it arrived (us)
+    float hotend;
+    float hotendTarget;
+    float bed;
+    float bedTarget;
+    uint32_t hasBed;
+};
+
+// Publishes a sending session's status in a named shared memory segment, Local\send-gcode-<name>.
+// The status is copied in from the sender and friends on a clock timer, so the I/O path pays nothing.
+class StatusSegment
+{
+private:
+    Clock& clock;
+    GCodeSender& sender;
+    const JobProgress* progress;
+    const TelemetryRing* telemetry;
+    const JobIndex* index;
+    unsigned intervalMs;                        // Publish this often
+    std::shared_ptr<void> mapping;              // Shared memory
+    StatusBlock* block;                         // Mapped view of it
+    unsigned timer;                             // Pending publish, or 0
+
+public:
+    StatusSegment(
+        const std::string& name,
+        Clock& clock,                           // Caller must keep these alive
+        GCodeSender& sender,
+        uint64_t jobSize,
+        const JobProgress* progress,            // May be null
+        const TelemetryRing* telemetry,         // May be null
+        const JobIndex* index,                  // For layers; may be null
+        unsigned intervalMs);
+    ~StatusSegment();
+
+public:
+    // Copy the current status in now
+    void publish(StatusState state);
+
+private:
+    void onTimer();
+};
+
+// Print the status published under name every intervalMs until the session ends
+void monitorStatus(const std::string& name, unsigned intervalMs);
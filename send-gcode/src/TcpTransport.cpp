@@ -0,0 +1,270 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+// Winsock 2 must come before Windows.h, which TcpTransport.h includes
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+#include "TcpTransport.h"
+#include "Clock.h"
+#include "Serial.h"
+#include <stdexcept>
+
+using namespace std;
+
+TcpTransport::TcpTransport(LineHandler receivedLine, StatusWriter statusWriter):
+    receivedLine(receivedLine),
+    statusWriter(statusWriter),
+    sock(INVALID_SOCKET),
+    connecting(false),
+    socketEvent(WSA_INVALID_EVENT),
+    retryTimer(0),
+    lostTime(0),
+    reconnects(0),
+    frontSent(0),
+    bytesInReadBuffer(0)
+{
+    WSADATA data;
+    if(WSAStartup(MAKEWORD(2, 2), &data))
+        throw runtime_error("WSAStartup failed");
+
+    socketEvent = WSACreateEvent();
+    retryTimer = CreateWaitableTimer(0, false, 0);
+    if(socketEvent == WSA_INVALID_EVENT || !retryTimer)
+    {
+        if(socketEvent != WSA_INVALID_EVENT)
+            WSACloseEvent(socketEvent);
+        if(retryTimer)
+            CloseHandle(retryTimer);
+        WSACleanup();
+        throw runtime_error("CreateEvent failed");
+    }
+    events.push_back(Event(socketEvent, [this](){onSocket();}));
+    events.push_back(Event(retryTimer, [this](){onRetry();}));
+} // TcpTransport::TcpTransport
+
+TcpTransport::~TcpTransport()
+{
+    closeSocket();
+    CloseHandle(retryTimer);
+    WSACloseEvent(socketEvent);
+    WSACleanup();
+}
+
+void TcpTransport::open(const std::string& host, const std::string& port)
+{
+    if(sock != INVALID_SOCKET)
+        throw runtime_error("connection is already open");
+    this->host = host;
+    this->port = port;
+
+    startConnect();
+    WSANETWORKEVENTS networkEvents;
+    if( WaitForSingleObject(socketEvent, connectTimeoutMs) != WAIT_OBJECT_0 ||
+        WSAEnumNetworkEvents((SOCKET)sock, socketEvent, &networkEvents) ||
+        !(networkEvents.lNetworkEvents & FD_CONNECT) ||
+        networkEvents.iErrorCode[FD_CONNECT_BIT])
+    {
+        closeSocket();
+        throw runtime_error("can not connect to " + host + ":" + port);
+    }
+    connecting = false;
+
+    // Let the event loop pick up anything which arrived with the connection
+    SetEvent(socketEvent);
+}
+
+void TcpTransport::send(std::string&& data)
+{
+    writeQueue.push_back(move(data));
+    flush();
+}
+
+void TcpTransport::sendUrgent(std::string&& data)
+{
+    list<string>::iterator pos = writeQueue.begin();
+    if(frontSent)
+        ++pos;
+    writeQueue.insert(pos, move(data));
+    flush();
+}
+
+void TcpTransport::startConnect()
+{
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    addrinfo* info = 0;
+    if(getaddrinfo(host.c_str(), port.c_str(), &hints, &info) || !info)
+        throw runtime_error("can not find " + host + ":" + port);
+
+    // WSAEventSelect() makes the socket non-blocking, so connect() finishes with FD_CONNECT
+    BOOL noDelay = true;
+    SOCKET s = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+    bool started = s != INVALID_SOCKET &&
+        !setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay)) &&
+        !WSAEventSelect(s, socketEvent, FD_CONNECT | FD_READ | FD_WRITE | FD_CLOSE) &&
+        (!connect(s, info->ai_addr, (int)info->ai_addrlen) || WSAGetLastError() == WSAEWOULDBLOCK);
+    freeaddrinfo(info);
+    if(!started)
+    {
+        if(s != INVALID_SOCKET)
+            closesocket(s);
+        throw runtime_error("can not connect to " + host + ":" + port);
+    }
+    sock = s;
+    connecting = true;
+}
+
+void TcpTransport::closeSocket()
+{
+    if(sock != INVALID_SOCKET)
+        closesocket((SOCKET)sock);
+    sock = INVALID_SOCKET;
+    connecting = false;
+    ResetEvent(socketEvent);
+}
+
+void TcpTransport::onSocket()
+{
+    if(sock == INVALID_SOCKET)
+    {
+        ResetEvent(socketEvent);
+        return;
+    }
+    WSANETWORKEVENTS networkEvents;
+    if(WSAEnumNetworkEvents((SOCKET)sock, socketEvent, &networkEvents))
+    {
+        lost();
+        return;
+    }
+    if(connecting)
+    {
+        if(!(networkEvents.lNetworkEvents & FD_CONNECT))
+            return;
+        if(networkEvents.iErrorCode[FD_CONNECT_BIT])
+        {
+            lost();
+            return;
+        }
+        connecting = false;
+        ++reconnects;
+        statusWriter(("reconnected to " + host + ":" + port + "\n").c_str());
+    }
+
+    // FD_READ and FD_WRITE only come again after a recv() or send() which found nothing to do,
+    // so try both every time. A close shows up as recv() returning 0.
+    receive();
+    flush();
+}
+
+void TcpTransport::receive()
+{
+    while(sock != INVALID_SOCKET && !connecting)
+    {
+        int n = recv((SOCKET)sock, readBuffer + bytesInReadBuffer, (int)(readBufferSize - bytesInReadBuffer), 0);
+        if(n > 0)
+        {
+            bytesInReadBuffer += n;
+            dispatchLines(readBuffer, bytesInReadBuffer, readBufferSize, receivedLine, statusWriter);
+        }
+        else if(!n || WSAGetLastError() != WSAEWOULDBLOCK)
+            lost();
+        else
+            return;
+    }
+}
+
+void TcpTransport::flush()
+{
+    while(sock != INVALID_SOCKET && !connecting && !writeQueue.empty())
+    {
+        // Line-sized frames would each be a packet of their own; gather them into one send
+        WSABUF buffers[maxGather];
+        DWORD count = 0;
+        for(list<string>::iterator it = writeQueue.begin(); it != writeQueue.end() && count < maxGather; ++it, ++count)
+        {
+            size_t skip = count ? 0 : frontSent;
+            buffers[count].buf = const_cast<char*>(it->data()) + skip;
+            buffers[count].len = (ULONG)(it->size() - skip);
+        }
+
+        DWORD sent = 0;
+        if(WSASend((SOCKET)sock, buffers, count, &sent, 0, 0, 0))
+        {
+            if(WSAGetLastError() != WSAEWOULDBLOCK)
+                lost();
+            return;             // FD_WRITE comes when there's room
+        }
+
+        while(sent)
+        {
+            size_t left = writeQueue.front().size() - frontSent;
+            if(sent < left)
+            {
+                frontSent += sent;
+                break;
+            }
+            sent -= (DWORD)left;
+            writeQueue.pop_front();
+            frontSent = 0;
+        }
+    }
+}
+
+void TcpTransport::lost()
+{
+    bool wasConnected = sock != INVALID_SOCKET && !connecting;
+    closeSocket();
+
+    uint64_t now = monotonicMicros();
+    if(wasConnected)
+    {
+        statusWriter(("lost connection to " + host + ":" + port + "; reconnecting\n").c_str());
+        lostTime = now;
+        bytesInReadBuffer = 0;
+        if(frontSent)
+        {
+            frontSent = 0;
+            writeQueue.push_front("\n");
+        }
+    }
+    else if(now - lostTime > giveUpMs * (uint64_t)1000)
+        throw runtime_error("can not reconnect to " + host + ":" + port);
+
+    // Try straight away after a drop, then every retryMs. Negative means relative, in 100ns units.
+    LARGE_INTEGER due;
+    due.QuadPart = -(LONGLONG)(wasConnected ? 1 : retryMs * 10000);
+    if(!SetWaitableTimer(retryTimer, &due, 0, 0, 0, false))
+        throw runtime_error("SetWaitableTimer failed");
+}
+
+void TcpTransport::onRetry()
+{
+    if(sock != INVALID_SOCKET)
+        return;
+    try
+    {
+        startConnect();
+    }
+    catch(exception&)
+    {
+        lost();
+    }
+}
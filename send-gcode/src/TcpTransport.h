@@ -0,0 +1,106 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#pragma once
+
+#include "Transport.h"
+#include <list>
+#include <stdint.h>
+
+// Link to firmware behind a network serial bridge (ser2net, ESP-Link and the like), over TCP.
+// Nagle is off so a frame leaves at once, and frames queued while the socket is busy go out
+// together in one gathered send.
+//
+// If the connection drops, it reconnects in the background and carries on with whatever was
+// still queued. The sender isn't told, so its line numbering carries on as if nothing happened;
+// a frame or "ok" lost in the drop is recovered the usual way, by a resend request or the
+// sender's timeout, which portFactory() callers always set for tcp: ports (see networkTimeoutMs).
+// A frame which was cut off is sent again whole, after a newline which ends
+// the fragment the firmware already has.
+class TcpTransport: public Transport
+{
+private:
+    enum {connectTimeoutMs = 10000};            // For open()
+    enum {retryMs = 1000};                      // Between reconnect attempts
+    enum {giveUpMs = 60000};                    // Fail after this long without a connection
+    enum {maxGather = 16};                      // Frames per send
+
+    LineHandler receivedLine;                   // This function is called for every received line
+    StatusWriter statusWriter;                  // This function is called to indicate warnings
+    std::vector<Event> events;                  // Events needed by this class
+
+    std::string host;
+    std::string port;
+    UINT_PTR sock;                              // SOCKET; INVALID_SOCKET while disconnected
+    bool connecting;                            // Waiting for a non-blocking connect()
+    HANDLE socketEvent;                         // WSAEventSelect() target; kept across reconnects
+    HANDLE retryTimer;                          // Due when the next reconnect attempt should start
+    uint64_t lostTime;                          // When the connection dropped
+    unsigned reconnects;                        // Connections made after the first
+    std::list<std::string> writeQueue;          // Frames to send
+    size_t frontSent;                           // Bytes of the front frame already sent
+    static const size_t readBufferSize = 1024;  // Maximum size of a received line
+    char readBuffer[readBufferSize];            // Receives incoming data
+    size_t bytesInReadBuffer;                   // Amount of data in readBuffer
+
+public:
+    TcpTransport(LineHandler receivedLine, StatusWriter statusWriter);
+    ~TcpTransport();
+
+public:
+    // Connect; throws exception on failure
+    void open(
+        const std::string& host,                // Name or address
+        const std::string& port);               // Number or service name
+
+    // Send data. Async; returns immediately. Queued while reconnecting.
+    virtual void send(std::string&& data);
+
+    // Send data as soon as the frame being sent is finished
+    virtual void sendUrgent(std::string&& data);
+
+    // Frames the socket hasn't taken yet, e.g. while reconnecting
+    virtual bool getWritePending() {return !writeQueue.empty();}
+
+    // Get events for event loop
+    virtual const std::vector<Event>& getEvents() {return events;}
+
+    // Connections made after the first
+    unsigned getReconnects() {return reconnects;}
+
+private:
+    // Start a non-blocking connect on a new socket
+    void startConnect();
+
+    // Close the socket, if any
+    void closeSocket();
+
+    // Signaled by the socket
+    void onSocket();
+
+    // Read everything available
+    void receive();
+
+    // Send as much of writeQueue as the socket will take
+    void flush();
+
+    // The connection dropped or a connect failed; try again later
+    void lost();
+
+    // Time to try connecting again
+    void onRetry();
+};
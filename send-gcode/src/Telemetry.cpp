@@ -0,0 +1,109 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#include "Telemetry.h"
+#include <ctype.h>
+
+// Parse a decimal like "210.35" or "-14.0" at p, leaving p after it; p is unchanged if there is none
+static bool parseNumber(const char*& p, const char* e, float& value)
+{
+    // A thermistor which is cold or disconnected reads below zero, e.g. "T:-14.0"
+    const char* start = p;
+    bool negative = p != e && *p == '-';
+    if(negative)
+        ++p;
+    double v = 0;
+    unsigned digits = 0;
+    while(p != e && isdigit((unsigned char)*p))
+    {
+        v = v * 10 + (*p++ - '0');
+        ++digits;
+    }
+    if(p != e && *p == '.')
+    {
+        double scale = 1;
+        ++p;
+        while(p != e && isdigit((unsigned char)*p))
+        {
+            scale /= 10;
+            v += (*p++ - '0') * scale;
+            ++digits;
+        }
+    }
+    if(!digits)
+    {
+        p = start;
+        return false;
+    }
+    value = (float)(negative ? -v : v);
+    return true;
+}
+
+// Parse "current" or "current /target" at p; target is 0 if missing
+static bool parsePair(const char*& p, const char* e, float& current, float& target)
+{
+    if(!parseNumber(p, e, current))
+        return false;
+    target = 0;
+    const char* q = p;
+    while(q != e && *q == ' ')
+        ++q;
+    if(q != e && *q == '/')
+    {
+        ++q;
+        while(q != e && *q == ' ')
+            ++q;
+        if(parseNumber(q, e, target))
+            p = q;
+    }
+    return true;
+}
+
+bool parseTemperatures(const char* b, const char* e, TemperatureReport& report)
+{
+    bool hasHotend = false;
+    report.hasBed = false;
+    for(const char* p = b; p != e; ++p)
+    {
+        if(p != b && p[-1] != ' ')
+            continue;
+
+        // "T:" or "T0:" is the first hotend; "T1:" and so on are skipped
+        const char* q = p;
+        if(!hasHotend && e - q >= 2 && q[0] == 'T' && (q[1] == ':' || (q[1] == '0' && e - q >= 3 && q[2] == ':')))
+        {
+            q += q[1] == ':' ? 2 : 3;
+            hasHotend = parsePair(q, e, report.hotend, report.hotendTarget);
+        }
+        else if(!report.hasBed && e - q >= 2 && q[0] == 'B' && q[1] == ':')
+        {
+            q += 2;
+            report.hasBed = parsePair(q, e, report.bed, report.bedTarget);
+        }
+    }
+    return hasHotend;
+}
+
+TelemetryRing::TelemetryRing():
+    count(0)
+{
+}
+
+void TelemetryRing::push(const TemperatureReport& report)
+{
+    reports[count++ % capacity] = report;
+}
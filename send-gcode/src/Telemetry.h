@@ -0,0 +1,63 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#pragma once
+
+#include <stdint.h>
+
+// Temperatures from one report by the firmware
+struct TemperatureReport
+{
+    uint64_t time;                              // Clock time it arrived
+    float hotend;                               // Degrees C
+    float hotendTarget;                         // 0 if off or not reported
+    float bed;                                  // Only valid if hasBed
+    float bedTarget;
+    bool hasBed;
+};
+
+// Parse the temperatures from an M105 answer or an automatic report, e.g.
+// "ok T:210.3 /210.0 B:60.1 /60.0 @:64", "T:20.00/0.00" or "ok T:201". Only the first
+// hotend is kept. Doesn't allocate. Returns false if the line has no hotend temperature;
+// report.time is left alone.
+bool parseTemperatures(const char* b, const char* e, TemperatureReport& report);
+
+// The most recent temperature reports, in a fixed-size ring; the oldest are overwritten
+class TelemetryRing
+{
+public:
+    static const unsigned capacity = 256;
+
+private:
+    TemperatureReport reports[capacity];
+    uint64_t count;                             // Reports pushed so far
+
+public:
+    TelemetryRing();
+
+public:
+    void push(const TemperatureReport& report);
+
+    // Total number pushed, including overwritten ones
+    uint64_t getCount() const {return count;}
+
+    // Number held; at most capacity
+    unsigned size() const {return count < capacity ? (unsigned)count : capacity;}
+
+    // A held report; 0 is the newest
+    const TemperatureReport& get(unsigned age) const {return reports[(count - 1 - age) % capacity];}
+};
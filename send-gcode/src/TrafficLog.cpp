@@ -0,0 +1,75 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#include "TrafficLog.h"
+
+using namespace std;
+
+// Ring size; enough for a few seconds of a terminal falling behind at 250000 bps
+static const size_t logRingSize = 256 * 1024;
+
+// Maximum time between console writes
+static const unsigned logIntervalMs = 50;
+
+TrafficLog::TrafficLog():
+    droppedShown(0),
+    writer(
+        logRingSize,
+        [this](const char* b, const char* e){onRecord(b, e);},
+        [this](){onFlush();},
+        logIntervalMs)
+{
+}
+
+void TrafficLog::record(RecordType type, const char* b, const char* e)
+{
+    uint8_t header = (uint8_t)type;
+    writer.push(&header, sizeof(header), b, e - b);
+}
+
+void TrafficLog::onRecord(const char* b, const char* e)
+{
+    switch(*b)
+    {
+    case logSent:
+        text += "send: ";
+        text.append(b + 1, e);
+        break;
+    case logReceived:
+        text += "recv: ";
+        text.append(b + 1, e);
+        text += '\n';
+        break;
+    default:
+        text.append(b + 1, e);
+    }
+}
+
+void TrafficLog::onFlush()
+{
+    unsigned dropped = writer.getDropped();
+    if(dropped != droppedShown)
+    {
+        char buf[80];
+        sprintf(buf, "verbose: %u lines not shown; the console is too slow\n", dropped - droppedShown);
+        text += buf;
+        droppedShown = dropped;
+    }
+    fwrite(text.data(), 1, text.size(), stdout);
+    fflush(stdout);
+    text.clear();
+}
@@ -0,0 +1,64 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#pragma once
+
+#include "BackgroundWriter.h"
+
+// Prints communications traffic (-v) from a background thread. The I/O path only copies
+// each frame or line into a memory ring; formatting and the console write happen on the
+// thread, so a slow terminal can't hold up the printer. If the ring fills, lines are
+// dropped and counted instead.
+class TrafficLog
+{
+private:
+    std::string text;                           // Batches output; only used by the background thread
+    unsigned droppedShown;                      // Dropped count already reported
+    BackgroundWriter writer;                    // Must be last; its thread uses the members above
+
+public:
+    TrafficLog();                               // Whatever is left is printed on destruction
+
+public:
+    // A frame sent to the firmware, including its newline
+    void sent(const char* b, const char* e) {record(logSent, b, e);}
+
+    // A line received from the firmware, without line terminators
+    void received(const char* b, const char* e) {record(logReceived, b, e);}
+
+    // Anything else worth showing with the traffic; msg ends with a newline
+    void note(const char* msg) {record(logNote, msg, msg + strlen(msg));}
+
+    // Lines dropped because the ring was full
+    unsigned getDropped() const {return writer.getDropped();}
+
+private:
+    enum RecordType
+    {
+        logSent,
+        logReceived,
+        logNote,
+    };
+
+    void record(RecordType type, const char* b, const char* e);
+
+    // Background thread: format record into text
+    void onRecord(const char* b, const char* e);
+
+    // Background thread: print text
+    void onFlush();
+};
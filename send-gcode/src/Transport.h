@@ -0,0 +1,58 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+#include <Windows.h>
+
+// Identifies function to call whenever an event is signaled; function may throw exceptions
+typedef std::tuple<HANDLE, std::function<void()>> Event;
+
+// Line handling function
+typedef std::function<void(const char* begin, const char* end)> LineHandler;
+
+// Receive status messages (warnings)
+typedef std::function<void(const char* msg)> StatusWriter;
+
+// A link to the firmware. Implementations call the LineHandler for every received line
+// and the StatusWriter for warnings.
+class Transport
+{
+public:
+    virtual ~Transport() {}
+
+    // Send data. Async; returns immediately
+    virtual void send(std::string&& data) = 0;
+
+    // Send data ahead of anything still queued; a write already under way finishes first
+    virtual void sendUrgent(std::string&& data) {send(std::move(data));}
+
+    // Is anything given to send() or sendUrgent() not yet handed to the driver or socket?
+    // Closing the transport would lose it.
+    virtual bool getWritePending() {return false;}
+
+    // Get events for event loop
+    virtual const std::vector<Event>& getEvents() = 0;
+};
+
+// Creates a connected transport which reports to the given handlers; throws exception on failure
+typedef std::function<std::unique_ptr<Transport>(LineHandler receivedLine, StatusWriter statusWriter)> TransportFactory;
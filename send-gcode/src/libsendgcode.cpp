@@ -0,0 +1,303 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#include "sendgcode.h"
+#include "GCodeSender.h"
+#include "IocpSerial.h"
+#include "PortFactory.h"
+#include "Telemetry.h"
+#include <algorithm>
+#include <new>
+#include <stdexcept>
+
+using namespace std;
+
+// Each thread's sg_last_error() buffer hangs off a TLS slot. __declspec(thread) doesn't work
+// in a DLL loaded with LoadLibrary() before Vista.
+static const size_t errorSize = 256;
+static DWORD errorSlot = TLS_OUT_OF_INDEXES;
+static char fallbackError[errorSize];           // Used if the slot or a buffer can't be had
+
+BOOL WINAPI DllMain(HINSTANCE, DWORD reason, LPVOID)
+{
+    if(reason == DLL_PROCESS_ATTACH)
+        errorSlot = TlsAlloc();
+    else if((reason == DLL_THREAD_DETACH || reason == DLL_PROCESS_DETACH) && errorSlot != TLS_OUT_OF_INDEXES)
+    {
+        delete[] (char*)TlsGetValue(errorSlot);
+        TlsSetValue(errorSlot, 0);
+        if(reason == DLL_PROCESS_DETACH)
+            TlsFree(errorSlot);
+    }
+    return true;
+}
+
+// This thread's error buffer; 0 if it has none yet and create is false
+static char* getErrorBuffer(bool create)
+{
+    if(errorSlot == TLS_OUT_OF_INDEXES)
+        return fallbackError;
+    char* buffer = (char*)TlsGetValue(errorSlot);
+    if(!buffer && create)
+    {
+        buffer = new(nothrow) char[errorSize];
+        if(!buffer || !TlsSetValue(errorSlot, buffer))
+        {
+            delete[] buffer;
+            return fallbackError;
+        }
+    }
+    return buffer;
+}
+
+static void setError(const char* msg)
+{
+    char* buffer = getErrorBuffer(true);
+    strncpy(buffer, msg, errorSize - 1);
+    buffer[errorSize - 1] = 0;
+}
+
+struct sg_engine
+{
+    RealClock clock;
+    unique_ptr<Reactor> reactor;
+    IocpReactor* completionPort;                // reactor, if it is one
+    vector<sg_job*> jobs;
+};
+
+struct sg_job
+{
+    sg_engine* engine;
+    sg_job_options options;
+    TelemetryRing telemetry;
+    uint64_t telemetrySeen;                     // Reports already passed to on_temperature
+    unique_ptr<GCodeSender> sender;             // Must be last; it reports to the members above
+};
+
+// Pass reports which arrived since the last call to on_temperature, oldest first
+static void deliverTelemetry(sg_job* job)
+{
+    uint64_t count = job->telemetry.getCount();
+    if(!job->options.on_temperature || count == job->telemetrySeen)
+        return;
+    unsigned fresh = (unsigned)min<uint64_t>(count - job->telemetrySeen, job->telemetry.size());
+    job->telemetrySeen = count;
+    for(unsigned age = fresh; age--;)
+    {
+        const TemperatureReport& r = job->telemetry.get(age);
+        sg_temperature report;
+        report.time_us = r.time;
+        report.hotend = r.hotend;
+        report.hotend_target = r.hotendTarget;
+        report.bed = r.bed;
+        report.bed_target = r.bedTarget;
+        report.has_bed = r.hasBed;
+        job->options.on_temperature(job->options.context, &report);
+    }
+}
+
+const char* sg_last_error(void)
+{
+    const char* buffer = getErrorBuffer(false);
+    return buffer ? buffer : "";
+}
+
+sg_engine* sg_engine_create(int completion_port)
+{
+    try
+    {
+        unique_ptr<sg_engine> engine(new sg_engine);
+        engine->completionPort = 0;
+        if(completion_port)
+            engine->reactor.reset(engine->completionPort = new IocpReactor);
+        else
+            engine->reactor.reset(new WaitReactor);
+        engine->reactor->add(engine->clock.getEvents());
+        return engine.release();
+    }
+    catch(exception& e)
+    {
+        setError(e.what());
+        return 0;
+    }
+}
+
+void sg_engine_destroy(sg_engine* engine)
+{
+    if(!engine)
+        return;
+    while(!engine->jobs.empty())
+        sg_job_destroy(engine->jobs.back());
+    delete engine;
+}
+
+int sg_engine_step(sg_engine* engine, unsigned timeout_ms)
+{
+    // Jobs catch their own handlers' failures (SenderOptions::holdFailures); a completion port
+    // says which port's I/O failed, and that fails its job. Anything else fails the engine.
+    int dispatched;
+    try
+    {
+        dispatched = (int)engine->reactor->step(timeout_ms);
+    }
+    catch(exception& e)
+    {
+        sg_job* failed = 0;
+        // Every target on the engine's port is an IocpSerial from portFactory(). Release builds
+        // have no RTTI, so the cast is static.
+        IocpTarget* target = engine->completionPort ? engine->completionPort->getFailedTarget() : 0;
+        Transport* transport = target ? static_cast<IocpSerial*>(target) : 0;
+        for(size_t i = 0; transport && !failed && i < engine->jobs.size(); ++i)
+            if(&engine->jobs[i]->sender->getTransport() == transport)
+                failed = engine->jobs[i];
+        if(!failed)
+        {
+            setError(e.what());
+            return -1;
+        }
+        failed->sender->fail(e.what());
+        dispatched = 1;
+    }
+    for(size_t i = 0; i < engine->jobs.size(); ++i)
+        deliverTelemetry(engine->jobs[i]);
+    return dispatched;
+}
+
+void* const* sg_engine_handles(sg_engine* engine, size_t* count)
+{
+    const vector<HANDLE>& handles = engine->reactor->getHandles();
+    *count = handles.size();
+    return handles.empty() ? 0 : &handles[0];
+}
+
+sg_job* sg_job_start(sg_engine* engine, const char* port, const char* code, size_t size, const sg_job_options* options)
+{
+    try
+    {
+        unique_ptr<sg_job> job(new sg_job);
+        job->engine = engine;
+        if(options)
+            job->options = *options;
+        else
+            memset(&job->options, 0, sizeof(job->options));
+        job->telemetrySeen = 0;
+
+        SenderOptions senderOptions;
+        senderOptions.timeoutMs = job->options.timeout_ms;
+        if(!senderOptions.timeoutMs && isNetworkPort(port))
+            senderOptions.timeoutMs = networkTimeoutMs;
+        senderOptions.temperatureMs = job->options.temperature_ms;
+        senderOptions.telemetry = &job->telemetry;
+        senderOptions.holdFailures = true;
+        FlowControl flow = flowNone;
+        if(job->options.flow_control == SG_FLOW_RTSCTS)
+            flow = flowRtsCts;
+        else if(job->options.flow_control == SG_FLOW_XONXOFF)
+            flow = flowXonXoff;
+        if(flow != flowNone)
+            senderOptions.window = maxWindow;
+        if(job->options.on_status)
+        {
+            sg_line_fn onStatus = job->options.on_status;
+            void* context = job->options.context;
+            senderOptions.statusWriter = [onStatus, context](const char* msg){
+                size_t length = strlen(msg);
+                while(length && (msg[length - 1] == '\n' || msg[length - 1] == '\r'))
+                    --length;
+                onStatus(context, msg, length);
+            };
+        }
+        else
+            senderOptions.statusWriter = [](const char*){};
+
+        job->sender.reset(new GCodeSender(
+            engine->clock,
+            portFactory(port, job->options.bps ? job->options.bps : 19200, engine->completionPort, flow),
+            unique_ptr<LineSource>(new TextLineSource(code, code + size)),
+            senderOptions));
+        engine->reactor->add(job->sender->getEvents());
+        engine->jobs.push_back(job.get());
+        return job.release();
+    }
+    catch(exception& e)
+    {
+        setError(e.what());
+        return 0;
+    }
+}
+
+void sg_job_destroy(sg_job* job)
+{
+    if(!job)
+        return;
+    sg_engine* engine = job->engine;
+    engine->reactor->remove(job->sender->getEvents());
+    engine->jobs.erase(find(engine->jobs.begin(), engine->jobs.end(), job));
+    delete job;
+}
+
+void sg_job_get_state(sg_job* job, sg_job_state* state)
+{
+    const SenderStats& stats = job->sender->getStats();
+    state->done = job->sender->getDone();
+    state->stopped = job->sender->getStopped();
+    state->failed = job->sender->getFailed();
+    state->error = job->sender->getError().c_str();
+    state->position = job->sender->getPosition();
+    state->frames_sent = stats.framesSent;
+    state->bytes_sent = stats.bytesSent;
+    state->resend_requests = stats.resendRequests;
+    state->timeouts = stats.timeouts;
+}
+
+int sg_job_send_priority(sg_job* job, const char* command, size_t length, sg_line_fn reply, void* context)
+{
+    try
+    {
+        uint16_t opcode;
+        string code = operatorCode(string(command, length), opcode);
+        if(opcode == (opcodeM | 112))
+        {
+            job->sender->emergencyStop();
+            return 0;
+        }
+        LineHandler handler;
+        if(reply)
+            handler = [reply, context](const char* b, const char* e){reply(context, b, e - b);};
+        job->sender->sendPriority(code, handler);
+        return 0;
+    }
+    catch(exception& e)
+    {
+        setError(e.what());
+        return -1;
+    }
+}
+
+int sg_job_emergency_stop(sg_job* job)
+{
+    try
+    {
+        job->sender->emergencyStop();
+        return 0;
+    }
+    catch(exception& e)
+    {
+        setError(e.what());
+        return -1;
+    }
+}
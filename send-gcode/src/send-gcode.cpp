@@ -15,7 +15,26 @@
 // along with this program; if not, write to the Free Software
 // Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
 
+#include "Benchmarks.h"
+#include "CaptureAnalyzer.h"
+#include "CommandTable.h"
+#include "CommandTableFile.h"
+#include "CostModel.h"
+#include "EventLoop.h"
 #include "GCodeSender.h"
+#include "JobIndex.h"
+#include "JobProgress.h"
+#include "MappedFile.h"
+#include "OperatorConsole.h"
+#include "PortFactory.h"
+#include "ProgressJournal.h"
+#include "PrintEstimator.h"
+#include "ReplayTransport.h"
+#include "SessionCapture.h"
+#include "SimulatedPrinter.h"
+#include "StatusSegment.h"
+#include "Telemetry.h"
+#include "TrafficLog.h"
 #include "tclap\CmdLine.h"
 
 using namespace std;
@@ -40,21 +59,7 @@ const char* copyright =
 const string version = "0.1";
 const string defaultPort = "COM4";
 const unsigned defaultBps = 19200;
-
-void readFile(const string& filename, shared_ptr<char>& content, size_t& size)
-{
-    shared_ptr<FILE> f(fopen(filename.c_str(), "rb"), [](FILE* f){if(f) fclose(f);});
-    if(!f)
-        throw runtime_error("can not open file " + filename);
-
-    fseek(&*f, 0, SEEK_END);
-    size = (size_t)ftell(&*f);
-    fseek(&*f, 0, SEEK_SET);
-
-    content = shared_ptr<char>(new char[size], [](char* p){delete[] p;});
-    if(fread(&*content, 1, size, &*f) != size)
-        throw runtime_error("can not read " + filename);
-}
+const unsigned defaultIdleGapMs = 1000;
 
 class StdOutput: public TCLAP::StdOutput
 {
@@ -67,45 +72,426 @@ void StdOutput::version(TCLAP::CmdLineInterface& c)
     printf("%s", copyright);
 }
 
+// Signaled by Ctrl+C. The console runs handlers on a thread of its own, so the handler
+// only wakes the event loop.
+static HANDLE emergencyEvent;
+
+static BOOL WINAPI onConsoleCtrl(DWORD type)
+{
+    if(type != CTRL_C_EVENT && type != CTRL_BREAK_EVENT)
+        return false;
+    SetEvent(emergencyEvent);
+    return true;
+}
+
 int main(int argc, char* argv[])
 {
     try
     {
+        SimulatorConfig simDefaults;
         TCLAP::CmdLine cmd("send-gcode - sends gcode commands to RepRap 5D firmware", ' ', version);
         StdOutput stdOutput;
         cmd.setOutput(&stdOutput);
 
         TCLAP::SwitchArg verboseArg("v","verbose","Print communications traffic", cmd, false);
-        TCLAP::ValueArg<unsigned> bpsArg("b", "bps", "Serial port speed; defaults to " + toString(defaultBps), false, defaultBps, "bps", cmd);
-        TCLAP::ValueArg<string> portArg("p", "port", "Serial port to use; defaults to " + defaultPort, false, defaultPort, "port", cmd);
-        TCLAP::ValueArg<string> fileArg("f", "file", "File to send", true, "", "file", cmd);
+        TCLAP::ValueArg<unsigned> bpsArg("b", "bps", "Serial port speed, any rate the driver takes (e.g. 250000); defaults to " + toString(defaultBps), false, defaultBps, "bps", cmd);
+        TCLAP::ValueArg<string> portArg("p", "port", "Serial port to use, or tcp:<host>:<port> for a network serial bridge; defaults to " + defaultPort, false, defaultPort, "port", cmd);
+        TCLAP::ValueArg<string> fileArg("f", "file", "File to send; G-code or a table file from --save-table. It is mapped into memory whole, so the Win32 build takes files up to about 1 GB; the x64 build has no practical limit", false, "", "file", cmd);
+        TCLAP::ValueArg<unsigned> timeoutArg("t", "timeout", "Ask for the temperature if the firmware is silent this long (ms), in case an \"ok\" was lost; 0 waits forever, except on a tcp: port, which defaults to " + toString(networkTimeoutMs), false, 0, "ms", cmd);
+        TCLAP::ValueArg<string> captureArg("c", "capture", "Record all traffic to a binary capture file", false, "", "file", cmd);
+        TCLAP::ValueArg<string> analyzeArg("", "analyze", "Analyze a capture file instead of sending", false, "", "file", cmd);
+        TCLAP::ValueArg<string> replayArg("", "replay", "Replay the firmware side of a capture file instead of using the port", false, "", "file", cmd);
+        TCLAP::ValueArg<double> replaySpeedArg("", "replay-speed", "Replay speed; 1 is original timing, 2 is twice as fast", false, 1, "factor", cmd);
+        TCLAP::SwitchArg virtualClockArg("", "virtual-clock", "Run on a virtual clock; waits take no real time", cmd, false);
+        TCLAP::SwitchArg simulateArg("", "simulate", "Send to a simulated printer on a virtual clock instead of using the port", cmd, false);
+        TCLAP::ValueArg<unsigned> simPlannerArg("", "sim-planner", "Simulated planner depth (moves); defaults to " + toString(simDefaults.plannerDepth), false, simDefaults.plannerDepth, "moves", cmd);
+        TCLAP::ValueArg<unsigned> simParseArg("", "sim-parse", "Simulated firmware parse time per line (us); defaults to " + toString(simDefaults.parseTimeUs), false, simDefaults.parseTimeUs, "us", cmd);
+        TCLAP::ValueArg<double> simAccelArg("", "sim-accel", "Simulated acceleration (mm/s^2); defaults to " + toString((unsigned)simDefaults.printer.acceleration), false, simDefaults.printer.acceleration, "mm/s^2", cmd);
+        TCLAP::ValueArg<double> simFeedrateArg("", "sim-feedrate", "Simulated maximum feedrate (mm/s); defaults to " + toString((unsigned)simDefaults.printer.maxFeedrate), false, simDefaults.printer.maxFeedrate, "mm/s", cmd);
+        TCLAP::SwitchArg statsArg("", "stats", "Print statistics about the file instead of sending", cmd, false);
+        TCLAP::SwitchArg estimateArg("", "estimate", "Estimate print time instead of sending; uses the --sim-* printer settings", cmd, false);
+        TCLAP::ValueArg<unsigned> progressArg("", "progress", "Print progress and time remaining this often (s) while sending", false, 0, "s", cmd);
+        TCLAP::ValueArg<unsigned> temperatureArg("", "temperature", "Ask for temperatures this often (ms) while sending, between lines of the job; shown by --progress", false, 0, "ms", cmd);
+        TCLAP::SwitchArg m73Arg("", "m73", "Send M73 with progress and time remaining as the percentage changes", cmd, false);
+        TCLAP::ValueArg<unsigned> resumeLineArg("", "resume-line", "Restore the printer's state and resume the job at this line of the file", false, 0, "line", cmd);
+        TCLAP::ValueArg<unsigned> resumeLayerArg("", "resume-layer", "Restore the printer's state and resume the job at the start of this layer (1 is the first)", false, 0, "layer", cmd);
+        TCLAP::ValueArg<string> journalArg("j", "journal", "Record progress in this file so the job can be resumed after a crash", false, "", "file", cmd);
+        TCLAP::ValueArg<string> costsArg("", "costs", "Learn how long the printer takes to answer each kind of command, and keep what's learned in this file; use one file per printer. Estimates use it for homing and heating, slow commands get longer timeouts, and temperature polls don't wait behind them", false, "", "file", cmd);
+        TCLAP::SwitchArg resumeJournalArg("", "resume-journal", "Resume the job after the last line the --journal file says the firmware accepted", cmd, false);
+        vector<string> resetActions;
+        resetActions.push_back("stop");
+        resetActions.push_back("recover");
+        resetActions.push_back("continue");
+        TCLAP::ValuesConstraint<string> resetConstraint(resetActions);
+        TCLAP::ValueArg<string> onResetArg("", "on-reset", "If the firmware resets during the job: stop; recover by re-heating, homing X and Y and restoring state, with the nozzle left where it was; or continue as if nothing was lost. Defaults to stop", false, "stop", &resetConstraint, cmd);
+        TCLAP::SwitchArg consoleArg("", "console", "Send commands typed while the job runs between lines of the file, and print the answers; M112 is an emergency stop", cmd, false);
+        TCLAP::ValueArg<string> consolePipeArg("", "console-pipe", "Take commands from clients of the pipe \\\\.\\pipe\\<name>; answers go back through the pipe", false, "", "name", cmd);
+        TCLAP::ValueArg<string> statusArg("", "status", "Publish progress, traffic and temperatures in shared memory under this name, for --monitor", false, "", "name", cmd);
+        TCLAP::ValueArg<string> monitorArg("", "monitor", "Print the status another send-gcode publishes with --status under this name, instead of sending", false, "", "name", cmd);
+        TCLAP::ValueArg<string> saveTableArg("", "save-table", "Parse the file and save it as a table file, which loads without parsing", false, "", "file", cmd);
+        TCLAP::ValueArg<unsigned> threadsArg("", "threads", "Threads for parsing the file; defaults to one per processor", false, 0, "n", cmd);
+        vector<string> flowModes;
+        flowModes.push_back("none");
+        flowModes.push_back("rtscts");
+        flowModes.push_back("xonxoff");
+        TCLAP::ValuesConstraint<string> flowConstraint(flowModes);
+        TCLAP::ValueArg<string> flowArg("", "flow", "Flow control the firmware or bridge supports: none, rtscts or xonxoff. With flow control, lines stream up to " + toString(maxWindow) + " ahead of their \"ok\" and the link holds the sender back. The simulated printer never needs holding back. Defaults to none", false, "none", &flowConstraint, cmd);
+        TCLAP::SwitchArg iocpArg("", "iocp", "Drive the port through an I/O completion port instead of events", cmd, false);
+        TCLAP::ValueArg<string> benchArg("", "bench", string("Run a benchmark instead of sending: ") + benchmarkNames, false, "", "name", cmd);
+        TCLAP::ValueArg<unsigned> idleGapArg("", "idle-gap", "Smallest idle gap (ms) reported by --analyze; defaults to " + toString(defaultIdleGapMs), false, defaultIdleGapMs, "ms", cmd);
         cmd.parse(argc, argv);
 
-        shared_ptr<char> content;
-        size_t size;
-        readFile(fileArg.getValue(), content, size);
+        if(benchArg.isSet())
+        {
+            runBenchmark(benchArg.getValue());
+            return 0;
+        }
+
+        if(monitorArg.isSet())
+        {
+            monitorStatus(monitorArg.getValue(), 1000);
+            return 0;
+        }
+
+        if(analyzeArg.isSet())
+        {
+            analyzeCapture(analyzeArg.getValue(), idleGapArg.getValue());
+            return 0;
+        }
+
+        if(!fileArg.isSet())
+            throw TCLAP::CmdLineParseException("Required argument missing", "file");
+
+        MappedFile content(fileArg.getValue());
+        unique_ptr<CommandTableFile> tableFile;
+        if(isCommandTableFile(content))
+            tableFile.reset(new CommandTableFile(content));
+
+        // A table file is read in place; G-code is parsed into parsed
+        CommandTable parsed;
+        auto loadTable = [&]() -> CommandColumns {
+            if(tableFile)
+                return tableFile->columns();
+            buildCommandTable(content.begin(), content.end(), threadsArg.getValue(), parsed);
+            return parsed.columns();
+        };
+
+        PrinterModel printer;
+        printer.acceleration = simAccelArg.getValue();
+        printer.maxFeedrate = simFeedrateArg.getValue();
+
+        // What this printer has taken over commands in earlier jobs
+        unique_ptr<CostModel> costs;
+        if(costsArg.isSet())
+        {
+            costs.reset(new CostModel);
+            costs->load(costsArg.getValue());
+        }
+
+        if(statsArg.getValue())
+        {
+            uint64_t start = monotonicMicros();
+            CommandColumns table = loadTable();
+            double seconds = (monotonicMicros() - start) / 1000000.0;
+            printJobStats(table);
+            printf("%s %.1f MB in %.3f s\n", tableFile ? "loaded" : "parsed", content.getSize() / 1048576.0, seconds);
+            return 0;
+        }
+
+        if(estimateArg.getValue())
+        {
+            CommandColumns table = loadTable();
+            uint64_t start = monotonicMicros();
+            PrintEstimate estimate = estimatePrintTime(table, printer, simPlannerArg.getValue(), 0, costs.get());
+            double seconds = (monotonicMicros() - start) / 1000000.0;
+            printf("estimate: print time %s, %u moves (%.1f m)\n",
+                formatDuration(estimate.total).c_str(), estimate.moves, estimate.distance / 1000);
+            printf("  moving %s, heating %s, homing %s, dwelling %s\n",
+                formatDuration(estimate.moving).c_str(), formatDuration(estimate.heating).c_str(),
+                formatDuration(estimate.homing).c_str(), formatDuration(estimate.dwelling).c_str());
+            printf("estimated %u commands in %.3f s\n", (unsigned)table.size(), seconds);
+            return 0;
+        }
+
+        if(saveTableArg.isSet())
+        {
+            if(tableFile)
+                throw runtime_error(fileArg.getValue() + " is already a table file");
+            buildCommandTable(content.begin(), content.end(), threadsArg.getValue(), parsed);
+            uint64_t rounded = saveCommandTable(saveTableArg.getValue(), parsed, content.begin(), content.getSize());
+            printf("saved %u commands to %s\n", (unsigned)parsed.size(), saveTableArg.getValue().c_str());
+            if(rounded)
+                printf("%u commands have more decimal places than the table keeps for their letters; they are stored as text\n",
+                    (unsigned)rounded);
+            return 0;
+        }
+
+        unique_ptr<Clock> clock;
+        if(virtualClockArg.getValue() || simulateArg.getValue())
+            clock.reset(new VirtualClock);
+        else
+            clock.reset(new RealClock);
+
+        // Traffic (-v) and progress lines are printed from the log's thread
+        unique_ptr<TrafficLog> log;
+        if(verboseArg.getValue() || progressArg.getValue())
+            log.reset(new TrafficLog);
+
+        unique_ptr<SessionCapture> capture;
+        if(captureArg.isSet())
+            capture.reset(new SessionCapture(*clock, captureArg.getValue()));
+
+        FlowControl flow = flowNone;
+        if(flowArg.getValue() == "rtscts")
+            flow = flowRtsCts;
+        else if(flowArg.getValue() == "xonxoff")
+            flow = flowXonXoff;
 
-        GCodeSender sender(portArg.getValue().c_str(), bpsArg.getValue(), &*content, &*content + size, verboseArg.getValue());
+        TransportFactory transportFactory;
+        // Dispatches everything; must outlive the transport
+        unique_ptr<Reactor> reactor;
+        IocpReactor* iocp = 0;
+        if(iocpArg.getValue())
+        {
+            // A virtual clock's session stalls when nothing is signaled; a completion port only
+            // hears of signals through the thread pool, so it can't tell that apart from a delay
+            if(virtualClockArg.getValue() || simulateArg.getValue())
+                throw runtime_error("--iocp can't be used with a virtual clock");
+            reactor.reset(iocp = new IocpReactor);
+        }
+        else
+            reactor.reset(new WaitReactor);
+
+        vector<CaptureRecord> replayRecords;
+        ReplayTransport* replay = 0;
+        SimulatedPrinter* simulator = 0;
+        if(simulateArg.getValue())
+        {
+            SimulatorConfig config;
+            config.bps = bpsArg.getValue();
+            config.plannerDepth = simPlannerArg.getValue();
+            config.parseTimeUs = simParseArg.getValue();
+            config.printer = printer;
+            transportFactory = [&, config](LineHandler receivedLine, StatusWriter statusWriter) -> unique_ptr<Transport> {
+                simulator = new SimulatedPrinter(*clock, config, receivedLine, statusWriter);
+                return unique_ptr<Transport>(simulator);
+            };
+        }
+        else if(replayArg.isSet())
+        {
+            readCapture(replayArg.getValue(), replayRecords);
+            double speed = replaySpeedArg.getValue();
+            transportFactory = [&](LineHandler receivedLine, StatusWriter statusWriter) -> unique_ptr<Transport> {
+                replay = new ReplayTransport(*clock, replayRecords, speed, receivedLine, statusWriter);
+                return unique_ptr<Transport>(replay);
+            };
+        }
+        else
+        {
+            transportFactory = portFactory(portArg.getValue(), bpsArg.getValue(), iocp, flow);
+        }
+
+        // A journal left by a run which didn't finish holds its position
+        JournalPosition journalPosition;
+        uint64_t jobHash = journalArg.isSet() ? journalHash(content.begin(), content.end()) : 0;
+        bool unfinished = journalArg.isSet() && readJournal(journalArg.getValue(), content.getSize(), jobHash, journalPosition) &&
+            !journalPosition.done && journalPosition.any;
+        if(unfinished && !resumeJournalArg.getValue())
+            throw runtime_error("the last run of this job stopped after line " + toString(journalPosition.sourceLine) +
+                "; use --resume-journal to continue from there, or delete " + journalArg.getValue() + " to start over");
+        if(resumeJournalArg.getValue() && !unfinished)
+            throw runtime_error("there is no unfinished job to resume in the journal");
 
-        const std::vector<Event>& events = sender.getEvents();
-        shared_ptr<HANDLE> eventHandles(new HANDLE[events.size()], [](HANDLE* p){delete[] p;});
-        for(size_t i = 0; i < events.size(); ++i)
-            (&*eventHandles)[i] = get<0>(events[i]);
+        CommandColumns table;
+        bool resume = resumeLineArg.isSet() || resumeLayerArg.isSet() || unfinished;
+        bool wantProgress = progressArg.getValue() || m73Arg.getValue() || statusArg.isSet();
+        if(wantProgress || resume || journalArg.isSet())
+            table = loadTable();
+
+        unique_ptr<TelemetryRing> telemetry;
+        if(temperatureArg.getValue())
+            telemetry.reset(new TelemetryRing);
+
+        // Progress comes from the estimated finish time of each command
+        unique_ptr<JobProgress> progress;
+        if(wantProgress)
+        {
+            vector<float> finishTimes;
+            PrintEstimate estimate = estimatePrintTime(table, printer, simPlannerArg.getValue(), &finishTimes, costs.get());
+            printf("estimated print time %s\n", formatDuration(estimate.total).c_str());
+            progress.reset(new JobProgress(*clock, move(finishTimes), progressArg.getValue(), log.get(), telemetry.get()));
+        }
+
+        // Layers, and the state before any command
+        unique_ptr<JobIndex> index;
+        if(resume || statusArg.isSet())
+            index.reset(new JobIndex(table));
+
+        // The state the skipped commands would have left goes in a preamble
+        size_t firstCommand = 0;
+        ModalState state;
+        vector<string> preamble;
+        if(unfinished)
+        {
+            firstCommand = (size_t)journalPosition.index + 1;
+            state = journalPosition.state;
+        }
+        else if(resume)
+        {
+            if(resumeLayerArg.isSet())
+            {
+                unsigned layer = resumeLayerArg.getValue();
+                if(layer < 1 || layer > index->getLayers())
+                    throw runtime_error("the file has layers 1 to " + toString((unsigned)index->getLayers()));
+                firstCommand = index->getLayerStart(layer - 1);
+            }
+            else
+                firstCommand = index->findLine(resumeLineArg.getValue());
+            state = index->getStateBefore(firstCommand);
+        }
+        if(resume)
+        {
+            if(firstCommand >= table.size())
+                throw runtime_error("nothing left to send");
+            state.appendRestore(preamble);
+            printf("resuming at line %u, Z %.3f\n", table.sourceLines[firstCommand], state.position[2]);
+        }
+
+        // Written at most once a second
+        unique_ptr<ProgressJournal> journal;
+        if(journalArg.isSet())
+            journal.reset(new ProgressJournal(journalArg.getValue(), table, content.getSize(), jobHash, firstCommand, state, 1000));
+
+        uint64_t start = clock->now();
+        SenderOptions options;
+        options.log = verboseArg.getValue() ? log.get() : 0;
+        options.capture = capture.get();
+        options.timeoutMs = timeoutArg.getValue();
+        bool networkPort = !simulateArg.getValue() && !replayArg.isSet() && isNetworkPort(portArg.getValue());
+        if(networkPort && !options.timeoutMs)
+            options.timeoutMs = networkTimeoutMs;
+        options.progress = progress.get();
+        options.journal = journal.get();
+        options.sendM73 = m73Arg.getValue();
+        options.temperatureMs = temperatureArg.getValue();
+        options.telemetry = telemetry.get();
+        options.preamble = preamble;
+        options.firstIndex = firstCommand;
+        options.state = state;
+        if(onResetArg.getValue() == "recover")
+            options.onReset = resetRecover;
+        else if(onResetArg.getValue() == "continue")
+            options.onReset = resetContinue;
+        if(flow != flowNone)
+            options.window = maxWindow;
+        options.costs = costs.get();
+        unique_ptr<LineSource> source;
+        if(tableFile)
+            source.reset(new TableLineSource(*tableFile));
+        else
+            source.reset(new TextLineSource(content.begin(), content.end()));
+        if(resume)
+            source->seek(table, firstCommand);
+        GCodeSender sender(*clock, transportFactory, move(source), options);
+
+        unique_ptr<StatusSegment> status;
+        if(statusArg.isSet())
+            status.reset(new StatusSegment(statusArg.getValue(), *clock, sender, table.size(), progress.get(), telemetry.get(), index.get(), 100));
+
+        // Ctrl+C is an emergency stop
+        emergencyEvent = CreateEvent(0, false, false, 0);
+        if(!emergencyEvent)
+            throw runtime_error("CreateEvent failed");
+        shared_ptr<void> emergencyEventCloser(emergencyEvent, CloseHandle);
+        SetConsoleCtrlHandler(onConsoleCtrl, true);
+
+        // Operator commands go ahead of the rest of the job
+        unique_ptr<OperatorConsole> console;
+        if(consoleArg.getValue() || consolePipeArg.isSet())
+            console.reset(new OperatorConsole(
+                [&](const string& text, LineHandler reply){
+                    string code;
+                    uint16_t opcode;
+                    try
+                    {
+                        code = operatorCode(text, opcode);
+                    }
+                    catch(exception& e)
+                    {
+                        string msg = string("error: ") + e.what();
+                        reply(msg.data(), msg.data() + msg.size());
+                        return;
+                    }
+                    if(opcode == (opcodeM | 112))
+                    {
+                        sender.emergencyStop();
+                        static const char msg[] = "emergency stop sent";
+                        reply(msg, msg + sizeof(msg) - 1);
+                    }
+                    else
+                        sender.sendPriority(code, reply);
+                },
+                consoleArg.getValue(),
+                consolePipeArg.getValue()));
+
+        vector<Event> events = sender.getEvents();
+        if(console)
+            events.insert(events.end(), console->getEvents().begin(), console->getEvents().end());
+        events.push_back(Event(emergencyEvent, [&](){
+            sender.emergencyStop();
+            printf("emergency stop sent\n");
+        }));
+        events.insert(events.end(), clock->getEvents().begin(), clock->getEvents().end());
+        bool isVirtual = virtualClockArg.getValue() || simulateArg.getValue();
+        reactor->add(events);
+        runReactor(*reactor, [&](){return sender.getDone() || (replay && replay->getFinished());}, isVirtual);
+        SetConsoleCtrlHandler(onConsoleCtrl, false);
+
+        // The rest of the traffic goes before the summary; nothing more is sent
+        log.reset();
+        if(status)
+            status->publish(sender.getStopped() ? statusStopped : statusDone);
+        if(journal)
+        {
+            // An emergency stop leaves the job to be resumed
+            if(sender.getDone() && !sender.getStopped())
+                journal->done();
+            if(journal->getFailed())
+                printf("warning: journal: %s\n", journal->getError().c_str());
+        }
+
+        if(capture)
+        {
+            capture->close();
+            if(capture->getFailed())
+                printf("warning: capture: %s; the capture is incomplete\n", capture->getError().c_str());
+            else if(capture->getDropped())
+                printf("warning: capture: %u records dropped\n", capture->getDropped());
+        }
+
+        if(costs)
+        {
+            costs->save(costsArg.getValue());
+            printf("costs: learned from %u answers, saved to %s\n", costs->getRecorded(), costsArg.getValue().c_str());
+        }
 
-        while(!sender.getDone())
+        if(simulator)
         {
-            DWORD result = WaitForMultipleObjectsEx(events.size(), &*eventHandles, false, INFINITE, true);
-            if(result == WAIT_FAILED)
-                throw runtime_error("wait failed");
-            else if(result < events.size())
-                get<1>(events[result])();
+            const SimulatorStats& stats = simulator->getStats();
+            printf("simulated: print time %s, %u lines (%u bytes), %u resends requested, planner starved %.1f s%s\n",
+                formatDuration((stats.finishTime - start) / 1000000.0).c_str(), stats.linesReceived,
+                (unsigned)stats.bytesReceived, stats.resendsRequested, stats.starvedTime / 1000000.0,
+                stats.halted ? ", halted" : "");
         }
+        if(replay)
+            printf("replay: %u frames sent, %u differed from the capture, %.3f s\n",
+                (unsigned)replay->getSent(), replay->getMismatches(), (clock->now() - start) / 1000000.0);
 
         return 0;
     }
     catch(TCLAP::ArgException &e)
     {
-        printf("error: %s for arg %s\n", e.error(), e.argId());
+        printf("error: %s for arg %s\n", e.error().c_str(), e.argId().c_str());
         return 1;
     }
     catch(exception& e)
@@ -0,0 +1,137 @@
+// send-gcode - sends gcode commands to RepRap 5D firmware
+// Copyright 2010  Todd Fleming
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. 
+
+#pragma once
+
+// C interface to libsendgcode, for driving printers from another program without
+// launching send-gcode for every job.
+//
+// An engine owns a clock and a reactor. Any number of jobs share it, and everything runs
+// on the thread that calls sg_engine_step(). Functions which can fail return 0 or -1 and
+// leave a message for sg_last_error(); nothing is ever thrown across the interface. A job
+// whose port or firmware fails while the engine runs it ends with sg_job_state.failed set;
+// the engine and other jobs carry on.
+// Callbacks must not destroy jobs or the engine.
+
+#include <stddef.h>
+
+#ifdef SENDGCODE_EXPORTS
+#define SENDGCODE_API __declspec(dllexport)
+#else
+#define SENDGCODE_API __declspec(dllimport)
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct sg_engine sg_engine;
+typedef struct sg_job sg_job;
+
+// A line of text without line terminators; not zero-terminated
+typedef void (*sg_line_fn)(void* context, const char* line, size_t length);
+
+// Temperatures from one report by the firmware
+typedef struct sg_temperature
+{
+    unsigned long long time_us;                 // When it arrived, on the engine's clock
+    double hotend;                              // Degrees C
+    double hotend_target;                       // 0 if off or not reported
+    double bed;                                 // Only valid if has_bed
+    double bed_target;
+    int has_bed;
+} sg_temperature;
+
+typedef void (*sg_temperature_fn)(void* context, const sg_temperature* report);
+
+// Values of sg_job_options.flow_control. With flow control, lines stream ahead of their "ok"
+// and the link holds the sender back.
+#define SG_FLOW_NONE 0
+#define SG_FLOW_RTSCTS 1
+#define SG_FLOW_XONXOFF 2
+
+typedef struct sg_job_options
+{
+    unsigned bps;                               // Port speed; 0 for 19200
+    unsigned timeout_ms;                        // Probe with M105 if the firmware is silent this long; 0 waits forever,
+                                                // except on a tcp: port, which uses 5000
+    unsigned temperature_ms;                    // Poll temperatures this often, between lines; 0 never
+    sg_line_fn on_status;                       // Warnings and notices; may be null
+    sg_temperature_fn on_temperature;           // Every temperature report, called from sg_engine_step(); may be null
+    void* context;                              // Passed to the callbacks
+    int flow_control;                           // SG_FLOW_*; what the firmware or bridge supports
+} sg_job_options;
+
+typedef struct sg_job_state
+{
+    int done;                                   // Every line has been sent and acknowledged, or the job was stopped or
+                                                // failed. After a stop, not until the M112 has been written, so the job
+                                                // can be destroyed then without losing it
+    int stopped;                                // Ended by sg_job_emergency_stop()
+    int failed;                                 // Ended by a failure, e.g. the port going away
+    const char* error;                          // Why it failed; empty if it didn't. Valid until the job is destroyed
+    unsigned long long position;                // Commands of the job the firmware has accepted
+    unsigned frames_sent;                       // Including resent frames
+    unsigned long long bytes_sent;
+    unsigned resend_requests;
+    unsigned timeouts;
+} sg_job_state;
+
+// Message for the last failure on this thread
+SENDGCODE_API const char* sg_last_error(void);
+
+// Create an engine; with completion_port set, ports are driven through an I/O completion
+// port rather than events, which scales to many printers. Returns 0 on failure.
+SENDGCODE_API sg_engine* sg_engine_create(int completion_port);
+
+// Destroy an engine and any jobs still on it
+SENDGCODE_API void sg_engine_destroy(sg_engine* engine);
+
+// Run whatever is ready, waiting up to timeout_ms for something (0xffffffff waits for ever).
+// Returns the number of things run, 0 if nothing was ready in time, or -1 if the engine
+// itself failed. A failure of one job only ends that job; see sg_job_state.failed.
+SENDGCODE_API int sg_engine_step(sg_engine* engine, unsigned timeout_ms);
+
+// Handles a caller with its own wait loop can wait on before calling sg_engine_step(engine, 0).
+// A completion-port engine has none, since it waits for everything on the port itself; its
+// caller steps it with a timeout instead. The array changes when jobs start and end.
+SENDGCODE_API void* const* sg_engine_handles(sg_engine* engine, size_t* count);
+
+// Open port (e.g. COM3, or tcp:host:port for a network serial bridge) and start sending code, which is G-code text of size bytes. The
+// text isn't copied: it may be any memory, e.g. a mapped file, and must stay unchanged until
+// the job is destroyed. options may be null for the defaults. Returns 0 on failure.
+SENDGCODE_API sg_job* sg_job_start(sg_engine* engine, const char* port, const char* code, size_t size, const sg_job_options* options);
+
+// Close the port and forget the job
+SENDGCODE_API void sg_job_destroy(sg_job* job);
+
+// Fill in state
+SENDGCODE_API void sg_job_get_state(sg_job* job, sg_job_state* state);
+
+// Send a command of length bytes ahead of the rest of the job. Comments, N words and checksums
+// are removed; M112 is an emergency stop, as sg_job_emergency_stop(). Lines from the firmware
+// up to and including its "ok" also go to reply, if it isn't null. Returns -1 on failure,
+// including a command which isn't a line of G-code.
+SENDGCODE_API int sg_job_send_priority(sg_job* job, const char* command, size_t length, sg_line_fn reply, void* context);
+
+// Send M112 ahead of anything queued and stop the job. Keep stepping the engine until
+// sg_job_state.done before destroying the job, or the M112 may not go out. Returns -1 on failure.
+SENDGCODE_API int sg_job_emergency_stop(sg_job* job);
+
+#ifdef __cplusplus
+}
+#endif